@@ -1,9 +1,12 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <rtbc.h>
 
 static void f_init(void);
+static void f_exit(void);
 
 static void f_global(const char *name);
 static void f_const(const_t value);
@@ -14,13 +17,24 @@ static void f_exit_routine(void);
 
 static void f_load_const(const_t value);
 static void f_load_local(int width, int offset);
+static void f_load_global(const char *name);
+static void f_store_local(int width, int offset);
 static void f_push(int width);
 static void f_pull(int width);
 static void f_call(int offset);
+static void f_tail_call(const char *name, int offset);
+
+static void f_keep_local(int reg, int offset);
+static void f_load_reg(int reg);
+static void f_store_reg(int reg);
 
 static void f_zero_extend(int new_width, int old_width);
 static void f_sign_extend(int new_width, int old_width);
 
+static void f_op(int op, int width, int is_signed, int is_swapped);
+static void f_op_const(int op, int width, int is_signed, uint64_t value);
+static int  f_op_kills(int op, int width, int is_const);
+
 static int  f_next(void);
 static void f_label(int label);
 
@@ -30,7 +44,18 @@ static void f_jump_nz(int width, int label);
 static void f_jump_p(int width, int label);
 static void f_jump_np(int width, int label);
 
-static int label_count = 0;
+static _Thread_local int label_count = 0; // Routines can get generated by several threads at once.
+
+static const char *kept_names[] = {"esi", "edi", "ebx", "ecx"}; // Of registers locals get kept in.
+
+// Helpers used since f_init(), for f_exit() to emit. Shared by every thread generating routines, as f_exit()
+// only comes once all of them are done (see pool_t).
+static _Atomic int helper_mask = 0;
+
+enum {
+  helper_div_u64 = 1, // Divides edx:eax by ebx:ecx, quotient in edx:eax and remainder in ebx:ecx.
+  helper_div_s64 = 2, // Same, signed (rounding towards zero), through __DIV_U64.
+};
 
 const arch_t arch_x86 = (arch_t){
   .name = "x86",
@@ -40,36 +65,1145 @@ const arch_t arch_x86 = (arch_t){
   
   .is_big = 0,
   
-  f_init,
+  .arg_offset = 8, // Return address, then the caller's ebp (see f_call()).
+  .reg_count = 4,  // esi and edi, which nothing else uses (helpers save them), then ebx and ecx (see f_op_kills()).
+  
+  .reg_min_width = 2, // Bytes do not fit in esi or edi, and get loaded better from memory.
+  
+  f_init,
+  f_exit,
+  
+  f_global,
+  f_const,
+  f_data,
+  
+  f_init_routine,
+  f_exit_routine,
+  
+  f_load_const,
+  f_load_local,
+  f_load_global,
+  f_store_local,
+  f_push,
+  f_pull,
+  f_call,
+  f_tail_call,
+  
+  f_keep_local,
+  f_load_reg,
+  f_store_reg,
+  
+  f_zero_extend,
+  f_sign_extend,
+  
+  f_op,
+  f_op_const,
+  f_op_kills,
+  
+  f_next,
+  f_label,
+  
+  f_jump,
+  f_jump_z,
+  f_jump_nz,
+  f_jump_p,
+  f_jump_np,
+};
+
+// Routine code gets buffered one instruction at a time (see f_emit()), for f_peep() to go over before
+// f_exit_routine() prints it. Instructions are kept as the text they get printed as, split into operands.
+
+#define PEEP_INSTS  128 // Routines up to this long get buffered without allocating anything.
+#define PEEP_WINDOW 32  // How many instructions rules look through for what they need.
+
+typedef struct x86_inst_t x86_inst_t;
+typedef struct x86_use_t x86_use_t;
+typedef struct peep_rule_t peep_rule_t;
+
+struct x86_inst_t {
+  int op; // One of x86_*, x86_label for labels (named by args[0]).
+  char name[8];
+  
+  char args[3][32];
+  int arg_count;
+  
+  int arg_regs[3];   // Registers each operand names, memory operands included.
+  int arg_widths[3]; // Of each operand that is a register, 0 otherwise.
+  
+  int is_removed;
+  int pass; // Last pass of f_peep() to go over it, for being near a change.
+};
+
+struct x86_use_t {
+  int reads, changes, kills; // Registers read, written to, and written to whole without being read.
+  int is_barrier;            // Labels and jumps, past which only reg_acc and kept_regs hold anything.
+};
+
+struct peep_rule_t {
+  const char *name;
+  int (*f_apply)(int index); // Returns how many instructions it removed, 0 if it did not match.
+};
+
+enum {
+  x86_label,
+  
+  x86_mov,
+  x86_movzx,
+  x86_movsx,
+  x86_lea,
+  x86_push,
+  x86_pop,
+  
+  x86_add,
+  x86_sub,
+  x86_and,
+  x86_or,
+  x86_xor,
+  x86_adc,
+  x86_sbb,
+  x86_shl,
+  x86_shr,
+  x86_sar,
+  x86_shld,
+  x86_shrd,
+  x86_neg,
+  x86_not,
+  x86_inc,
+  x86_dec,
+  x86_xchg,
+  
+  x86_imul,
+  x86_mul,
+  x86_div,
+  x86_idiv,
+  x86_cdq,
+  x86_test,
+  x86_cmp,
+  
+  x86_call,
+  x86_ret,
+  x86_jmp,
+  x86_jz,
+  x86_jnz,
+  x86_jl,
+  x86_jge,
+  x86_jc,
+  x86_jnc,
+  
+  x86_other,
+};
+
+static const char *x86_names[] = {
+  "",
+  "mov", "movzx", "movsx", "lea", "push", "pop",
+  "add", "sub", "and", "or", "xor", "adc", "sbb", "shl", "shr", "sar", "shld", "shrd", "neg", "not", "inc", "dec", "xchg",
+  "imul", "mul", "div", "idiv", "cdq", "test", "cmp",
+  "call", "ret", "jmp", "jz", "jnz", "jl", "jge", "jc", "jnc",
+};
+
+#define X86(op) (((uint64_t)(1)) << x86_##op) // For f_peep_is().
+
+#define X86_JUMPS (X86(jmp) | X86(jz) | X86(jnz) | X86(jl) | X86(jge) | X86(jc) | X86(jnc))
+
+enum {
+  reg_eax = 1,
+  reg_ecx = 2,
+  reg_edx = 4,
+  reg_ebx = 8,
+  reg_esi = 16,
+  reg_edi = 32,
+  
+  reg_all = 63,
+  reg_acc = reg_eax | reg_edx, // All that gets past a block, along with kept_regs.
+};
+
+static const int kept_masks[] = {reg_esi, reg_edi, reg_ebx, reg_ecx}; // Of kept_names.
+static _Thread_local int kept_regs = 0; // Those the current routine keeps locals in.
+
+static const char *reg_names[][3] = {
+  {"eax", "ax", "al"},
+  {"ecx", "cx", "cl"},
+  {"edx", "dx", "dl"},
+  {"ebx", "bx", "bl"},
+  {"esi", "si", NULL},
+  {"edi", "di", NULL},
+};
+
+static _Thread_local x86_inst_t inst_buffer[PEEP_INSTS];
+
+static _Thread_local x86_inst_t *insts = NULL;
+static _Thread_local int inst_count = 0, inst_capacity = 0;
+static _Thread_local int is_buffered = 0;
+
+// Returns the register name is (as a mask) along with its width, 0 if it is not one.
+
+static int f_peep_reg_name(const char *name, int length, int *width) {
+  for (int i = 0; i < 6; i++) {
+    for (int j = 0; j < 3; j++) {
+      if (reg_names[i][j] && !strncmp(name, reg_names[i][j], length) && !reg_names[i][j][length]) {
+        *width = 4 >> j;
+        return 1 << i;
+      }
+    }
+  }
+  
+  return 0;
+}
+
+// Sets operand index of inst to text (length characters of it), noting which registers it names.
+
+static void f_peep_set(x86_inst_t *inst, int index, const char *text, int length) {
+  char *arg = inst->args[index];
+  
+  if (length >= (int)(sizeof(inst->args[0]))) {
+    length = sizeof(inst->args[0]) - 1;
+  }
+  
+  memmove(arg, text, length);
+  arg[length] = '\0';
+  
+  inst->arg_regs[index] = 0;
+  inst->arg_widths[index] = 0;
+  
+  if (inst->arg_count <= index) {
+    inst->arg_count = index + 1;
+  }
+  
+  for (int i = 0; arg[i];) {
+    int word_length = strspn(arg + i, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.$");
+    int width = 0;
+    
+    if (word_length >= 2 && word_length <= 3) {
+      int reg = f_peep_reg_name(arg + i, word_length, &width);
+      inst->arg_regs[index] |= reg;
+      
+      if (reg && word_length == length) {
+        inst->arg_widths[index] = width;
+      }
+    }
+    
+    i += (word_length ? word_length : 1);
+  }
+}
+
+static void f_peep_arg(x86_inst_t *inst, int index, const char *format, ...) {
+  char arg[sizeof(inst->args[0])];
+  va_list args;
+  
+  va_start(args, format);
+  vsnprintf(arg, sizeof(arg), format, args);
+  va_end(args);
+  
+  f_peep_set(inst, index, arg, strlen(arg));
+}
+
+static void f_peep_op(x86_inst_t *inst, int op) {
+  inst->op = op;
+  strcpy(inst->name, x86_names[op]);
+}
+
+static void f_emit(const char *format, ...) {
+  char line[128];
+  va_list args;
+  
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  
+  if (!is_buffered) {
+    f_print("%s", line);
+    return;
+  }
+  
+  if (inst_count == inst_capacity) {
+    x86_inst_t *new_insts = realloc(insts == inst_buffer ? NULL : insts, inst_capacity * 2 * sizeof(x86_inst_t));
+    
+    if (!new_insts) {
+      f_error("Out of memory (requested %zu bytes).\n", inst_capacity * 2 * sizeof(x86_inst_t));
+    }
+    
+    if (insts == inst_buffer) {
+      memcpy(new_insts, inst_buffer, sizeof(inst_buffer));
+    }
+    
+    insts = new_insts;
+    inst_capacity *= 2;
+  }
+  
+  x86_inst_t *inst = insts + inst_count++;
+  
+  *inst = (x86_inst_t){
+    .op = x86_label,
+    .name = "",
+    
+    .args = {"", "", ""},
+    .arg_count = 0,
+    
+    .arg_regs = {0, 0, 0},
+    .arg_widths = {0, 0, 0},
+    
+    .is_removed = 0,
+    .pass = 0,
+  };
+  
+  char *text = line + strspn(line, " ");
+  int length = strcspn(text, "\n");
+  
+  if (length && text[length - 1] == ':') {
+    f_peep_set(inst, 0, text, length - 1);
+    return;
+  }
+  
+  text[length] = '\0';
+  length = strcspn(text, " ");
+  
+  inst->op = x86_other;
+  
+  for (int i = 1; i < x86_other; i++) {
+    if (!strncmp(text, x86_names[i], length) && !x86_names[i][length]) {
+      inst->op = i;
+      break;
+    }
+  }
+  
+  memcpy(inst->name, text, length < 7 ? length : 7);
+  inst->name[length < 7 ? length : 7] = '\0';
+  
+  for (text += length; *text && inst->arg_count < 3;) {
+    text += strspn(text, " ,");
+    
+    const char *comma = strstr(text, ", ");
+    length = (comma ? comma - text : (int)(strlen(text)));
+    
+    f_peep_set(inst, inst->arg_count, text, length);
+    text += length;
+  }
+}
+
+static int f_peep_is(const x86_inst_t *inst, uint64_t ops) {
+  return (ops >> inst->op) & 1;
+}
+
+// Returns the register operand index of inst is (as a mask) along with its width, 0 if it is not one.
+
+static int f_peep_reg(const x86_inst_t *inst, int index, int *width) {
+  if (width) {
+    *width = inst->arg_widths[index];
+  }
+  
+  return (inst->arg_widths[index] ? inst->arg_regs[index] : 0);
+}
+
+static int f_peep_number(const char *arg, uint64_t *value) {
+  if (arg[0] < '0' || arg[0] > '9') {
+    return 0;
+  }
+  
+  char *end;
+  *value = strtoull(arg, &end, 0);
+  
+  return !*end;
+}
+
+// Whether inst writes to memory, its destination being sized ("dword [ebp + 8]") or not.
+
+static int f_peep_is_store(const x86_inst_t *inst) {
+  return (strchr(inst->args[0], '[') && !f_peep_is(inst, X86(push) | X86(test) | X86(cmp)));
+}
+
+static x86_use_t f_peep_use(const x86_inst_t *inst) {
+  x86_use_t use = (x86_use_t){
+    .reads = inst->arg_regs[0] | inst->arg_regs[1] | inst->arg_regs[2],
+    .changes = 0,
+    .kills = 0,
+    
+    .is_barrier = 0,
+  };
+  
+  int width = 0;
+  int dest = f_peep_reg(inst, 0, &width);
+  
+  int is_cleared = (f_peep_is(inst, X86(xor) | X86(sub)) && dest && !strcmp(inst->args[0], inst->args[1]));
+  
+  if (f_peep_is(inst, X86(label) | X86(ret) | X86_JUMPS)) {
+    use.is_barrier = 1;
+  } else if (f_peep_is(inst, X86(mov) | X86(movzx) | X86(movsx) | X86(lea) | X86(pop)) ||
+             (f_peep_is(inst, X86(imul)) && inst->arg_count == 3) || is_cleared) {
+    use.changes = dest;
+    
+    // Only partly written to registers keep the rest of what they had.
+    
+    if (width == 4) {
+      use.kills = dest;
+      use.reads = (is_cleared ? 0 : inst->arg_regs[1] | inst->arg_regs[2]);
+    }
+  } else if (f_peep_is(inst, X86(cdq))) {
+    use.reads = reg_eax;
+    use.changes = use.kills = reg_edx;
+  } else if (f_peep_is(inst, X86(mul) | X86(imul) | X86(div) | X86(idiv))) {
+    use.reads |= reg_eax | (f_peep_is(inst, X86(div) | X86(idiv)) ? reg_edx : 0);
+    use.changes = use.kills = reg_eax | reg_edx;
+  } else if (f_peep_is(inst, X86(call))) {
+    // Helpers take whatever they like.
+    
+    if (!strncmp(inst->args[0], "__", 2)) {
+      use.reads = reg_all;
+    }
+    
+    use.changes = use.kills = reg_all;
+  } else if (f_peep_is(inst, X86(xchg))) {
+    use.changes = use.reads;
+  } else if (!f_peep_is(inst, X86(push) | X86(test) | X86(cmp))) {
+    use.changes = dest;
+  }
+  
+  if (f_peep_is(inst, X86(other))) {
+    use.reads = use.changes = reg_all;
+    use.is_barrier = 1;
+  }
+  
+  return use;
+}
+
+static int f_peep_next(int index) {
+  do {
+    index++;
+  } while (index < inst_count && insts[index].is_removed);
+  
+  return index;
+}
+
+static int f_peep_prev(int index) {
+  do {
+    index--;
+  } while (index >= 0 && insts[index].is_removed);
+  
+  return index;
+}
+
+// Whether nothing reads the registers in mask from index on, before writing them whole.
+
+static int f_peep_is_dead(int index, int mask) {
+  for (int count = 0; index < inst_count && count < PEEP_WINDOW; index = f_peep_next(index), count++) {
+    x86_use_t use = f_peep_use(insts + index);
+    
+    if (use.reads & mask) {
+      return 0;
+    } else if (f_peep_is(insts + index, X86(ret))) {
+      return !(mask & reg_acc); // Callers only get the accumulator back.
+    } else if (f_peep_is(insts + index, X86(jmp)) && strncmp(insts[index].args[0], ".SUB_", 5)) {
+      return 1; // Tail calls, which only take what is in memory.
+    } else if (use.is_barrier) {
+      return !(mask & (reg_acc | kept_regs));
+    }
+    
+    mask &= ~use.kills;
+    
+    if (!mask) {
+      return 1;
+    }
+  }
+  
+  return 0;
+}
+
+// Values pushed only to get popped a few instructions later, with nothing else touching the stack, can just
+// stay in a register (or go straight to the one they get popped to).
+
+static int f_peep_push_pop(int index) {
+  const int spares[] = {reg_ebx, reg_ecx, reg_edx};
+  const char *spare_names[] = {"ebx", "ecx", "edx"};
+  
+  x86_inst_t *push = insts + index;
+  
+  if (!f_peep_is(push, X86(push))) {
+    return 0;
+  }
+  
+  const char *value = push->args[0] + (strncmp(push->args[0], "dword ", 6) ? 0 : 6);
+  
+  int width = 0;
+  int reg = f_peep_reg(push, 0, &width);
+  
+  int is_memory = (value[0] == '[');
+  
+  if ((reg && width != 4) || (!reg && (push->arg_regs[0] || strstr(value, "esp") || !strcmp(value, "ebp")))) {
+    return 0;
+  }
+  
+  int reads = 0, changes = 0; // Of whatever is in between.
+  int is_stored = 0;
+  
+  for (int i = f_peep_next(index), count = 0; i < inst_count && count < PEEP_WINDOW; i = f_peep_next(i), count++) {
+    x86_inst_t *inst = insts + i;
+    
+    if (f_peep_is(inst, X86(pop))) {
+      int other_width = 0;
+      int other = f_peep_reg(inst, 0, &other_width);
+      
+      if (!other || other_width != 4) {
+        return 0;
+      }
+      
+      int is_changed = ((changes & reg) || (is_memory && is_stored));
+      
+      if (other == reg && !is_changed) {
+        push->is_removed = 1;
+        inst->is_removed = 1;
+        
+        return 2;
+      } else if (!is_changed) {
+        f_peep_op(inst, x86_mov);
+        f_peep_arg(inst, 1, "%s", value);
+        
+        push->is_removed = 1;
+        return 1;
+      } else if (!((reads | changes) & other)) {
+        f_peep_op(push, x86_mov);
+        f_peep_arg(push, 1, "%s", value);
+        f_peep_arg(push, 0, "%s", inst->args[0]);
+        
+        inst->is_removed = 1;
+        return 1;
+      }
+      
+      // Otherwise it can still wait in any scratch register nothing in between touches, for f_peep_operand()
+      // to use from there. Nothing gets removed yet, so this does not count.
+      
+      for (int j = 0; j < (int)(sizeof(spares) / sizeof(spares[0])); j++) {
+        if (((reads | changes) & spares[j]) || !f_peep_is_dead(f_peep_next(i), spares[j])) {
+          continue;
+        }
+        
+        f_peep_op(push, x86_mov);
+        f_peep_arg(push, 1, "%s", value);
+        f_peep_arg(push, 0, "%s", spare_names[j]);
+        
+        f_peep_op(inst, x86_mov);
+        f_peep_arg(inst, 1, "%s", spare_names[j]);
+        
+        return 0;
+      }
+      
+      return 0;
+    }
+    
+    x86_use_t use = f_peep_use(inst);
+    
+    if (use.is_barrier || f_peep_is(inst, X86(push) | X86(call)) || strstr(inst->args[0], "esp") ||
+        strstr(inst->args[1], "esp")) {
+      return 0;
+    }
+    
+    reads |= use.reads;
+    changes |= use.changes;
+    is_stored |= f_peep_is_store(inst);
+  }
+  
+  return 0;
+}
+
+// Registers written to and never read before being written to again.
+
+static int f_peep_dead(int index) {
+  x86_inst_t *inst = insts + index;
+  int width = 0;
+  
+  int reg = (f_peep_is(inst, X86(mov) | X86(movzx) | X86(movsx) | X86(lea)) ? f_peep_reg(inst, 0, &width) : 0);
+  
+  if (!reg || width != 4) {
+    return 0;
+  }
+  
+  if (!strcmp(inst->args[0], inst->args[1]) || f_peep_is_dead(f_peep_next(index), reg)) {
+    inst->is_removed = 1;
+    return 1;
+  }
+  
+  return 0;
+}
+
+// Loads of what a register was just stored to memory from.
+
+static int f_peep_reload(int index) {
+  x86_inst_t *inst = insts + index;
+  int width = 0;
+  
+  int reg = (f_peep_is(inst, X86(mov)) ? f_peep_reg(inst, 0, &width) : 0);
+  
+  if (!reg || width != 4 || inst->args[1][0] != '[') {
+    return 0;
+  }
+  
+  int mask = reg | inst->arg_regs[1];
+  
+  for (int i = f_peep_prev(index), count = 0; i >= 0 && count < PEEP_WINDOW; i = f_peep_prev(i), count++) {
+    x86_inst_t *other = insts + i;
+    
+    if (f_peep_is(other, X86(mov)) && !strcmp(other->args[0], inst->args[1]) && !strcmp(other->args[1], inst->args[0])) {
+      inst->is_removed = 1;
+      return 1;
+    }
+    
+    x86_use_t use = f_peep_use(other);
+    
+    if (use.is_barrier || (use.changes & mask) || f_peep_is_store(other) || f_peep_is(other, X86(call))) {
+      return 0;
+    }
+  }
+  
+  return 0;
+}
+
+// Jumps to right past themselves, and conditional ones over a jump (which can go wherever that one goes,
+// the other way around).
+
+static int f_peep_jump(int index) {
+  const int inverses[][2] = {{x86_jz, x86_jnz}, {x86_jl, x86_jge}, {x86_jc, x86_jnc}};
+  x86_inst_t *inst = insts + index;
+  
+  if (!f_peep_is(inst, X86_JUMPS)) {
+    return 0;
+  }
+  
+  int next = f_peep_next(index);
+  
+  for (int i = next; i < inst_count && f_peep_is(insts + i, X86(label)); i = f_peep_next(i)) {
+    if (!strcmp(insts[i].args[0], inst->args[0])) {
+      inst->is_removed = 1;
+      return 1;
+    }
+  }
+  
+  if (next >= inst_count || !f_peep_is(insts + next, X86(jmp)) || f_peep_is(inst, X86(jmp))) {
+    return 0;
+  }
+  
+  for (int i = f_peep_next(next); i < inst_count && f_peep_is(insts + i, X86(label)); i = f_peep_next(i)) {
+    if (strcmp(insts[i].args[0], inst->args[0])) {
+      continue;
+    }
+    
+    for (int j = 0; j < (int)(sizeof(inverses) / sizeof(inverses[0])); j++) {
+      if (inst->op == inverses[j][0] || inst->op == inverses[j][1]) {
+        f_peep_op(inst, inverses[j][inst->op == inverses[j][0]]);
+        f_peep_arg(inst, 0, "%s", insts[next].args[0]);
+        
+        insts[next].is_removed = 1;
+        return 1;
+      }
+    }
+  }
+  
+  return 0;
+}
+
+// Whatever comes right past a jump that is always taken (or a ret), before any label, never runs.
+
+static int f_peep_unreachable(int index) {
+  int count = 0;
+  
+  if (!f_peep_is(insts + index, X86(jmp) | X86(ret))) {
+    return 0;
+  }
+  
+  for (int i = f_peep_next(index); i < inst_count && !f_peep_is(insts + i, X86(label)); i = f_peep_next(i)) {
+    insts[i].is_removed = 1;
+    count++;
+  }
+  
+  return count;
+}
+
+// Returns how many of the low bits of eax are all there is to it after inst, the rest being cleared (in
+// zero_bits) or copies of the top one of those (in sign_bits), 32 meaning none.
+
+static void f_peep_bits(const x86_inst_t *inst, int *zero_bits, int *sign_bits) {
+  uint64_t value = 0;
+  
+  *zero_bits = 32;
+  *sign_bits = 32;
+  
+  if (f_peep_reg(inst, 0, NULL) != reg_eax || inst->arg_widths[0] != 4) {
+    return;
+  }
+  
+  if (f_peep_is(inst, X86(movzx) | X86(movsx))) {
+    int width = inst->arg_widths[1];
+    
+    if (!width) {
+      width = (strncmp(inst->args[1], "byte ", 5) ? strncmp(inst->args[1], "word ", 5) ? 4 : 2 : 1);
+    }
+    
+    *(f_peep_is(inst, X86(movzx)) ? zero_bits : sign_bits) = width * 8;
+  } else if (f_peep_is(inst, X86(xor) | X86(sub)) && !strcmp(inst->args[1], "eax")) {
+    *zero_bits = *sign_bits = 8;
+  } else if (f_peep_is(inst, X86(mov)) && f_peep_number(inst->args[1], &value)) {
+    *zero_bits = (value <= 0xFF ? 8 : value <= 0xFFFF ? 16 : 32);
+    *sign_bits = ((int32_t)(value) == (int8_t)(value) ? 8 : (int32_t)(value) == (int16_t)(value) ? 16 : 32);
+  } else if (f_peep_is(inst, X86(and)) && f_peep_number(inst->args[1], &value)) {
+    *zero_bits = (value <= 0xFF ? 8 : value <= 0xFFFF ? 16 : 32);
+  } else if (f_peep_is(inst, X86(shr) | X86(sar)) && f_peep_number(inst->args[1], &value) && value < 32) {
+    *(f_peep_is(inst, X86(shr)) ? zero_bits : sign_bits) = 32 - (int)(value);
+  }
+}
+
+// Extending what already is (from whatever last wrote to eax), or what can just get loaded extended.
+
+static int f_peep_extend(int index) {
+  x86_inst_t *inst = insts + index;
+  int new_width = 0, old_width = 0;
+  
+  if (!f_peep_is(inst, X86(movzx) | X86(movsx)) || f_peep_reg(inst, 0, &new_width) != reg_eax ||
+      f_peep_reg(inst, 1, &old_width) != reg_eax) {
+    return 0;
+  }
+  
+  int is_signed = f_peep_is(inst, X86(movsx));
+  int reads = 0;
+  
+  for (int i = f_peep_prev(index), count = 0; i >= 0 && count < PEEP_WINDOW; i = f_peep_prev(i), count++) {
+    x86_inst_t *other = insts + i;
+    x86_use_t use = f_peep_use(other);
+    
+    if (use.is_barrier) {
+      return 0;
+    } else if (!(use.changes & reg_eax)) {
+      reads |= use.reads;
+      continue;
+    }
+    
+    int zero_bits, sign_bits;
+    f_peep_bits(other, &zero_bits, &sign_bits);
+    
+    if ((is_signed ? sign_bits : zero_bits) <= old_width * 8) {
+      inst->is_removed = 1;
+      return 1;
+    }
+    
+    int other_width = 0;
+    uint64_t value;
+    
+    if (reads & reg_eax || !f_peep_is(other, X86(mov)) || f_peep_reg(other, 0, &other_width) != reg_eax) {
+      return 0;
+    }
+    
+    // Locals only get read whole, their low bits can get read on their own instead.
+    
+    if (other_width == 4 && other->args[1][0] == '[' && !other->arg_regs[1]) {
+      f_peep_op(other, inst->op);
+      
+      f_peep_arg(other, 1, "%s %s", old_width == 1 ? "byte" : "word", other->args[1]);
+      f_peep_arg(other, 0, "%s", inst->args[0]);
+      
+      inst->is_removed = 1;
+      return 1;
+    }
+    
+    // Same for kept ones, as long as there is a name for those bits (which is not the case for bytes).
+    
+    int source_width = 0;
+    int source = f_peep_reg(other, 1, &source_width);
+    
+    if (other_width == 4 && source_width == 4) {
+      for (int j = 0; j < 6; j++) {
+        if (source != (1 << j) || !reg_names[j][old_width == 1 ? 2 : 1]) {
+          continue;
+        }
+        
+        f_peep_op(other, inst->op);
+        
+        f_peep_arg(other, 1, "%s", reg_names[j][old_width == 1 ? 2 : 1]);
+        f_peep_arg(other, 0, "%s", inst->args[0]);
+        
+        inst->is_removed = 1;
+        return 1;
+      }
+    }
+    
+    if (other_width != old_width || !f_peep_number(other->args[1], &value)) {
+      return 0;
+    }
+    
+    if (is_signed && (value >> (old_width * 8 - 1)) & 1) {
+      value |= (~((uint64_t)(0))) << (old_width * 8);
+    }
+    
+    if (new_width == 4) {
+      f_peep_arg(other, 0, "eax");
+      f_peep_arg(other, 1, "0x%08X", (uint32_t)(value));
+    } else {
+      f_peep_arg(other, 0, "ax");
+      f_peep_arg(other, 1, "0x%04X", (uint32_t)(value) & 0xFFFF);
+    }
+    
+    inst->is_removed = 1;
+    return 1;
+  }
+  
+  return 0;
+}
+
+// Constants (and locals, kept or not) loaded into a register only for the next instruction reading it to
+// use, which can take them as an operand itself.
+
+static int f_peep_operand(int index) {
+  x86_inst_t *inst = insts + index;
+  int width = 0;
+  
+  int reg = (f_peep_is(inst, X86(mov)) ? f_peep_reg(inst, 0, &width) : 0);
+  const char *value = inst->args[1];
+  
+  int value_width = 0;
+  int is_reg = (f_peep_reg(inst, 1, &value_width) && value_width == 4);
+  
+  int is_memory = (value[0] == '[');
+  uint64_t number;
+  
+  if (!reg || width != 4 || (inst->arg_regs[1] && !is_reg) || (!is_memory && strchr(value, '['))) {
+    return 0;
+  }
+  
+  int i = f_peep_next(index);
+  
+  for (int count = 0;; i = f_peep_next(i), count++) {
+    if (i >= inst_count || count >= PEEP_WINDOW) {
+      return 0;
+    }
+    
+    x86_use_t use = f_peep_use(insts + i);
+    
+    if (use.reads & reg) {
+      break;
+    } else if (use.is_barrier || (use.changes & (reg | inst->arg_regs[1])) ||
+               (is_memory && (f_peep_is_store(insts + i) || f_peep_is(insts + i, X86(call))))) {
+      return 0;
+    }
+  }
+  
+  x86_inst_t *other = insts + i;
+  
+  int other_width = 0;
+  int other_reg = (other->arg_count ? f_peep_reg(other, other->arg_count - 1, &other_width) : 0);
+  
+  if (other_reg != reg || (other->arg_count > 1 && (other->arg_regs[0] & reg))) {
+    return 0;
+  } else if (!(f_peep_use(other).kills & reg) && !f_peep_is_dead(f_peep_next(i), reg)) {
+    return 0;
+  }
+  
+  int is_dest_memory = (strchr(other->args[0], '[') != NULL); // Stored to or not (cmp, test).
+  
+  if (other->arg_count == 1 && f_peep_is(other, X86(push)) && other_width == 4) {
+    f_peep_arg(other, 0, is_reg ? "%s" : "dword %s", value);
+  } else if (other->arg_count == 1 && f_peep_is(other, X86(call)) && !is_memory && !f_peep_number(value, &number)) {
+    f_peep_arg(other, 0, "%s", value);
+  } else if (other->arg_count != 2) {
+    return 0;
+  } else if (f_peep_is(other, X86(mov)) && is_dest_memory && !is_memory && other_width < 4 &&
+             f_peep_number(value, &number)) {
+    f_peep_arg(other, 0, "%s %s", other_width == 1 ? "byte" : "word", other->args[0]);
+    f_peep_arg(other, 1, other_width == 1 ? "0x%02X" : "0x%04X", (uint32_t)(number) & (other_width == 1 ? 0xFF : 0xFFFF));
+  } else if (other_width != 4) {
+    return 0;
+  } else if (f_peep_is(other, X86(mov)) && is_dest_memory && !is_memory) {
+    f_peep_arg(other, 0, is_reg ? "%s" : "dword %s", other->args[0]);
+    f_peep_arg(other, 1, "%s", value);
+  } else if (is_dest_memory) {
+    return 0;
+  } else if (f_peep_is(other, X86(imul)) && !is_memory && !is_reg) {
+    f_peep_arg(other, 2, "%s", value);
+    f_peep_arg(other, 1, "%s", other->args[0]);
+  } else if (f_peep_is(other, X86(mov) | X86(add) | X86(sub) | X86(and) | X86(or) | X86(xor) | X86(adc) | X86(sbb) |
+                              X86(cmp) | X86(imul))) {
+    f_peep_arg(other, 1, "%s", value);
+  } else {
+    return 0;
+  }
+  
+  inst->is_removed = 1;
+  return 1;
+}
+
+// Copies made only to compute something the other way around (left operands come last, see ir.c), which
+// commutes anyway.
+
+static int f_peep_commute(int index) {
+  x86_inst_t *copy = insts + index;
+  int width = 0, other_width = 0;
+  
+  int reg = (f_peep_is(copy, X86(mov)) ? f_peep_reg(copy, 1, &width) : 0);
+  int other = (reg ? f_peep_reg(copy, 0, &other_width) : 0);
+  
+  int load = f_peep_next(index);
+  int op = (load < inst_count ? f_peep_next(load) : inst_count);
+  
+  if (!other || width != 4 || other_width != 4 || op >= inst_count) {
+    return 0;
+  }
+  
+  x86_inst_t *load_inst = insts + load, *op_inst = insts + op;
+  
+  if (!f_peep_is(load_inst, X86(mov)) || strcmp(load_inst->args[0], copy->args[1]) ||
+      (load_inst->arg_regs[1] & (reg | other))) {
+    return 0;
+  } else if (!f_peep_is(op_inst, X86(add) | X86(and) | X86(or) | X86(xor) | X86(imul)) || op_inst->arg_count != 2 ||
+             strcmp(op_inst->args[0], copy->args[1]) || strcmp(op_inst->args[1], copy->args[0])) {
+    return 0;
+  } else if (!f_peep_is_dead(f_peep_next(op), other)) {
+    return 0;
+  }
+  
+  const char *value = load_inst->args[1];
+  
+  if (f_peep_is(op_inst, X86(imul)) && value[0] != '[' && !load_inst->arg_widths[1]) {
+    f_peep_arg(op_inst, 2, "%s", value);
+    f_peep_arg(op_inst, 1, "%s", op_inst->args[0]);
+  } else {
+    f_peep_arg(op_inst, 1, "%s", value);
+  }
+  
+  copy->is_removed = 1;
+  load_inst->is_removed = 1;
+  
+  return 2;
+}
+
+static const peep_rule_t peep_rules[] = {
+  {"push/pop", f_peep_push_pop},
+  {"dead mov", f_peep_dead},
+  {"reload", f_peep_reload},
+  {"jump", f_peep_jump},
+  {"unreachable", f_peep_unreachable},
+  {"extend", f_peep_extend},
+  {"operand", f_peep_operand},
+  {"commute", f_peep_commute},
+};
+
+#define PEEP_RULE_COUNT ((int)(sizeof(peep_rules) / sizeof(peep_rule_t)))
+
+// Instructions each rule removed since f_init(), over every thread (only counted when debugging).
+static _Atomic int peep_counts[PEEP_RULE_COUNT];
+
+// Drops labels nothing jumps to, which would only keep rules from looking past them.
+
+static int f_peep_labels(void) {
+  if (!label_count) {
+    return 0;
+  }
+  
+  int *refs = calloc(label_count, sizeof(int));
+  int is_changed = 0;
+  
+  for (int i = 0; i < inst_count; i++) {
+    int label = (strncmp(insts[i].args[0], ".SUB_", 5) ? -1 : atoi(insts[i].args[0] + 5));
+    
+    if (!insts[i].is_removed && f_peep_is(insts + i, X86_JUMPS) && label >= 0 && label < label_count) {
+      refs[label]++;
+    }
+  }
+  
+  for (int i = 0; i < inst_count; i++) {
+    int label = (strncmp(insts[i].args[0], ".SUB_", 5) ? -1 : atoi(insts[i].args[0] + 5));
+    
+    if (!insts[i].is_removed && f_peep_is(insts + i, X86(label)) && label >= 0 && label < label_count && !refs[label]) {
+      insts[i].is_removed = 1;
+      is_changed = 1;
+    }
+  }
+  
+  free(refs);
+  return is_changed;
+}
+
+// Rules look PEEP_WINDOW instructions back and up to twice that ahead (through f_peep_is_dead()), and change
+// up to PEEP_WINDOW away, so that only instructions this close to a change can have anything new to do in the
+// next pass, or the rest of this one.
+
+static void f_peep_near(int index, int pass) {
+  insts[index].pass = pass;
+  
+  for (int i = f_peep_prev(index), count = 0; i >= 0 && count < PEEP_WINDOW * 3; i = f_peep_prev(i), count++) {
+    insts[i].pass = pass;
+  }
+  
+  for (int i = f_peep_next(index), count = 0; i < inst_count && count < PEEP_WINDOW * 3; i = f_peep_next(i), count++) {
+    insts[i].pass = pass;
+  }
+}
+
+static void f_peep(void) {
+  int counts[PEEP_RULE_COUNT] = {0};
+  
+  for (int pass = 0, is_changed = 1; is_changed; pass++) {
+    int is_dropped = f_peep_labels(); // Which changes what every jump goes past, so all of them get another go.
+    is_changed = is_dropped;
+    
+    for (int i = 0; i < inst_count; i++) {
+      if (!is_dropped && insts[i].pass < pass) {
+        continue;
+      }
+      
+      for (int j = 0; j < PEEP_RULE_COUNT && !insts[i].is_removed; j++) {
+        int count = peep_rules[j].f_apply(i);
+        
+        if (count > 0) {
+          f_peep_near(i, pass + 1);
+        }
+        
+        counts[j] += count;
+        is_changed |= (count > 0);
+      }
+    }
+    
+    int count = 0;
+    
+    for (int i = 0; i < inst_count; i++) {
+      if (!insts[i].is_removed) {
+        insts[count++] = insts[i];
+      }
+    }
+    
+    inst_count = count;
+  }
   
-  f_global,
-  f_const,
-  f_data,
+  for (int i = 0; i < PEEP_RULE_COUNT && f_do_debug; i++) {
+    if (counts[i]) {
+      peep_counts[i] += counts[i];
+    }
+  }
+}
+
+void f_init(void) {
+  label_count = 0;
+  helper_mask = 0;
   
-  f_init_routine,
-  f_exit_routine,
+  for (int i = 0; i < PEEP_RULE_COUNT; i++) {
+    peep_counts[i] = 0;
+  }
   
-  f_load_const,
-  f_load_local,
-  f_push,
-  f_pull,
-  f_call,
+  f_print("[bits 32]\n");
+}
+
+static const char *helper_div_u64_text =
+  // Divisors that fit in 32 bits take two divisions, each giving 32 bits of the quotient.
+  "  push esi\n"
+  "  push edi\n"
+  "  test ebx, ebx\n"
+  "  jnz .LARGE\n"
+  "  mov esi, eax\n"
+  "  mov eax, edx\n"
+  "  xor edx, edx\n"
+  "  div ecx\n"
+  "  mov edi, eax\n"
+  "  mov eax, esi\n"
+  "  div ecx\n"
+  "  mov ecx, edx\n"
+  "  mov edx, edi\n"
+  "  pop edi\n"
+  "  pop esi\n"
+  "  ret\n"
+  // Larger ones give quotients that fit in 32 bits, which one division by their top 32 bits gets right or one
+  // too small (Hacker's Delight, 9-5).
+  ".LARGE:\n"
+  "  push ebx\n"
+  "  push ecx\n"
+  "  push edx\n"
+  "  push eax\n"
+  "  bsr ecx, ebx\n"
+  "  mov esi, [esp + 8]\n"
+  "  shrd esi, ebx, cl\n"
+  "  mov edi, ebx\n"
+  "  shr edi, cl\n"
+  "  shrd esi, edi, 1\n"
+  "  shrd eax, edx, 1\n"
+  "  shr edx, 1\n"
+  "  div esi\n"
+  "  shr eax, cl\n"
+  "  sub eax, 1\n"
+  "  adc eax, 0\n"
+  "  mov edi, eax\n"
+  "  mul dword [esp + 8]\n"
+  "  mov ecx, eax\n"
+  "  mov esi, edx\n"
+  "  mov eax, edi\n"
+  "  mul dword [esp + 12]\n"
+  "  add esi, eax\n"
+  "  mov eax, [esp]\n"
+  "  mov edx, [esp + 4]\n"
+  "  sub eax, ecx\n"
+  "  sbb edx, esi\n"
+  "  mov ecx, eax\n"
+  "  mov ebx, edx\n"
+  "  sub ecx, [esp + 8]\n"
+  "  sbb ebx, [esp + 12]\n"
+  "  jc .SMALL\n"
+  "  inc edi\n"
+  "  jmp .DONE\n"
+  ".SMALL:\n"
+  "  mov ecx, eax\n"
+  "  mov ebx, edx\n"
+  ".DONE:\n"
+  "  mov eax, edi\n"
+  "  xor edx, edx\n"
+  "  add esp, 16\n"
+  "  pop edi\n"
+  "  pop esi\n"
+  "  ret\n";
+
+static const char *helper_div_s64_text =
+  // Divides the absolute values, then negates the quotient if the signs differ, and the remainder if the
+  // dividend was negative (esi bits 0 and 1).
+  "  push esi\n"
+  "  xor esi, esi\n"
+  "  test edx, edx\n"
+  "  jns .DIVIDEND\n"
+  "  neg edx\n"
+  "  neg eax\n"
+  "  sbb edx, 0\n"
+  "  mov esi, 3\n"
+  ".DIVIDEND:\n"
+  "  test ebx, ebx\n"
+  "  jns .DIVISOR\n"
+  "  neg ebx\n"
+  "  neg ecx\n"
+  "  sbb ebx, 0\n"
+  "  xor esi, 1\n"
+  ".DIVISOR:\n"
+  "  call __DIV_U64\n"
+  "  test esi, 1\n"
+  "  jz .QUOTIENT\n"
+  "  neg edx\n"
+  "  neg eax\n"
+  "  sbb edx, 0\n"
+  ".QUOTIENT:\n"
+  "  test esi, 2\n"
+  "  jz .REMAINDER\n"
+  "  neg ebx\n"
+  "  neg ecx\n"
+  "  sbb ebx, 0\n"
+  ".REMAINDER:\n"
+  "  pop esi\n"
+  "  ret\n";
   
-  f_zero_extend,
-  f_sign_extend,
+static void f_exit(void) {
+  if (f_do_debug) {
+    f_debug("Peephole removed");
+    
+    for (int i = 0; i < PEEP_RULE_COUNT; i++) {
+      f_debug(" %d (%s)%s", (int)(peep_counts[i]), peep_rules[i].name, i < PEEP_RULE_COUNT - 1 ? "," : " instructions.\n");
+    }
+  }
   
-  f_next,
-  f_label,
+  if (helper_mask & helper_div_s64) {
+    f_global("__DIV_S64");
+    f_print("%s", helper_div_s64_text);
+  }
   
-  f_jump,
-  f_jump_z,
-  f_jump_nz,
-  f_jump_p,
-  f_jump_np,
-};
-
-void f_init(void) {
-  printf("[bits 32]\n");
+  if (helper_mask & (helper_div_u64 | helper_div_s64)) {
+    f_global("__DIV_U64");
+    f_print("%s", helper_div_u64_text);
+  }
 }
 
 static int f_next(void) {
@@ -77,13 +1211,13 @@ static int f_next(void) {
 }
 
 static void f_global(const char *name) {
-  printf("\nglobal %s\n\n", name);
-  printf("%s:\n", name);
+  f_print("\nglobal %s\n\n", name);
+  f_print("%s:\n", name);
 }
 
 static void f_const(const_t value) {
   if (value.is_data) {
-    printf("  dd (DATA + %d)\n", value.offset);
+    f_print("  dd (DATA + %d)\n", value.offset);
   } else {
     int width = value.type.base_width;
     
@@ -92,48 +1226,87 @@ static void f_const(const_t value) {
     }
     
     if (width == 1) {
-      printf("  db 0x%02X\n", value.ux & 0xFF);
+      f_print("  db 0x%02X\n", value.ux & 0xFF);
     } else if (width <= 2) {
-      printf("  dw 0x%04X\n", value.ux & 0xFFFF);
+      f_print("  dw 0x%04X\n", value.ux & 0xFFFF);
     } else if (width <= 4) {
-      printf("  dd 0x%08X\n", value.ux & 0xFFFFFFFF);
+      f_print("  dd 0x%08X\n", value.ux & 0xFFFFFFFF);
     } else if (width <= 8) {
-      printf("  dq 0x%016X\n", value.ux);
+      f_print("  dq 0x%016X\n", value.ux);
     }
   }
 }
 
 static void f_data(const void *data, int length) {
   const uint8_t *data_u8 = (const uint8_t *)(data);
-  printf("  db ");
+  f_print("  db ");
   
   for (int i = 0; i < length; i++) {
     if (i) {
-      printf(", ");
+      f_print(", ");
     }
     
-    printf("0x%02X", data_u8[i]);
+    f_print("0x%02X", data_u8[i]);
   }
   
-  putchar('\n');
+  f_print("\n");
 }
 
 static void f_init_routine(int offset) {
-  printf("  mov ebp, esp\n");
+  label_count = 0;
+  kept_regs = 0;
+  is_buffered = 1;
+  
+  if (insts != inst_buffer) {
+    free(insts); // Left over from a routine that failed halfway, if anything.
+  }
+  
+  insts = inst_buffer;
+  inst_count = 0;
+  inst_capacity = PEEP_INSTS;
+  
+  f_emit("  mov ebp, esp\n");
   
   if (offset) {
-    printf("  sub esp, %d\n", offset);
+    f_emit("  sub esp, %d\n", offset);
   }
 }
 
 static void f_exit_routine(void) {
-  printf("  mov esp, ebp\n");
-  printf("  ret\n");
+  f_emit("  mov esp, ebp\n");
+  f_emit("  ret\n");
+  
+  f_peep();
+  is_buffered = 0;
+  
+  for (int i = 0; i < inst_count; i++) {
+    const x86_inst_t *inst = insts + i;
+    
+    if (inst->op == x86_label) {
+      f_print("%s:\n", inst->args[0]);
+    } else if (inst->arg_count == 3) {
+      f_print("  %s %s, %s, %s\n", inst->name, inst->args[0], inst->args[1], inst->args[2]);
+    } else if (inst->arg_count == 2) {
+      f_print("  %s %s, %s\n", inst->name, inst->args[0], inst->args[1]);
+    } else if (inst->arg_count == 1) {
+      f_print("  %s %s\n", inst->name, inst->args[0]);
+    } else {
+      f_print("  %s\n", inst->name);
+    }
+  }
+  
+  if (insts != inst_buffer) {
+    free(insts);
+  }
+  
+  insts = NULL;
+  inst_count = 0;
+  inst_capacity = 0;
 }
 
 static void f_load_const(const_t value) {
   if (value.is_data) {
-    printf("  mov eax, (DATA + %d)\n", value.offset);
+    f_emit("  mov eax, (DATA + %d)\n", value.offset);
   } else {
     int width = value.type.base_width;
     
@@ -142,24 +1315,37 @@ static void f_load_const(const_t value) {
     }
     
     if (width == 1) {
-      printf("  mov al, 0x%02X\n", value.ux & 0xFF);
+      f_emit("  mov al, 0x%02X\n", value.ux & 0xFF);
     } else if (width <= 2) {
-      printf("  mov ax, 0x%04X\n", value.ux & 0xFFFF);
+      f_emit("  mov ax, 0x%04X\n", value.ux & 0xFFFF);
     } else if (width <= 4) {
-      printf("  mov eax, 0x%08X\n", value.ux & 0xFFFFFFFF);
+      f_emit("  mov eax, 0x%08X\n", value.ux & 0xFFFFFFFF);
     } else if (width <= 8) {
-      printf("  mov edx, 0x%08X\n", (value.ux >> 32) & 0xFFFFFFFF);
-      printf("  mov eax, 0x%08X\n", value.ux & 0xFFFFFFFF);
+      f_emit("  mov edx, 0x%08X\n", (value.ux >> 32) & 0xFFFFFFFF);
+      f_emit("  mov eax, 0x%08X\n", value.ux & 0xFFFFFFFF);
     }
   }
 }
 
 static void f_load_local(int width, int offset) {
   width = (width + 3) / 4;
-  printf("  mov eax, [ebp + %d]\n", offset);
+  f_emit("  mov eax, [ebp + %d]\n", offset);
   
   if (width > 1) {
-    printf("  mov edx, [ebp + %d]\n", offset + 4);
+    f_emit("  mov edx, [ebp + %d]\n", offset + 4);
+  }
+}
+
+static void f_load_global(const char *name) {
+  f_emit("  mov eax, %s\n", name);
+}
+
+static void f_store_local(int width, int offset) {
+  const char *names[] = {"al", "ax", "eax", "eax"};
+  f_emit("  mov [ebp + %d], %s\n", offset, names[(width < 4 ? width : 4) - 1]);
+  
+  if (width > 4) {
+    f_emit("  mov [ebp + %d], edx\n", offset + 4);
   }
 }
 
@@ -167,140 +1353,607 @@ static void f_push(int width) {
   width = (width + 3) / 4;
   
   if (width > 1) {
-    printf("  push edx\n");
+    f_emit("  push edx\n");
   }
   
-  printf("  push eax\n");
+  f_emit("  push eax\n");
 }
 
 static void f_pull(int width) {
   width = (width + 3) / 4;
-  printf("  pop eax\n");
+  f_emit("  pop eax\n");
   
   if (width > 1) {
-    printf("  pop edx\n");
+    f_emit("  pop edx\n");
   }
 }
 
 static void f_call(int offset) {
-  printf("  push ebp\n");
-  printf("  call eax\n");
-  printf("  pop ebp\n");
-  printf("  add esp, %d\n", offset);
+  f_emit("  push ebp\n");
+  f_emit("  call eax\n");
+  f_emit("  pop ebp\n");
+  
+  if (offset) {
+    f_emit("  add esp, %d\n", offset);
+  }
+}
+
+// Arguments get pulled into place last one first, that being the one at the lowest address in both frames.
+// The return address and the caller's ebp stay where they are, for the callee to go back to our caller.
+
+static void f_tail_call(const char *name, int offset) {
+  for (int i = 0; i < offset; i += 4) {
+    f_emit("  pop edx\n");
+    f_emit("  mov [ebp + %d], edx\n", arch_x86.arg_offset + i);
+  }
+  
+  f_emit("  mov esp, ebp\n");
+  f_emit("  jmp %s\n", name);
+}
+
+static void f_keep_local(int reg, int offset) {
+  kept_regs |= kept_masks[reg];
+  f_emit("  mov %s, [ebp + %d]\n", kept_names[reg], offset);
+}
+
+static void f_load_reg(int reg) {
+  f_emit("  mov eax, %s\n", kept_names[reg]);
+}
+
+static void f_store_reg(int reg) {
+  kept_regs |= kept_masks[reg];
+  f_emit("  mov %s, eax\n", kept_names[reg]);
 }
 
 static void f_zero_extend(int new_width, int old_width) {
   const char *names[] = {"al", "ax", "eax", "eax"};
   
-  if (new_width < old_width) {
+  if (new_width <= old_width) {
     return;
   }
   
   if (new_width > 4 && old_width <= 4) {
-    printf("  xor edx, edx\n");
-    printf("  movzx eax, %s\n", names[old_width - 1]);
+    f_emit("  xor edx, edx\n");
+    
+    if (old_width < 4) {
+      f_emit("  movzx eax, %s\n", names[old_width - 1]);
+    }
   } else {
-    printf("  movzx %s, %s\n", names[new_width - 1], names[old_width - 1]);
+    f_emit("  movzx %s, %s\n", names[new_width - 1], names[old_width - 1]);
   }
 }
 
 static void f_sign_extend(int new_width, int old_width) {
   const char *names[] = {"al", "ax", "eax", "eax"};
   
-  if (new_width < old_width) {
+  if (new_width <= old_width) {
     return;
   }
   
   if (new_width > 4 && old_width <= 4) {
-    printf("  mov edx, 0xFFFFFFFF\n");
-    printf("  movsx eax, %s\n", names[old_width - 1]);
-    printf("  cmp eax, 0x80000000\n");
-    printf("  adc edx, 0\n");
+    f_emit("  mov edx, 0xFFFFFFFF\n");
+    
+    if (old_width < 4) {
+      f_emit("  movsx eax, %s\n", names[old_width - 1]);
+    }
+    
+    f_emit("  cmp eax, 0x80000000\n");
+    f_emit("  adc edx, 0\n");
   } else {
-    printf("  movsx %s, %s\n", names[new_width - 1], names[old_width - 1]);
+    f_emit("  movsx %s, %s\n", names[new_width - 1], names[old_width - 1]);
   }
 }
 
-static void f_label(int label) {
-  printf("SUB_%d:\n", label);
-}
+// Operands narrower than 32 bits only have their low bits right, which is all most operators need. Division
+// needs them extended first.
 
-static void f_jump(int label) {
-  printf("  jmp SUB_%d\n", label);
+static void f_extend_32(const char *reg, const char **names, int width, int is_signed) {
+  if (width < 4) {
+    f_emit("  %s %s, %s\n", is_signed ? "movsx" : "movzx", reg, names[width - 1]);
+  }
 }
 
-static void f_jump_z(int width, int label) {
-  width = (width + 3) / 4;
+// The right operand goes in edx, which only division needs for itself (taking ecx instead).
+
+static void f_op(int op, int width, int is_signed, int is_swapped) {
+  const char *acc_names[] = {"al", "ax", "eax", "eax"};
+  const char *other_names[] = {"cl", "cx", "ecx", "ecx"};
+  const char *names[] = {"add", "sub", NULL, NULL, NULL, "and", "or", "xor"};
   
-  if (width > 1) {
-    int skip_label = f_next();
+  int is_commutative = (op != ir_sub && op != ir_div && op != ir_mod);
+  const char *other = (width > 4 || op == ir_div || op == ir_mod ? "ecx" : "edx");
+  
+  f_emit("  pop %s\n", other);
+  
+  if (width > 4) {
+    const char *high_names[] = {"adc", "sbb", NULL, NULL, NULL, "and", "or", "xor"};
+    f_emit("  pop ebx\n");
     
-    printf("  test edx, edx\n");
-    printf("  jnz SUB_%d\n", skip_label);
+    if (is_swapped && !is_commutative) {
+      f_emit("  xchg eax, ecx\n");
+      f_emit("  xchg edx, ebx\n");
+    }
     
-    f_jump_z(4, label);
-    f_label(skip_label);
+    if (op == ir_mul) {
+      f_emit("  imul edx, ecx\n");
+      f_emit("  imul ebx, eax\n");
+      f_emit("  add ebx, edx\n");
+      f_emit("  mul ecx\n");
+      f_emit("  add edx, ebx\n");
+    } else if (op == ir_div || op == ir_mod) {
+      helper_mask |= (is_signed ? helper_div_s64 : helper_div_u64);
+      f_emit("  call %s\n", is_signed ? "__DIV_S64" : "__DIV_U64");
+      
+      if (op == ir_mod) {
+        f_emit("  mov eax, ecx\n");
+        f_emit("  mov edx, ebx\n");
+      }
+    } else {
+      f_emit("  %s eax, ecx\n", names[op - ir_add]);
+      f_emit("  %s edx, ebx\n", high_names[op - ir_add]);
+    }
+    
+    return;
+  }
+  
+  if (is_swapped && op == ir_sub) {
+    f_emit("  sub edx, eax\n");
+    f_emit("  mov eax, edx\n");
     
     return;
+  } else if (is_swapped && !is_commutative) {
+    f_emit("  xchg eax, ecx\n");
   }
   
-  printf("  test eax, eax\n");
-  printf("  jz SUB_%d\n", label);
+  if (op == ir_mul) {
+    f_emit("  imul eax, edx\n");
+  } else if (op == ir_div || op == ir_mod) {
+    f_extend_32("eax", acc_names, width, is_signed);
+    f_extend_32("ecx", other_names, width, is_signed);
+    
+    f_emit(is_signed ? "  cdq\n" : "  xor edx, edx\n");
+    f_emit("  %s ecx\n", is_signed ? "idiv" : "div");
+    
+    if (op == ir_mod) {
+      f_emit("  mov eax, edx\n");
+    }
+  } else {
+    f_emit("  %s eax, %s\n", names[op - ir_add], other);
+  }
 }
 
-static void f_jump_nz(int width, int label) {
-  width = (width + 3) / 4;
+// Returns log2(value) if it is a power of two, -1 otherwise.
+
+static int f_log2(uint64_t value) {
+  if (!value || (value & (value - 1))) {
+    return -1;
+  }
   
-  if (width > 1) {
-    int skip_label = f_next();
+  int shift = 0;
+  
+  while (value > 1) {
+    value >>= 1;
+    shift++;
+  }
+  
+  return shift;
+}
+
+// Multiplies eax by value with shifts, lea and the like where that takes a few quick instructions (odd factors
+// of 3, 5 and 9 being one lea each), with imul otherwise.
+
+static void f_mul_32(uint32_t value) {
+  const uint32_t leas[] = {3, 5, 9};
+  
+  if (!value) {
+    f_emit("  xor eax, eax\n");
+    return;
+  }
+  
+  int shift = 0;
+  uint32_t odd = value;
+  
+  while (!(odd & 1)) {
+    odd >>= 1;
+    shift++;
+  }
+  
+  // One or two leas, negated afterwards if that is what it takes.
+  
+  for (int is_negated = 0; is_negated < 2; is_negated++) {
+    uint32_t factor = (is_negated ? -odd : odd);
+    
+    for (int i = 0; i < 4; i++) {
+      for (int j = 0; j < 4; j++) {
+        uint32_t lea_a = (i < 3 ? leas[i] : 1);
+        uint32_t lea_b = (j < 3 ? leas[j] : 1);
+        
+        if (i > j || lea_a * lea_b != factor) {
+          continue;
+        }
+        
+        if (i < 3) {
+          f_emit("  lea eax, [eax + eax * %d]\n", lea_a - 1);
+        }
+        
+        if (j < 3) {
+          f_emit("  lea eax, [eax + eax * %d]\n", lea_b - 1);
+        }
+        
+        if (is_negated) {
+          f_emit("  neg eax\n");
+        }
+        
+        if (shift) {
+          f_emit("  shl eax, %d\n", shift);
+        }
+        
+        return;
+      }
+    }
+  }
+  
+  // Then a shift and an add or subtract, for odd factors one away from a power of two.
+  
+  int log_above = f_log2((uint64_t)(odd) + 1);
+  int log_below = f_log2((uint64_t)(odd) - 1);
+  
+  if (!shift && ((log_above > 0 && log_above < 32) || log_below > 0)) {
+    f_emit("  mov edx, eax\n");
+    f_emit("  shl eax, %d\n", log_above > 0 ? log_above : log_below);
+    f_emit("  %s eax, edx\n", log_above > 0 ? "sub" : "add");
     
-    printf("  test edx, edx\n");
-    printf("  jz SUB_%d\n", skip_label);
+    return;
+  }
+  
+  f_emit("  imul eax, eax, 0x%08X\n", value);
+}
+
+// Unsigned division by a constant that is not a power of two, as a multiplication by its reciprocal scaled
+// up (Granlund and Montgomery): a 32-bit one if there is one that gets every dividend right, a 33-bit one
+// otherwise (its top bit being the add in the middle). Leaves the dividend in ebx if is_kept.
+
+static void f_div_u32(uint32_t value, int is_kept) {
+  int bits = 0; // Of value, rounded up.
+  
+  while (bits < 32 && (((uint64_t)(1)) << bits) < value) {
+    bits++;
+  }
+  
+  if (is_kept) {
+    f_emit("  mov ebx, eax\n");
+  }
+  
+  for (int shift = 0; shift < bits; shift++) {
+    uint64_t power = ((uint64_t)(1)) << (32 + shift);
+    uint64_t factor = (power + value - 1) / value;
     
-    f_jump_nz(4, label);
-    f_label(skip_label);
+    if (factor <= 0xFFFFFFFF && factor * value - power <= (((uint64_t)(1)) << shift)) {
+      f_emit("  mov edx, 0x%08X\n", (uint32_t)(factor));
+      f_emit("  mul edx\n");
+      f_emit("  mov eax, edx\n");
+      
+      if (shift) {
+        f_emit("  shr eax, %d\n", shift);
+      }
+      
+      return;
+    }
+  }
+  
+  uint64_t factor = ((((uint64_t)(1)) << 32) * ((((uint64_t)(1)) << bits) - value)) / value + 1;
+  
+  f_emit("  mov ecx, eax\n");
+  f_emit("  mov edx, 0x%08X\n", (uint32_t)(factor));
+  f_emit("  mul edx\n");
+  f_emit("  sub ecx, edx\n");
+  f_emit("  shr ecx, 1\n");
+  f_emit("  add ecx, edx\n");
+  f_emit("  shr ecx, %d\n", bits - 1);
+  f_emit("  mov eax, ecx\n");
+}
+
+// Same, signed, for divisors other than 0, 1, -1 and powers of two (negated or not), with the magic numbers
+// from Hacker's Delight (10-1).
+
+static void f_div_s32(int32_t value, int is_kept) {
+  uint32_t abs_value = (value < 0 ? -(uint32_t)(value) : (uint32_t)(value));
+  uint32_t t = 0x80000000 + ((uint32_t)(value) >> 31);
+  uint32_t abs_nc = t - 1 - t % abs_value;
+  
+  uint32_t q1 = 0x80000000 / abs_nc, r1 = 0x80000000 - q1 * abs_nc;
+  uint32_t q2 = 0x80000000 / abs_value, r2 = 0x80000000 - q2 * abs_value;
+  uint32_t delta;
+  
+  int p = 31;
+  
+  do {
+    p++;
+    
+    q1 *= 2;
+    r1 *= 2;
+    
+    if (r1 >= abs_nc) {
+      q1++;
+      r1 -= abs_nc;
+    }
+    
+    q2 *= 2;
+    r2 *= 2;
+    
+    if (r2 >= abs_value) {
+      q2++;
+      r2 -= abs_value;
+    }
+    
+    delta = abs_value - r2;
+  } while (q1 < delta || (q1 == delta && !r1));
+  
+  int32_t factor = (int32_t)(value < 0 ? -(q2 + 1) : q2 + 1);
+  
+  if (is_kept) {
+    f_emit("  mov ebx, eax\n");
+  }
+  
+  f_emit("  mov ecx, eax\n");
+  f_emit("  mov edx, 0x%08X\n", (uint32_t)(factor));
+  f_emit("  imul edx\n");
+  
+  if (value > 0 && factor < 0) {
+    f_emit("  add edx, ecx\n");
+  } else if (value < 0 && factor > 0) {
+    f_emit("  sub edx, ecx\n");
+  }
+  
+  if (p > 32) {
+    f_emit("  sar edx, %d\n", p - 32);
+  }
+  
+  f_emit("  mov eax, edx\n");
+  f_emit("  shr eax, 31\n");
+  f_emit("  add eax, edx\n");
+}
+
+// Divides (or takes the modulus of) eax by value, already cut to width and sign-extended if signed.
+
+static void f_div_const_32(int op, int width, int is_signed, int64_t value) {
+  const char *names[] = {"al", "ax", "eax", "eax"};
+  uint64_t abs_value = (value < 0 ? -(uint64_t)(value) : (uint64_t)(value));
+  
+  int shift = f_log2(is_signed ? abs_value : (uint64_t)(value));
+  
+  if (shift == 0) {
+    if (op == ir_mod) {
+      f_emit("  xor eax, eax\n");
+    } else if (value < 0) {
+      f_emit("  neg eax\n");
+    }
+    
+    return;
+  }
+  
+  if (!is_signed && shift > 0 && op == ir_mod) {
+    f_emit("  and eax, 0x%08X\n", (uint32_t)(value - 1));
+    return;
+  }
+  
+  f_extend_32("eax", names, width, is_signed);
+  
+  if (!is_signed && shift > 0) {
+    f_emit("  shr eax, %d\n", shift);
+    return;
+  }
+  
+  // Signed ones round towards zero, so negative dividends get a power of two minus one added first (its
+  // remainder being whatever is left of that, minus that again).
+  
+  if (shift > 0) {
+    f_emit("  cdq\n");
+    f_emit("  and edx, 0x%08X\n", (uint32_t)(abs_value - 1));
+    f_emit("  add eax, edx\n");
+    
+    if (op == ir_mod) {
+      f_emit("  and eax, 0x%08X\n", (uint32_t)(abs_value - 1));
+      f_emit("  sub eax, edx\n");
+    } else {
+      f_emit("  sar eax, %d\n", shift);
+      
+      if (value < 0) {
+        f_emit("  neg eax\n");
+      }
+    }
     
     return;
   }
   
-  printf("  test eax, eax\n");
-  printf("  jnz SUB_%d\n", label);
+  if (is_signed) {
+    f_div_s32((int32_t)(value), op == ir_mod);
+  } else {
+    f_div_u32((uint32_t)(value), op == ir_mod);
+  }
+  
+  if (op == ir_mod) {
+    f_emit("  imul eax, eax, 0x%08X\n", (uint32_t)(value));
+    f_emit("  sub ebx, eax\n");
+    f_emit("  mov eax, ebx\n");
+  }
 }
 
-static void f_jump_p(int width, int label) {
-  width = (width + 3) / 4;
+// 64-bit values only get shifts and masks for powers of two, anything else calls a helper (or multiplies
+// each half). No type is signed and 64 bits wide, but decimal literals are, so signed division and modulo
+// by anything but 1 go through the signed helper.
+
+static void f_op_const_64(int op, int is_signed, uint64_t value) {
+  uint32_t low = (uint32_t)(value), high = (uint32_t)(value >> 32);
+  int shift = f_log2(value);
   
-  if (width > 1) {
-    int skip_label = f_next();
+  if ((op == ir_div || op == ir_mod) && is_signed && value != 1) {
+    helper_mask |= helper_div_s64;
     
-    printf("  cmp edx, 0\n");
-    printf("  jl SUB_%d\n", skip_label);
+    f_emit("  mov ecx, 0x%08X\n", low);
+    f_emit("  mov ebx, 0x%08X\n", high);
+    f_emit("  call __DIV_S64\n");
     
-    f_jump_p(4, label);
-    f_label(skip_label);
+    if (op == ir_mod) {
+      f_emit("  mov eax, ecx\n");
+      f_emit("  mov edx, ebx\n");
+    }
+  } else if (op == ir_mul) {
+    if (shift >= 32) {
+      f_emit("  mov edx, eax\n");
+      f_emit("  xor eax, eax\n");
+      
+      if (shift > 32) {
+        f_emit("  shl edx, %d\n", shift - 32);
+      }
+    } else if (shift > 0) {
+      f_emit("  shld edx, eax, %d\n", shift);
+      f_emit("  shl eax, %d\n", shift);
+    } else if (!value) {
+      f_emit("  xor eax, eax\n");
+      f_emit("  xor edx, edx\n");
+    } else if (value > 1) {
+      f_emit("  imul ecx, edx, 0x%08X\n", low);
+      
+      if (high) {
+        f_emit("  imul ebx, eax, 0x%08X\n", high);
+        f_emit("  add ecx, ebx\n");
+      }
+      
+      f_emit("  mov edx, 0x%08X\n", low);
+      f_emit("  mul edx\n");
+      f_emit("  add edx, ecx\n");
+    }
+  } else if ((op == ir_div || op == ir_mod) && shift >= 0) {
+    if (op == ir_div && shift >= 32) {
+      f_emit("  mov eax, edx\n");
+      f_emit("  xor edx, edx\n");
+      
+      if (shift > 32) {
+        f_emit("  shr eax, %d\n", shift - 32);
+      }
+    } else if (op == ir_div && shift > 0) {
+      f_emit("  shrd eax, edx, %d\n", shift);
+      f_emit("  shr edx, %d\n", shift);
+    } else if (op == ir_mod && shift > 32) {
+      f_emit("  and edx, 0x%08X\n", (uint32_t)((value - 1) >> 32));
+    } else if (op == ir_mod) {
+      if (shift < 32) {
+        f_emit("  and eax, 0x%08X\n", (uint32_t)(value - 1));
+      }
+      
+      f_emit("  xor edx, edx\n");
+    }
+  } else if (op == ir_div || op == ir_mod) {
+    helper_mask |= helper_div_u64;
+    
+    f_emit("  mov ecx, 0x%08X\n", low);
+    f_emit("  mov ebx, 0x%08X\n", high);
+    f_emit("  call __DIV_U64\n");
+    
+    if (op == ir_mod) {
+      f_emit("  mov eax, ecx\n");
+      f_emit("  mov edx, ebx\n");
+    }
+  } else {
+    const char *names[] = {"add", "sub", NULL, NULL, NULL, "and", "or", "xor"};
+    const char *high_names[] = {"adc", "sbb", NULL, NULL, NULL, "and", "or", "xor"};
     
+    f_emit("  %s eax, 0x%08X\n", names[op - ir_add], low);
+    f_emit("  %s edx, 0x%08X\n", high_names[op - ir_add], high);
+  }
+}
+
+static void f_op_const(int op, int width, int is_signed, uint64_t value) {
+  const char *names[] = {"add", "sub", NULL, NULL, NULL, "and", "or", "xor"};
+  
+  if (width > 4) {
+    f_op_const_64(op, is_signed, value);
     return;
   }
   
-  printf("  cmp eax, 0\n");
-  printf("  jge SUB_%d\n", label);
+  // Cut to width, then sign-extended if need be.
+  
+  value &= (((uint64_t)(1)) << (width * 8)) - 1;
+  
+  if (is_signed && (value >> (width * 8 - 1))) {
+    value |= (~((uint64_t)(0))) << (width * 8);
+  }
+  
+  if (op == ir_mul) {
+    f_mul_32((uint32_t)(value));
+  } else if (op == ir_div || op == ir_mod) {
+    f_div_const_32(op, width, is_signed, (int64_t)(value));
+  } else {
+    f_emit("  %s eax, 0x%08X\n", names[op - ir_add], (uint32_t)(value));
+  }
 }
 
-static void f_jump_np(int width, int label) {
-  width = (width + 3) / 4;
+// ebx and ecx (kept registers 2 and 3) are scratch for division, and for 64-bit operators other than adding
+// and the like by constants.
+
+static int f_op_kills(int op, int width, int is_const) {
+  if (op == ir_div || op == ir_mod || (width > 4 && (!is_const || op == ir_mul))) {
+    return (1 << 2) | (1 << 3);
+  }
   
-  if (width > 1) {
+  return 0;
+}
+
+static void f_label(int label) {
+  f_emit(".SUB_%d:\n", label);
+}
+
+static void f_jump(int label) {
+  f_emit("  jmp .SUB_%d\n", label);
+}
+
+// Conditions are tested at their own width, the bits above it being whatever the last operation left there.
+
+static void f_jump_z(int width, int label) {
+  const char *names[] = {"al", "ax", "eax", "eax"};
+  
+  if (width > 4) {
     int skip_label = f_next();
     
-    printf("  cmp edx, 0\n");
-    printf("  jge SUB_%d\n", skip_label);
+    f_emit("  test edx, edx\n");
+    f_emit("  jnz .SUB_%d\n", skip_label);
     
-    f_jump_np(4, label);
+    f_jump_z(4, label);
     f_label(skip_label);
     
     return;
   }
   
-  printf("  cmp eax, 0\n");
-  printf("  jl SUB_%d\n", label);
+  f_emit("  test %s, %s\n", names[width - 1], names[width - 1]);
+  f_emit("  jz .SUB_%d\n", label);
+}
+
+static void f_jump_nz(int width, int label) {
+  const char *names[] = {"al", "ax", "eax", "eax"};
+  
+  if (width > 4) {
+    f_emit("  test edx, edx\n");
+    f_emit("  jnz .SUB_%d\n", label);
+    
+    f_jump_nz(4, label);
+    return;
+  }
+  
+  f_emit("  test %s, %s\n", names[width - 1], names[width - 1]);
+  f_emit("  jnz .SUB_%d\n", label);
+}
+
+// The sign of 64-bit values is all in edx.
+
+static void f_jump_p(int width, int label) {
+  const char *names[] = {"al", "ax", "eax", "eax"};
+  f_emit("  cmp %s, 0\n", width > 4 ? "edx" : names[width - 1]);
+  f_emit("  jge .SUB_%d\n", label);
+}
+
+static void f_jump_np(int width, int label) {
+  const char *names[] = {"al", "ax", "eax", "eax"};
+  f_emit("  cmp %s, 0\n", width > 4 ? "edx" : names[width - 1]);
+  f_emit("  jl .SUB_%d\n", label);
 }
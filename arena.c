@@ -0,0 +1,163 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rtbc.h>
+
+#define ARENA_ALIGN     16
+#define ARENA_MIN_CHUNK 65536
+#define ARENA_LARGE     16384 // Allocations this big get a chunk of their own, which can grow with realloc().
+
+struct arena_chunk_t {
+  arena_chunk_t *next;
+  size_t size;
+  
+  _Alignas(ARENA_ALIGN) uint8_t data[];
+};
+
+static size_t f_arena_align(size_t size) {
+  return (size + (ARENA_ALIGN - 1)) & ~((size_t)(ARENA_ALIGN - 1));
+}
+
+static arena_chunk_t *f_arena_large(arena_t *arena, arena_chunk_t *chunk, size_t size) {
+  arena_chunk_t **link = &(arena->large);
+  
+  if (chunk) {
+    while (*link != chunk) {
+      link = &((*link)->next);
+    }
+    
+    arena->reserved -= chunk->size;
+  }
+  
+  arena_chunk_t *new_chunk = realloc(chunk, sizeof(arena_chunk_t) + size);
+  
+  if (!new_chunk) {
+    f_error("Out of memory (requested %zu bytes).\n", size);
+  }
+  
+  if (!chunk) {
+    new_chunk->next = arena->large;
+  }
+  
+  new_chunk->size = size;
+  *link = new_chunk;
+  
+  arena->reserved += size;
+  return new_chunk;
+}
+
+void *f_arena_alloc(arena_t *arena, size_t size) {
+  size = f_arena_align(size);
+  
+  if (size >= ARENA_LARGE) {
+    arena->allocated += size;
+    return f_arena_large(arena, NULL, size)->data;
+  }
+  
+  if (!arena->chunk || arena->chunk_length + size > arena->chunk->size) {
+    // Every new chunk is at least twice as big as the last one, so the chunk count stays logarithmic.
+    
+    size_t chunk_size = (arena->chunk ? arena->chunk->size * 2 : ARENA_MIN_CHUNK);
+    
+    while (chunk_size < size) {
+      chunk_size *= 2;
+    }
+    
+    arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + chunk_size);
+    
+    if (!chunk) {
+      f_error("Out of memory (requested %zu bytes).\n", size);
+    }
+    
+    chunk->next = arena->chunk;
+    chunk->size = chunk_size;
+    
+    arena->chunk = chunk;
+    arena->chunk_length = 0;
+    
+    arena->reserved += chunk_size;
+  }
+  
+  void *ptr = arena->chunk->data + arena->chunk_length;
+  
+  arena->chunk_length += size;
+  arena->allocated += size;
+  
+  return ptr;
+}
+
+void *f_arena_grow(arena_t *arena, void *ptr, size_t old_size, size_t new_size) {
+  if (!ptr) {
+    return f_arena_alloc(arena, new_size);
+  }
+  
+  old_size = f_arena_align(old_size);
+  new_size = f_arena_align(new_size);
+  
+  if (new_size <= old_size) {
+    return ptr;
+  }
+  
+  if (old_size >= ARENA_LARGE) {
+    arena_chunk_t *chunk = (arena_chunk_t *)((uint8_t *)(ptr) - offsetof(arena_chunk_t, data));
+    arena->allocated += new_size - old_size;
+    
+    return f_arena_large(arena, chunk, new_size)->data;
+  }
+  
+  // If ptr was the last thing handed out and the chunk still has room, just bump it in place.
+  
+  if (new_size < ARENA_LARGE && (uint8_t *)(ptr) + old_size == arena->chunk->data + arena->chunk_length &&
+      arena->chunk_length + (new_size - old_size) <= arena->chunk->size) {
+    arena->chunk_length += new_size - old_size;
+    arena->allocated += new_size - old_size;
+    
+    return ptr;
+  }
+  
+  void *new_ptr = f_arena_alloc(arena, new_size);
+  memcpy(new_ptr, ptr, old_size);
+  
+  return new_ptr;
+}
+
+void *f_arena_reserve(arena_t *arena, void *array, int count, int *capacity, size_t item_size) {
+  if (count <= *capacity) {
+    return array;
+  }
+  
+  int new_capacity = (*capacity ? *capacity : 16);
+  
+  while (new_capacity < count) {
+    new_capacity *= 2;
+  }
+  
+  array = f_arena_grow(arena, array, *capacity * item_size, new_capacity * item_size);
+  *capacity = new_capacity;
+  
+  return array;
+}
+
+char *f_arena_strdup(arena_t *arena, const char *string) {
+  size_t length = strlen(string) + 1;
+  return memcpy(f_arena_alloc(arena, length), string, length);
+}
+
+void f_arena_free(arena_t *arena) {
+  while (arena->chunk) {
+    arena_chunk_t *next = arena->chunk->next;
+    
+    free(arena->chunk);
+    arena->chunk = next;
+  }
+  
+  while (arena->large) {
+    arena_chunk_t *next = arena->large->next;
+    
+    free(arena->large);
+    arena->large = next;
+  }
+  
+  arena->chunk_length = 0;
+}
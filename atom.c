@@ -0,0 +1,158 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <rtbc.h>
+
+// Every name (and canonical path, for guards) the compiler has seen, numbered in order. Atoms are never
+// freed, so they stay the same across every compile in a process (watch mode keeps relying on this), and
+// atom 0 is left as "no atom".
+
+#define ATOM_MIN_SLOTS 1024
+
+typedef struct atom_slot_t atom_slot_t;
+
+struct atom_slot_t {
+  uint32_t atom; // 0 marks a free slot.
+  uint32_t hash;
+};
+
+static arena_t atom_arena;
+
+static const char **atom_names;
+static int atom_count, atom_capacity;
+
+static atom_slot_t *atom_slots; // Keeping hashes in there means probing never touches names unless they match.
+static int slot_capacity;
+
+static uint32_t f_atom_hash(const char *name, size_t length) {
+  uint32_t hash = 2166136261u;
+  
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)(name[i])) * 16777619u;
+  }
+  
+  return hash;
+}
+
+static atom_slot_t *f_atom_slot(const char *name, size_t length, uint32_t hash) {
+  int index = hash & (slot_capacity - 1);
+  
+  for (;;) {
+    atom_slot_t *slot = atom_slots + index;
+    
+    if (!slot->atom) {
+      return slot;
+    }
+    
+    if (slot->hash == hash) {
+      const char *other = atom_names[slot->atom];
+      
+      if (!strncmp(other, name, length) && !other[length]) {
+        return slot;
+      }
+    }
+    
+    index = (index + 1) & (slot_capacity - 1);
+  }
+}
+
+static void f_atom_grow(void) {
+  atom_slot_t *slots = atom_slots;
+  int capacity = slot_capacity;
+  
+  slot_capacity = (capacity ? capacity * 2 : ATOM_MIN_SLOTS);
+  atom_slots = calloc(slot_capacity, sizeof(atom_slot_t));
+  
+  // Every atom is different already, so these only need a free slot.
+  
+  for (int i = 0; i < capacity; i++) {
+    if (!slots[i].atom) {
+      continue;
+    }
+    
+    int index = slots[i].hash & (slot_capacity - 1);
+    
+    while (atom_slots[index].atom) {
+      index = (index + 1) & (slot_capacity - 1);
+    }
+    
+    atom_slots[index] = slots[i];
+  }
+  
+  free(slots);
+}
+
+// Interns the first length characters of name. Only ever called by the thread splicing sources, lexer
+// threads keep atoms of their own for each unit instead (see unit_t).
+
+uint32_t f_atom_n(const char *name, size_t length) {
+  if (!atom_count) {
+    atom_capacity = ATOM_MIN_SLOTS;
+    
+    atom_names = malloc(atom_capacity * sizeof(const char *));
+    atom_names[0] = "";
+    
+    atom_count = 1;
+  }
+  
+  if ((atom_count + 1) * 2 > slot_capacity) {
+    f_atom_grow();
+  }
+  
+  uint32_t hash = f_atom_hash(name, length);
+  atom_slot_t *slot = f_atom_slot(name, length, hash);
+  
+  if (slot->atom) {
+    return slot->atom;
+  }
+  
+  if (atom_count == atom_capacity) {
+    atom_capacity *= 2;
+    
+    atom_names = realloc(atom_names, atom_capacity * sizeof(const char *));
+  }
+  
+  char *copy = f_arena_alloc(&atom_arena, length + 1);
+  
+  memcpy(copy, name, length);
+  copy[length] = '\0';
+  
+  atom_names[atom_count] = copy;
+  
+  *slot = (atom_slot_t){
+    .atom = atom_count,
+    .hash = hash,
+  };
+  
+  return atom_count++;
+}
+
+uint32_t f_atom(const char *name) {
+  return f_atom_n(name, strlen(name));
+}
+
+// Same, for names from anywhere but the source (which the lexer uppercases already). Names too long to be
+// in a source get atom 0.
+
+uint32_t f_atom_upper(const char *name) {
+  char buffer[MAX_LENGTH + 1];
+  size_t length = strlen(name);
+  
+  if (length > MAX_LENGTH) {
+    return 0;
+  }
+  
+  for (size_t i = 0; i < length; i++) {
+    buffer[i] = toupper(name[i]);
+  }
+  
+  return f_atom_n(buffer, length);
+}
+
+// Spelling of an atom, as it was interned.
+
+const char *f_atom_name(uint32_t atom) {
+  return atom_names[atom];
+}
@@ -0,0 +1,138 @@
+#!/usr/bin/sh
+# Times the compiler on generated workloads, for the working tree and any git revisions given:
+#   sh bench/bench.sh [-n runs] [-w workload,...] [revision ...]
+# Each build is -Ofast, each run starts without a .rtbc cache, and the best of n runs is reported.
+set -e
+
+runs=5
+workloads=keywords
+while getopts n:w: option; do
+  case $option in
+    n) runs=$OPTARG ;;
+    w) workloads=$OPTARG ;;
+    *) exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Workloads are written to $work/<name>/test.tbc (main always compiles test.tbc).
+
+gen_keywords() { # Globals whose names share lengths and first characters with keywords.
+  awk 'BEGIN {
+    split("if ifz ifnz ife ifne ifl ifnl ifg ifng ifp ifnp ifa ifna ifb ifnb u8 u16 u32 u64 s8 s16 s32 s64 use only as", k, " ");
+    for (i = 0; i < 40000; i++) {
+      w = k[i % 26 + 1] "x" i;
+      if (i % 2) printf("u32 %s;\n", w); else printf("u32 %s = %d;\n", w, i);
+    }
+  }' > "$1/test.tbc"
+}
+
+gen_headers() { # 30 guarded headers pulled in by "use", each using three others.
+  awk -v dir="$1" 'BEGIN {
+    for (h = 0; h < 30; h++) {
+      f = dir "/h" h ".tbh";
+      printf("only !H%d;\nmacro H%d;\n", h, h) > f;
+      for (u = 1; u <= 3; u++) printf("use \"h%d.tbh\";\n", (h * 7 + u * 11) % 30) > f;
+      for (i = 0; i < 5000; i++) {
+        printf("u32 g%d_%d = 0x%x; # comment \"%d\"\n", h, i, i, i) > f;
+        printf("u8 b%d_%d; # no value\n", h, i) > f;
+      }
+      close(f);
+    }
+    f = dir "/test.tbc";
+    for (h = 0; h < 30; h += 3) printf("use \"h%d.tbh\", \"h%d.tbh\", \"h%d.tbh\";\n", h, h + 1, h + 2) > f;
+  }'
+}
+
+gen_scan() { # Long comments, identifiers and runs of whitespace, and a header of string literals.
+  # String literals only parse in routine bodies, so their header is guarded off. It still gets lexed whole
+  # before its guard is checked.
+  awk -v dir="$1" 'BEGIN {
+    f = dir "/strings.tbh";
+    printf("only !SCAN;\n") > f;
+    for (i = 0; i < 20000; i++) {
+      printf("s%d(\"%s %d\\n\", \"%s\\t%s\");\n", i, "a string long enough to be worth scanning in blocks", i,
+        "tab", "separated and \\x41\\102 escaped") > f;
+    }
+    close(f);
+    f = dir "/test.tbc";
+    printf("macro SCAN;\nuse \"strings.tbh\";\n") > f;
+    for (i = 0; i < 20000; i++) {
+      printf("# A comment line long enough to take more than a couple of vector blocks to skip, %d.\n", i) > f;
+      printf("u32    identifier%05d    =    0x%x  ;\t\t    \n\n", i, i) > f;
+    }
+  }'
+}
+
+gen_symbols() { # 20000 macros checked by one "only", 20000 globals, and a routine with 2000 arguments and locals.
+  awk 'BEGIN {
+    for (i = 0; i < 20000; i++) printf("macro M%d;\n", i);
+    printf("only M0");
+    for (i = 1; i < 20000; i++) printf(", M%d", i);
+    printf(";\n");
+    for (i = 0; i < 20000; i++) printf("u32 g%d = %d;\n", i, i);
+    printf("s r(s a0");
+    for (i = 1; i < 2000; i++) printf(", s a%d", i);
+    printf(") : (s l0");
+    for (i = 1; i < 2000; i++) printf(", s l%d", i);
+    printf(") @( 0@; );\n");
+  }' > "$1/test.tbc"
+}
+
+gen_routines() { # 4000 routines using their arguments and calling the two before them, small ones getting inlined.
+  awk 'BEGIN {
+    printf("u32 r0(u32 a, u32 b) @( a + b@; );\nu32 r1(u32 a, u32 b) @( a - b@; );\n");
+    for (i = 2; i < 4000; i++) {
+      printf("u32 r%d(u32 a, u32 b) : (u32 c) @( whnz (a) @( r%d(a, c); ) r%d(a * %d, b) + (b & 7) ^ c@; );\n",
+        i, i - 1, i - 2, i);
+    }
+  }' > "$1/test.tbc"
+}
+
+gen() {
+  mkdir -p "$work/$1"
+  "gen_$1" "$work/$1"
+}
+
+build() { # build <label> <source directory>
+  gcc "$2"/*.c -I"$2/include" -Ofast -s -pthread -o "$work/rtbc-$1" 2> /dev/null
+}
+
+measure() { # measure <label> <workload>
+  best=
+  i=0
+  while [ $i -lt "$runs" ]; do
+    rm -rf "$work/$2/.rtbc"
+    start=$(date +%s%N)
+    status=0
+    (cd "$work/$2" && "$work/rtbc-$1" > /dev/null 2>&1) || status=$?
+    end=$(date +%s%N)
+    time=$(((end - start) / 1000))
+    if [ -z "$best" ] || [ $time -lt "$best" ]; then best=$time; fi
+    i=$((i + 1))
+  done
+  size=$(cat "$work/$2"/*.tb? | wc -c)
+  awk -v l="$1" -v w="$2" -v t="$best" -v s="$size" \
+    'BEGIN { printf("%-12s %-10s %9.2f ms %8.1f MB/s\n", l, w, t / 1000, s / t) }'
+  if [ $status -ne 0 ]; then echo "$1 failed on $2 (exit status $status), the time above is not comparable"; fi
+}
+
+labels=tree
+build tree "$root"
+for revision in "$@"; do
+  mkdir -p "$work/src-$revision"
+  git -C "$root" archive "$revision" | tar -x -C "$work/src-$revision"
+  build "$revision" "$work/src-$revision"
+  labels="$labels $revision"
+done
+
+for workload in $(echo "$workloads" | tr , ' '); do
+  gen "$workload"
+  for label in $labels; do
+    measure "$label" "$workload"
+  done
+done
@@ -0,0 +1,103 @@
+// Times every case in cases.h (generated by cycles.sh from cycles.tbc), printing the name of each routine along
+// with the fewest cycles a call to it took, over CALL_COUNT calls in a row, best of RUN_COUNT. Calls that do
+// not return what they should get printed as failing instead. Freestanding, same as tests/driver.c.
+
+#include <stdint.h>
+
+#ifndef RUN_COUNT
+#define RUN_COUNT 5
+#endif
+
+#define CALL_COUNT 10000
+
+typedef struct case_t case_t;
+
+struct case_t {
+  const char *text;
+  void *routine;
+  
+  int word_count;
+  uint32_t words[32];
+  
+  uint32_t result;
+};
+
+uint32_t tbcall(void *routine, int count, const uint32_t *words);
+
+#include "cases.h"
+
+static void f_write(const char *text, int length) {
+  if (length < 0) {
+    length = 0;
+    
+    while (text[length]) {
+      length++;
+    }
+  }
+  
+  int call = 4; // write(), which returns in eax.
+  __asm__ volatile("int $0x80" : "+a"(call) : "b"(1), "c"(text), "d"(length) : "memory");
+}
+
+static void f_write_u32(uint32_t value) {
+  char buffer[16];
+  int i = sizeof(buffer) - 1;
+  
+  buffer[i] = '\0';
+  
+  do {
+    buffer[--i] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  
+  f_write(buffer + i, -1);
+}
+
+static uint64_t f_cycles(void) {
+  uint32_t low, high;
+  __asm__ volatile("lfence\n\trdtsc" : "=a"(low), "=d"(high));
+  
+  return ((uint64_t)(high) << 32) | low;
+}
+
+void _start(void) {
+  int fail_count = 0;
+  
+  for (unsigned i = 0; i < sizeof(cases) / sizeof(case_t); i++) {
+    const case_t *test = cases + i;
+    
+    int name_length = 0;
+    uint64_t best = ~(uint64_t)(0);
+    
+    while (test->text[name_length] != '(') {
+      name_length++;
+    }
+    
+    f_write(test->text, name_length);
+    
+    if (tbcall(test->routine, test->word_count, test->words) != test->result) {
+      f_write(" FAIL\n", -1);
+      fail_count++;
+      
+      continue;
+    }
+    
+    for (int run = 0; run < RUN_COUNT; run++) {
+      uint64_t start = f_cycles();
+      
+      for (int call = 0; call < CALL_COUNT; call++) {
+        tbcall(test->routine, test->word_count, test->words);
+      }
+      
+      uint64_t cycles = f_cycles() - start;
+      best = (cycles < best ? cycles : best);
+    }
+    
+    f_write(" ", 1);
+    f_write_u32((uint32_t)(best) / CALL_COUNT); // Runs take well under 2^32 cycles.
+    f_write("\n", 1);
+  }
+  
+  __asm__ volatile("int $0x80" : : "a"(1), "b"(fail_count));
+  __builtin_unreachable();
+}
@@ -0,0 +1,45 @@
+#!/usr/bin/sh
+# Times the code the compiler generates for bench/cycles.tbc, for the working tree and any git revisions given:
+#   sh bench/cycles.sh [-n runs] [revision ...]
+# Prints cycles per call of every routine there, best of n runs of 10000 calls (call overhead included). Needs
+# nasm and a gcc that can target i386, same as tests/run.sh.
+set -e
+
+runs=5
+while getopts n: option; do
+  case $option in
+    n) runs=$OPTARG ;;
+    *) exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+nasm -f elf32 "$root/tests/call.asm" -o "$work/call.o"
+awk -f "$root/tests/cases.awk" "$root/bench/cycles.tbc" > "$work/cases.h"
+
+measure() { # measure <label> <source directory>
+  mkdir -p "$work/$1"
+  cp "$root/bench/cycles.tbc" "$work/$1/test.tbc"
+  gcc "$2"/*.c -I"$2/include" -O2 -pthread -o "$work/$1/rtbc" 2> /dev/null
+  
+  if ! (cd "$work/$1" && ./rtbc > test.asm 2> /dev/null); then
+    echo "$1 does not compile cycles.tbc"
+    return
+  fi
+  
+  nasm -f elf32 "$work/$1/test.asm" -o "$work/$1/test.o"
+  gcc -m32 -O2 -ffreestanding -fno-pic -fno-stack-protector -nostdlib -static -I"$work" -DRUN_COUNT="$runs" \
+    "$root/bench/cycles.c" "$work/$1/test.o" "$work/call.o" -o "$work/$1/cycles"
+  "$work/$1/cycles" | awk -v l="$1" '{ printf("%-12s %-10s %6d cycles\n", l, tolower($1), $2) }' || true
+}
+
+measure tree "$root"
+for revision in "$@"; do
+  mkdir -p "$work/src-$revision"
+  git -C "$root" archive "$revision" | tar -x -C "$work/src-$revision"
+  measure "$revision" "$work/src-$revision"
+done
@@ -1,4 +1,4 @@
 #!/usr/bin/sh
 
-# gcc $(find . -name "*.c") -Iinclude -Ofast -s -o rtbc
-gcc $(find . -name "*.c") -Iinclude -Og -g -fsanitize=address,undefined -o rtbc
+# gcc *.c -Iinclude -Ofast -s -pthread -o rtbc
+gcc *.c -Iinclude -Og -g -fsanitize=address,undefined -pthread -o rtbc
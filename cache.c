@@ -0,0 +1,350 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <rtbc.h>
+
+// Precompiled headers: the words and string data of a lexed unit, stored as-is so a later compile can map the
+// file and point the unit straight into it. Anything that does not match (version, path, file contents, or
+// the payload itself) is just ignored, and the header gets lexed again.
+
+#define CACHE_MAGIC   0x43504254 // "TBPC"
+#define CACHE_VERSION 2
+#define CACHE_ALIGN   8
+
+typedef struct cache_header_t cache_header_t;
+
+struct cache_header_t {
+  uint32_t magic, version;
+  uint32_t word_kinds, value_size; // w_count and sizeof(value_t), so changing either invalidates everything.
+  
+  int64_t mtime; // Of the header when it got lexed, in nanoseconds.
+  uint64_t size; // Same, in bytes.
+  
+  uint64_t file_hash;    // Of the whole header.
+  uint64_t payload_hash; // Of everything after this header.
+  
+  uint32_t path_length; // All lengths include null terminators, if any.
+  uint32_t word_count, value_count;
+  uint32_t data_length, string_count;
+  uint32_t use_count, use_length;
+  uint32_t name_count, name_data_length;
+};
+
+static uint64_t f_cache_hash(const void *data, size_t length) {
+  const uint8_t *bytes = data;
+  uint64_t hash = 14695981039346656037u;
+  
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211u;
+  }
+  
+  return hash;
+}
+
+static size_t f_cache_align(size_t size) {
+  return (size + (CACHE_ALIGN - 1)) & ~((size_t)(CACHE_ALIGN - 1));
+}
+
+// Empty sections might come from NULL arrays, which memcpy() does not like even with nothing to copy.
+
+static void f_cache_put(char *ptr, const void *data, size_t length) {
+  if (length) {
+    memcpy(ptr, data, length);
+  }
+}
+
+// Only headers get cached, as those are what keeps getting lexed again on every compile.
+
+static int f_cache_wants(const unit_t *unit) {
+  size_t length = strlen(unit->path);
+  return (length >= 4 && !strcmp(unit->path + length - 4, ".tbh"));
+}
+
+// Cache entries are named after the hash of the canonical path (which is stored inside too, to tell
+// collisions apart).
+
+static char *f_cache_name(unit_t *unit, const char *cache_path) {
+  uint64_t hash = f_cache_hash(unit->path, strlen(unit->path));
+  
+  size_t length = snprintf(NULL, 0, "%s/%016lx.tbp", cache_path, hash);
+  char *name = f_arena_alloc(&(unit->arena), length + 1);
+  
+  snprintf(name, length + 1, "%s/%016lx.tbp", cache_path, hash);
+  return name;
+}
+
+static int64_t f_cache_mtime(const struct stat *info) {
+  return (int64_t)(info->st_mtim.tv_sec) * 1000000000 + info->st_mtim.tv_nsec;
+}
+
+// Section sizes, in payload order: path, word types, word offsets, values, string lengths, data, uses, name
+// offsets and name data.
+
+#define CACHE_SECTIONS 9
+
+static void f_cache_sizes(const cache_header_t *header, size_t *sizes) {
+  sizes[0] = f_cache_align(header->path_length);
+  sizes[1] = f_cache_align(header->word_count * sizeof(uint8_t));
+  sizes[2] = f_cache_align(header->word_count * sizeof(uint32_t));
+  sizes[3] = f_cache_align(header->value_count * sizeof(value_t));
+  sizes[4] = f_cache_align(header->string_count * sizeof(int));
+  sizes[5] = f_cache_align(header->data_length);
+  sizes[6] = f_cache_align(header->use_length);
+  sizes[7] = f_cache_align(header->name_count * sizeof(uint32_t));
+  sizes[8] = f_cache_align(header->name_data_length);
+}
+
+// Tries to fill unit from its cache entry, pointing it into the mapped entry (which the unit keeps until it
+// gets freed). Returns 0 if there is no usable entry.
+
+int f_cache_load(unit_t *unit, const char *cache_path) {
+  if (!cache_path || !f_cache_wants(unit)) {
+    return 0;
+  }
+  
+  struct stat info;
+  
+  if (stat(unit->path, &info)) {
+    return 0;
+  }
+  
+  char *buffer;
+  size_t length;
+  int is_mapped;
+  
+  if (!f_lex_map(f_cache_name(unit, cache_path), &buffer, &length, &is_mapped, NULL)) {
+    return 0;
+  }
+  
+  const cache_header_t *header = (const cache_header_t *)(buffer);
+  
+  if (length < sizeof(cache_header_t) || header->magic != CACHE_MAGIC || header->version != CACHE_VERSION ||
+      header->word_kinds != w_count || header->value_size != sizeof(value_t) || header->size != (uint64_t)(info.st_size)) {
+    f_lex_unmap(buffer, length, is_mapped);
+    return 0;
+  }
+  
+  size_t sizes[CACHE_SECTIONS], payload_length = 0;
+  f_cache_sizes(header, sizes);
+  
+  for (int i = 0; i < CACHE_SECTIONS; i++) {
+    payload_length += sizes[i];
+  }
+  
+  if (length != sizeof(cache_header_t) + payload_length ||
+      f_cache_hash(buffer + sizeof(cache_header_t), payload_length) != header->payload_hash) {
+    f_debug("Cache for '%s': corrupt, lexing again.\n", unit->name);
+    
+    f_lex_unmap(buffer, length, is_mapped);
+    return 0;
+  }
+  
+  char *ptr = buffer + sizeof(cache_header_t);
+  
+  if (header->path_length != strlen(unit->path) + 1 || memcmp(ptr, unit->path, header->path_length)) {
+    f_lex_unmap(buffer, length, is_mapped);
+    return 0;
+  }
+  
+  // Touched since it got cached: only hash the contents (still much cheaper than lexing them) if the mtime
+  // does not match, then remember the new mtime if they are still the same.
+  
+  if (header->mtime != f_cache_mtime(&info)) {
+    char *file_buffer;
+    size_t file_length;
+    int file_is_mapped;
+    int64_t file_mtime; // Of the contents hashed, rather than the ones stat() saw.
+    
+    if (!f_lex_map(unit->path, &file_buffer, &file_length, &file_is_mapped, &file_mtime)) {
+      f_lex_unmap(buffer, length, is_mapped);
+      return 0;
+    }
+    
+    uint64_t file_hash = f_cache_hash(file_buffer, file_length);
+    f_lex_unmap(file_buffer, file_length, file_is_mapped);
+    
+    if (file_hash != header->file_hash) {
+      f_debug("Cache for '%s': stale, lexing again.\n", unit->name);
+      
+      f_lex_unmap(buffer, length, is_mapped);
+      return 0;
+    }
+    
+    int fd = (file_mtime >= 0 ? open(f_cache_name(unit, cache_path), O_WRONLY) : -1);
+    
+    if (fd >= 0) {
+      pwrite(fd, &file_mtime, sizeof(file_mtime), offsetof(cache_header_t, mtime));
+      
+      close(fd);
+    }
+  }
+  
+  ptr += sizes[0];
+  
+  unit->word_types = (uint8_t *)(ptr);
+  unit->word_count = header->word_count;
+  ptr += sizes[1];
+  
+  unit->word_offsets = (uint32_t *)(ptr);
+  ptr += sizes[2];
+  
+  unit->values = (value_t *)(ptr);
+  unit->value_count = header->value_count;
+  ptr += sizes[3];
+  
+  unit->string_lengths = (int *)(ptr);
+  unit->string_count = header->string_count;
+  ptr += sizes[4];
+  
+  unit->data_buffer = ptr;
+  unit->data_length = header->data_length;
+  ptr += sizes[5];
+  
+  unit->uses = f_arena_alloc(&(unit->arena), (header->use_count + 1) * sizeof(char *));
+  unit->use_count = header->use_count;
+  
+  for (uint32_t i = 0; i < header->use_count; i++) {
+    unit->uses[i] = ptr;
+    ptr += strlen(ptr) + 1;
+  }
+  
+  ptr = buffer + sizeof(cache_header_t) + (payload_length - sizes[7] - sizes[8]);
+  
+  unit->name_offsets = (uint32_t *)(ptr);
+  unit->name_count = header->name_count;
+  ptr += sizes[7];
+  
+  unit->name_data = ptr;
+  unit->name_data_length = header->name_data_length;
+  
+  // Nothing can grow in place anymore, which is fine as units are done by now.
+  
+  unit->word_capacity = unit->word_count;
+  unit->value_capacity = unit->value_count;
+  unit->string_capacity = unit->string_count;
+  unit->data_capacity = unit->data_length;
+  unit->use_capacity = unit->use_count;
+  unit->name_capacity = unit->name_count;
+  unit->name_data_capacity = unit->name_data_length;
+  
+  unit->cache_buffer = buffer;
+  unit->cache_length = length;
+  unit->cache_is_mapped = is_mapped;
+  
+  f_debug("Cache for '%s': loaded.\n", unit->name);
+  return 1;
+}
+
+// Writes the cache entry for a freshly lexed unit, given the contents it got lexed from and the mtime of the
+// file as they got read (-1 if not a regular file). Any failure just leaves things without a cache entry.
+
+void f_cache_save(unit_t *unit, const char *cache_path, const char *buffer, size_t length, int64_t mtime) {
+  if (!cache_path || !f_cache_wants(unit) || unit->error || mtime < 0) {
+    return;
+  }
+  
+  cache_header_t header = (cache_header_t){
+    .magic = CACHE_MAGIC,
+    .version = CACHE_VERSION,
+    
+    .word_kinds = w_count,
+    .value_size = sizeof(value_t),
+    
+    .mtime = mtime,
+    .size = length,
+    
+    .file_hash = f_cache_hash(buffer, length),
+    .payload_hash = 0,
+    
+    .path_length = strlen(unit->path) + 1,
+    .word_count = unit->word_count,
+    .value_count = unit->value_count,
+    .data_length = unit->data_length,
+    .string_count = unit->string_count,
+    .use_count = unit->use_count,
+    .use_length = 0,
+    .name_count = unit->name_count,
+    .name_data_length = unit->name_data_length,
+  };
+  
+  for (int i = 0; i < unit->use_count; i++) {
+    header.use_length += strlen(unit->uses[i]) + 1;
+  }
+  
+  size_t sizes[CACHE_SECTIONS], payload_length = 0;
+  f_cache_sizes(&header, sizes);
+  
+  for (int i = 0; i < CACHE_SECTIONS; i++) {
+    payload_length += sizes[i];
+  }
+  
+  char *payload = calloc(payload_length + 1, 1);
+  char *ptr = payload;
+  
+  memcpy(ptr, unit->path, header.path_length);
+  ptr += sizes[0];
+  
+  f_cache_put(ptr, unit->word_types, unit->word_count * sizeof(uint8_t));
+  ptr += sizes[1];
+  
+  f_cache_put(ptr, unit->word_offsets, unit->word_count * sizeof(uint32_t));
+  ptr += sizes[2];
+  
+  f_cache_put(ptr, unit->values, unit->value_count * sizeof(value_t));
+  ptr += sizes[3];
+  
+  f_cache_put(ptr, unit->string_lengths, unit->string_count * sizeof(int));
+  ptr += sizes[4];
+  
+  f_cache_put(ptr, unit->data_buffer, unit->data_length);
+  ptr += sizes[5];
+  
+  for (int i = 0; i < unit->use_count; i++) {
+    size_t use_length = strlen(unit->uses[i]) + 1;
+    
+    memcpy(ptr, unit->uses[i], use_length);
+    ptr += use_length;
+  }
+  
+  ptr = payload + (payload_length - sizes[7] - sizes[8]);
+  
+  f_cache_put(ptr, unit->name_offsets, unit->name_count * sizeof(uint32_t));
+  ptr += sizes[7];
+  
+  f_cache_put(ptr, unit->name_data, unit->name_data_length);
+  
+  header.payload_hash = f_cache_hash(payload, payload_length);
+  
+  // Write to a temporary file first then rename it over, so no other compile ever sees half an entry.
+  
+  char *name = f_cache_name(unit, cache_path);
+  
+  size_t temp_length = strlen(name) + 8;
+  char *temp_name = f_arena_alloc(&(unit->arena), temp_length);
+  
+  snprintf(temp_name, temp_length, "%s.XXXXXX", name);
+  mkdir(cache_path, 0755);
+  
+  int fd = mkstemp(temp_name);
+  
+  if (fd < 0) {
+    free(payload);
+    return;
+  }
+  
+  int is_written = (write(fd, &header, sizeof(header)) == sizeof(header) &&
+                    write(fd, payload, payload_length) == (ssize_t)(payload_length));
+                    
+  close(fd);
+  free(payload);
+  
+  if (!is_written || rename(temp_name, name)) {
+    unlink(temp_name);
+  }
+}
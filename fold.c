@@ -0,0 +1,176 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <rtbc.h>
+
+// Constant folding, for global initializers and for whatever routines compute out of constants alone. Values
+// are kept in their canonical form: cut to their width, and sign-extended to 64 bits if signed. Anything
+// going wrong is returned as an error message, for the parser to point at the operator with.
+
+const_t f_fold_fit(const arch_t *arch, const_t value) {
+  int width = f_type_size(arch, value.type);
+  
+  if (value.is_data || !width || width >= 8) {
+    return value;
+  }
+  
+  value.ux &= (((uint64_t)(1)) << (width * 8)) - 1;
+  int sign_bit = (value.ux >> (width * 8 - 1)) & 1;
+  
+  if (value.type.base_signed && !value.type.point_count && sign_bit) {
+    value.ux |= ((~((uint64_t)(0))) << (width * 8));
+  }
+  
+  return value;
+}
+
+const_t f_fold_cast(const arch_t *arch, type_t type, const_t value) {
+  int type_width = f_type_size(arch, type);
+  int width = f_type_size(arch, value.type);
+  
+  if (value.is_data && type_width < width) {
+    f_error("Cannot cast DATA-relative address to smaller size.\n");
+  }
+  
+  if (type_width > width) {
+    value.ux &= (((uint64_t)(1)) << (width * 8)) - 1;
+    int sign_bit = (value.ux >> (width * 8 - 1)) & 1;
+    
+    if (value.type.base_signed && type.base_signed && sign_bit) {
+      value.ux |= ((~((uint64_t)(0))) << (width * 8));
+    }
+  }
+  
+  value.type = type;
+  return value;
+}
+
+type_t f_fold_type(type_t type_a, type_t type_b) {
+  if (type_a.point_count && type_b.point_count) {
+    if (type_a.base_width != type_b.base_width ||
+        type_a.base_signed != type_b.base_signed ||
+        type_a.point_count != type_b.point_count) {
+      f_error("Cannot operate with two pointers of different type.\n");
+    }
+    
+    return type_a;
+  } else if (type_a.point_count) {
+    return type_a;
+  } else if (type_b.point_count) {
+    return type_b;
+  }
+  
+  return (type_t){
+    .base_width = (type_a.base_width > type_b.base_width ? type_a.base_width : type_b.base_width),
+    .base_signed = (type_a.base_signed && type_b.base_signed),
+    
+    .point_count = 0,
+  };
+}
+
+// Prefix operators: -, !, and the 1-bit shifts and rotates.
+
+const char *f_fold_unary(const arch_t *arch, int op, const_t value, const_t *result) {
+  if (value.is_data) {
+    return "DATA-relative addresses can only be added to or subtracted from.";
+  }
+  
+  int bits = f_type_size(arch, value.type) * 8;
+  int is_signed = (value.type.base_signed && !value.type.point_count);
+  
+  uint64_t mask = (bits >= 64 ? ~((uint64_t)(0)) : (((uint64_t)(1)) << bits) - 1);
+  value = f_fold_fit(arch, value);
+  
+  if (op == s_sub) {
+    value.ux = -value.ux;
+  } else if (op == s_not) {
+    value.ux = ~value.ux;
+  } else if (op == s_l_shift) {
+    value.ux <<= 1;
+  } else if (op == s_r_shift) {
+    value.ux = (is_signed ? (uint64_t)(value.x >> 1) : value.ux >> 1);
+  } else if (op == s_l_rotate) {
+    value.ux = ((value.ux << 1) | ((value.ux >> (bits - 1)) & 1)) & mask;
+  } else if (op == s_r_rotate) {
+    value.ux = ((value.ux & mask) >> 1) | ((value.ux & 1) << (bits - 1));
+  } else {
+    return "Not a prefix operator.";
+  }
+  
+  *result = f_fold_fit(arch, value);
+  return NULL;
+}
+
+// Infix operators: & \ ^ + - * / %. Operands are cast to the wider of their types first, just like they will
+// be at runtime. DATA-relative addresses stay symbolic, so only offsets can be added to (or subtracted from)
+// them, and subtracting two of them gives a plain offset.
+
+const char *f_fold_binary(const arch_t *arch, int op, const_t value_a, const_t value_b, const_t *result) {
+  if (value_a.is_data || value_b.is_data) {
+    if (value_a.is_data && value_b.is_data && op == s_sub) {
+      *result = (const_t){
+        .type = (type_t){
+          .base_width = arch->point_width,
+          .base_signed = 1,
+          
+          .point_count = 0,
+        },
+        
+        .is_data = 0,
+        .x = (int64_t)(value_a.offset - value_b.offset),
+      };
+    } else if (value_a.is_data && !value_b.is_data && (op == s_add || op == s_sub)) {
+      value_b = f_fold_fit(arch, value_b);
+      
+      *result = value_a;
+      result->offset = (op == s_add ? value_a.offset + value_b.ux : value_a.offset - value_b.ux);
+    } else if (value_b.is_data && !value_a.is_data && op == s_add) {
+      value_a = f_fold_fit(arch, value_a);
+      
+      *result = value_b;
+      result->offset = value_b.offset + value_a.ux;
+    } else {
+      return "DATA-relative addresses can only be added to or subtracted from.";
+    }
+    
+    return NULL;
+  }
+  
+  type_t type = f_fold_type(value_a.type, value_b.type);
+  int is_signed = (type.base_signed && !type.point_count);
+  
+  value_a = f_fold_fit(arch, f_fold_cast(arch, type, value_a));
+  value_b = f_fold_fit(arch, f_fold_cast(arch, type, value_b));
+  
+  const_t value = value_a;
+  
+  if (op == s_and) {
+    value.ux = value_a.ux & value_b.ux;
+  } else if (op == s_or) {
+    value.ux = value_a.ux | value_b.ux;
+  } else if (op == s_xor) {
+    value.ux = value_a.ux ^ value_b.ux;
+  } else if (op == s_add) {
+    value.ux = value_a.ux + value_b.ux;
+  } else if (op == s_sub) {
+    value.ux = value_a.ux - value_b.ux;
+  } else if (op == s_mul) {
+    value.ux = value_a.ux * value_b.ux;
+  } else if (op == s_div || op == s_mod) {
+    if (!value_b.ux) {
+      return "Division by zero in constant expression.";
+    }
+    
+    if (is_signed && value_b.x == -1) {
+      value.ux = (op == s_div ? -value_a.ux : 0); // INT64_MIN / -1 would trap.
+    } else if (is_signed) {
+      value.x = (op == s_div ? value_a.x / value_b.x : value_a.x % value_b.x);
+    } else {
+      value.ux = (op == s_div ? value_a.ux / value_b.ux : value_a.ux % value_b.ux);
+    }
+  } else {
+    return "Not an infix operator.";
+  }
+  
+  *result = f_fold_fit(arch, value);
+  return NULL;
+}
@@ -4,18 +4,53 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <pthread.h>
 
 #define MAX_LENGTH 15
 
+typedef struct arena_t arena_t;
+typedef struct arena_chunk_t arena_chunk_t;
+
+typedef struct table_t table_t;
+typedef struct table_bind_t table_bind_t;
+
+typedef struct unit_t unit_t;
+typedef struct lexer_t lexer_t;
+
 typedef struct source_t source_t;
 typedef struct macro_t macro_t;
+typedef struct string_t string_t;
+typedef struct guard_t guard_t;
 typedef struct word_t word_t;
+typedef struct span_t span_t;
+typedef struct frame_t frame_t;
+typedef union value_t value_t;
 
 typedef struct context_t context_t;
 typedef struct entry_t entry_t;
+typedef struct routine_t routine_t;
+typedef struct operand_t operand_t;
 typedef struct const_t const_t;
 typedef struct enum_t enum_t;
 typedef struct type_t type_t;
+typedef struct pool_t pool_t;
+
+typedef struct ir_t ir_t;
+typedef struct ir_block_t ir_block_t;
+typedef struct ir_inst_t ir_inst_t;
+typedef struct ir_range_t ir_range_t;
+typedef struct ir_value_t ir_value_t;
+typedef struct ir_pass_t ir_pass_t;
+
+typedef struct inline_t inline_t;
+
+typedef struct link_t link_t;
+typedef struct symbol_t symbol_t;
+
+typedef struct replay_t replay_t;
+typedef struct replay_entry_t replay_entry_t;
 
 typedef struct arch_t arch_t;
 
@@ -23,38 +58,267 @@ typedef struct arch_t arch_t;
 
 extern int f_do_debug;
 
-void f_error(const char *format, ...);
+// All of these are per thread, as routines can get generated by several threads at once (see parse.c).
+
+extern _Thread_local FILE *f_output;        // Where backends print to, stdout if NULL.
+extern _Thread_local jmp_buf *f_error_jump; // If set, f_error() jumps there instead of exiting.
+
+extern _Thread_local int f_error_is_kept;        // If set too, f_error() keeps its message instead of printing it,
+extern _Thread_local char f_error_message[1024]; // in here.
+
+_Noreturn void f_error(const char *format, ...);
 void f_debug(const char *format, ...);
+void f_print(const char *format, ...);
+
+// arena.c
+
+// Bump allocator owned by a whole compilation, everything gets freed at once by f_arena_free().
+struct arena_t {
+  arena_chunk_t *chunk, *large;
+  size_t chunk_length;
+  
+  size_t allocated; // Bytes handed out.
+  size_t reserved;  // Bytes requested from malloc().
+};
+
+void *f_arena_alloc(arena_t *arena, size_t size);
+void *f_arena_grow(arena_t *arena, void *ptr, size_t old_size, size_t new_size);
+void *f_arena_reserve(arena_t *arena, void *array, int count, int *capacity, size_t item_size);
+char *f_arena_strdup(arena_t *arena, const char *string);
+void  f_arena_free(arena_t *arena);
+
+// atom.c
+
+uint32_t    f_atom_n(const char *name, size_t length);
+uint32_t    f_atom(const char *name);
+uint32_t    f_atom_upper(const char *name);
+const char *f_atom_name(uint32_t atom);
+
+// table.c
+
+// Table from atoms to values, with scopes: an atom bound again hides its older binding until the scope it
+// got bound in is popped. Lives in an arena, as everything it is used for does.
+struct table_t {
+  int *slots; // Innermost binding of every atom, -1 if none.
+  int slot_capacity;
+  
+  table_bind_t *binds; // Every binding in scope, innermost last.
+  int bind_count, bind_capacity;
+};
+
+struct table_bind_t {
+  uint32_t atom;
+  
+  int value;
+  int shadow; // Binding it hides, -1 if none.
+};
+
+int  f_table_find(const table_t *table, uint32_t atom);
+void f_table_bind(arena_t *arena, table_t *table, uint32_t atom, int value);
+int  f_table_scope(const table_t *table);
+void f_table_pop(table_t *table, int scope);
+
+// lex.c
+
+// A single file's words and string data, lexed on its own ("only", "use" and "macro" are left as they are,
+// to be handled when splicing it into a source).
+struct unit_t {
+  char *path; // Canonical path, what units are looked up by.
+  char *name; // Path as first written.
+  
+  arena_t arena;
+  
+  uint8_t *word_types;
+  uint32_t *word_offsets;
+  int word_count, word_capacity;
+  
+  value_t *values;
+  int value_count, value_capacity;
+  
+  char *data_buffer; // One string per l_str word, in order, each one string_lengths[i] bytes long.
+  int data_length, data_capacity;
+  
+  int *string_lengths;
+  int string_count, string_capacity;
+  
+  char **uses; // Paths found in "use" statements, to lex ahead of time.
+  int use_count, use_capacity;
+  
+  // Names get interned into atoms of the unit's own while lexing (so threads never have to share a table,
+  // and cache entries can be loaded as they are), then into global ones by the source, once per name.
+  
+  char *name_data; // Spelling of every name, null-terminated.
+  int name_data_length, name_data_capacity;
+  
+  uint32_t *name_offsets; // Into name_data, by local atom.
+  int name_count, name_capacity;
+  
+  uint64_t *name_slots; // Hash table of (hash << 32) | (local atom + 1), 0 marks a free slot. Only used while lexing.
+  int name_slot_capacity;
+  
+  uint32_t *atoms; // Global atom of every local one, 0 until first spliced.
+  
+  char *error; // Set if lexing stopped early, reported once splicing gets past the last word.
+  int state;
+  
+  int splice_count; // Times it is being spliced right now (nested "use" of the same file), by the source.
+  
+  char *cache_buffer; // Cache entry everything above points into, if loaded from one.
+  size_t cache_length;
+  int cache_is_mapped;
+};
+
+// Pool of threads lexing units ahead of time, as "use" statements are found.
+struct lexer_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  
+  unit_t **units;
+  int unit_count;
+  
+  unit_t **queue;
+  int queue_start, queue_count;
+  size_t queue_length; // Bytes of every file ever queued.
+  
+  pthread_t *threads; // Only started once queue_length reaches LEX_THREAD_LENGTH.
+  int thread_count;
+  
+  const char *cache_path;
+  int is_done;
+};
+
+int  f_lex_map(const char *path, char **buffer, size_t *length, int *is_mapped, int64_t *mtime);
+void f_lex_unmap(char *buffer, size_t length, int is_mapped);
+void f_lex_locate(const char *buffer, size_t length, size_t offset, int *line, int *column);
+
+void    f_lexer_init(lexer_t *lexer, int thread_count, const char *cache_path);
+unit_t *f_lexer_get(lexer_t *lexer, const char *name);
+void    f_lexer_drop(lexer_t *lexer, unit_t *unit);
+void    f_lexer_touch(lexer_t *lexer, const char *path);
+void    f_lexer_free(lexer_t *lexer);
+
+// scan.c
+
+void f_scan_init(void);
+
+const char *f_scan_space(const char *ptr, const char *end);
+const char *f_scan_name(const char *ptr, const char *end);
+const char *f_scan_string(const char *ptr, const char *end);
+
+// cache.c
+
+int  f_cache_load(unit_t *unit, const char *cache_path);
+void f_cache_save(unit_t *unit, const char *cache_path, const char *buffer, size_t length, int64_t mtime);
 
 // source.c
 
+#define SOURCE_WINDOW 4096 // Words spliced ahead of the parser at once, for streamed sources.
+
 struct source_t {
+  arena_t *arena;
+  
+  lexer_t *lexer;   // Only set while loading, unless set beforehand to keep units around for later loads.
+  int thread_count; // Threads to lex with, 1 lexes everything in place (as do streamed sources).
+  
+  int is_lexer_kept;
+  
+  const char *cache_path; // Directory to keep precompiled headers in, NULL to always lex them.
+  
+  // Streamed sources only get spliced as the parser asks for words, and release them once it is done with
+  // each top-level statement, so only a window of words is ever kept. Indices (words, values and spans)
+  // still count from the start of the source, the arrays below start at word_base and value_base.
+  
+  int is_streaming;
+  int word_base, value_base;
+  
+  frame_t *frames; // Files being spliced, innermost last.
+  int frame_count, frame_capacity;
+  
   char **files;
-  int file_count;
+  int file_count, file_capacity;
   
-  word_t *words;
-  int word_index, word_count;
+  // Words are stored as a structure of arrays: a type byte and a byte offset (within its file) for every
+  // word, plus a value for literals only (l_name to l_str), in the same order. Lines and columns are only
+  // worked out from offsets when reporting errors.
+  
+  uint8_t *word_types;
+  uint32_t *word_offsets;
+  int word_index, word_count, word_capacity;
+  
+  value_t *values;
+  int value_index, value_count, value_capacity;
+  
+  span_t *spans; // Runs of words coming from the same file.
+  int span_count, span_capacity;
   
   macro_t *macros;
-  int macro_count;
+  int macro_count, macro_capacity;
+  table_t macro_table; // Indices into macros, by the atoms of their names.
+  
+  guard_t *guards; // Files wrapped in an "only" guard.
+  int guard_count, guard_capacity;
+  table_t guard_table; // Indices into guards, by the atoms of their canonical paths.
   
   char *data_buffer;
-  int data_length;
+  int data_length, data_capacity;
+  
+  string_t *strings; // Hash table of every string in DATA, for interning.
+  int string_count, string_capacity;
+};
+
+struct string_t {
+  int offset, length; // Length includes the null terminator, 0 marks a free slot.
 };
 
 struct macro_t {
-  char name[MAX_LENGTH + 1];
+  uint32_t atom;
   
   word_t *words;
   int word_count;
 };
 
+struct guard_t {
+  char *path;
+  
+  word_t *words; // Everything between "only" and ";".
+  int word_count;
+};
+
+struct span_t {
+  int word, file; // Index of the first word of the run, and its file.
+};
+
+struct frame_t {
+  unit_t *unit;
+  char *path; // Canonical path, for guards.
+  int file;
+  
+  int word_index, value_index, string_index; // Next ones to splice, within the unit.
+  int first_word; // Index of the first word spliced from this file.
+  
+  int last_only, last_macro; // Index of the pending "only" or "macro", -1 if none.
+  int in_use;
+  
+  int only_not, only_guard;
+};
+
+union value_t {
+  uint32_t atom; // Local to its unit (see unit_t) until spliced.
+  
+  uint64_t ux;
+  int64_t x;
+  uint64_t chr;
+  uint64_t str; // Offset (in DATA)
+};
+
+// Unpacked word, as read from the source by f_source_read() (or while lexing). Its anonymous union must
+// match value_t.
 struct word_t {
   int type;
-  int file, line, column;
+  int index; // Index of the word in the source, -1 if it is not part of it.
   
   union {
-    char name[MAX_LENGTH + 1];
+    uint32_t atom;
     
     uint64_t ux;
     int64_t x;
@@ -84,7 +348,7 @@ enum {
   s_l_paren, // (
   s_r_paren, // )
   s_a_paren, // @(
-  
+    
   s_l_bracket, // [
   s_r_bracket, // ]
   s_a_bracket, // @[
@@ -149,7 +413,16 @@ enum {
   w_keywords = k_us, // Keywords start
 };
 
+#define f_word_has_value(type) ((type) >= l_name && (type) <= l_str)
+
 void f_source_load(source_t *source, const char *path);
+void f_source_pack(source_t *source);
+
+int  f_source_peek(source_t *source);
+void f_source_read(source_t *source, word_t *word);
+void f_source_release(source_t *source);
+void f_source_where(const source_t *source, int index, int *file, int *line, int *column);
+_Noreturn void f_source_error_at(const source_t *source, int index, const char *format, ...);
 
 // parse.c
 
@@ -170,28 +443,345 @@ struct const_t {
 };
 
 struct entry_t {
-  char name[MAX_LENGTH + 1];
+  uint32_t atom;
   type_t type;
   
   union {
     int is_routine;
     int offset; // Negative offsets are locals, positive ones are arguments, 0 is our exit pointer.
   };
+  
+  routine_t *routine; // Of routines, set by their first declaration.
+};
+
+enum {
+  routine_declared, // Body not seen yet.
+  routine_busy,     // Body being parsed (calls to it from in there are recursive).
+  routine_lazy,     // Body at word_index and value_index, to parse again if anything calls it.
+  routine_queued,   // Body at word_index and value_index, being generated by a worker (see parse.c).
+  routine_done,
+};
+
+// Routine bodies only get kept if worth inlining (see inline.c). Bodies naming nothing only depend on their
+// own words, so those get parsed again when called instead of being kept, if the words are still there.
+struct routine_t {
+  type_t *arg_types;
+  int *arg_offsets; // Arguments are pushed in order, so the last one comes first.
+  int arg_count, arg_size;
+  
+  int state;
+  int word_index, value_index; // Right past the opening "@(".
+  int local_size;
+  
+  ir_t *body;
+};
+
+enum {
+  operand_const,
+  operand_local,
+  operand_value,
+};
+
+// Value in a routine body, only put into its IR once used (constants and names, see parse.c).
+struct operand_t {
+  int kind;
+  type_t type;
+  
+  union {
+    const_t constant;
+    int offset; // Of locals.
+    int value;
+  };
 };
 
 struct context_t {
   entry_t *globals;
-  int global_count;
+  int global_count, global_capacity;
   
   entry_t *locals;
-  int local_count;
+  int local_count, local_capacity;
+  
+  type_t *arg_types; // Of the current routine.
+  int arg_capacity;
+  
+  operand_t *operands; // Arguments of calls (and left operands) being parsed, innermost last (see parse.c).
+  int operand_count, operand_capacity;
+  
+  table_t names; // Globals, with the locals of the current routine on top (see f_parse_find()).
+  const table_t *global_names; // Of the main thread, for workers, whose names only hold locals.
+  ir_t *ir;      // Of the current routine.
+  ir_t *lazy_ir; // Of routines parsed again from a call (see routine_t).
+  
+  const inline_t *inlining; // NULL to never inline.
+  table_t inline_names;     // Overrides, 1 to always inline and 0 to never.
+  
+  int is_named;     // Whether the current routine named anything.
+  int is_dependent; // Whether the current statement depends on others (calls, helpers), so it cannot be replayed.
+  int body_index;   // Where the body of the current routine starts, for workers (0 on the main thread).
+  pool_t *pool;  // Workers to hand routine bodies to instead, if any, or the ones this one is part of (see parse.c).
+  link_t *link;  // Keeps top-level symbols for later instead of emitting them, if pruning (see link.c).
   
   enum_t *enums;
   int enum_count;
 };
 
 int  f_type_size(const arch_t *arch, type_t type);
-void f_parse_root(const arch_t *arch, source_t *source);
+void f_parse_root(const arch_t *arch, source_t *source, replay_t *replay, const char **roots, const inline_t *inlining,
+                  int thread_count);
+                  
+// fold.c
+
+const_t     f_fold_fit(const arch_t *arch, const_t value);
+const_t     f_fold_cast(const arch_t *arch, type_t type, const_t value);
+type_t      f_fold_type(type_t type_a, type_t type_b);
+const char *f_fold_unary(const arch_t *arch, int op, const_t value, const_t *result);
+const char *f_fold_binary(const arch_t *arch, int op, const_t value_a, const_t value_b, const_t *result);
+
+// ir.c
+
+// Code of a single routine, as the parser builds it before any of it reaches the architecture: basic blocks
+// of instructions over virtual values, each defined by exactly one instruction and typed. Blocks run into
+// the next one in order unless they end in a jump, and get named by f_ir_block() before being placed with
+// f_ir_place() (just like labels are, see arch_t).
+enum {
+  // Defining a value:
+  
+  ir_const,       // constant
+  ir_local,       // Local (or argument) at offset, read as type.
+  ir_zero_extend, // args[0], zero-extended to type.
+  ir_sign_extend, // args[0], sign-extended to type.
+  ir_add,         // args[0] + args[1], both of type (and so on, signed if type is).
+  ir_sub,
+  ir_mul,
+  ir_div,
+  ir_mod,
+  ir_and,
+  ir_or,
+  ir_xor,
+  ir_call,        // Routine call.atom, taking the last call.size bytes of arguments.
+  
+  // Neither:
+  
+  ir_arg,   // Pushes args[0] as the next argument of a call.
+  ir_store, // Writes args[0] to the local at offset.
+  
+  // Ending a block:
+  
+  ir_jump,    // Goes to block.
+  ir_jump_z,  // Goes to block if args[0] is zero, runs into the next one otherwise.
+  ir_jump_nz, // Same, if args[0] is not zero.
+  ir_jump_p,  // Same, if args[0] is positive (or zero).
+  ir_jump_np, // Same, if args[0] is negative.
+  ir_return,  // Exits the routine, giving args[0] (if not -1, already cast to the exit type).
+  
+  ir_count,
+};
+
+#define f_ir_has_value(op) ((op) < ir_arg)
+#define f_ir_is_binary(op) ((op) >= ir_add && (op) <= ir_xor)
+#define f_ir_is_end(op)    ((op) >= ir_jump)
+
+struct ir_inst_t {
+  int op;
+  
+  int value; // Defined by it, -1 if none.
+  type_t type;
+  
+  int args[2]; // Values used, -1 if none.
+  int block;   // Jumped to.
+  
+  union {
+    const_t constant;
+    int offset;
+    
+    struct {
+      uint32_t atom;
+      int size;
+    } call;
+  };
+};
+
+struct ir_block_t {
+  ir_inst_t *insts;
+  int inst_count, inst_capacity;
+  
+  int is_placed;
+  int label;    // Given by f_ir_lower(), -1 if nothing jumps there.
+  int position; // Of its first instruction, counting every one in lowering order (see ir_range_t).
+};
+
+// Where a local (or argument) gets used while lowering, along with the register it gets kept in, if any.
+struct ir_range_t {
+  int offset;
+  int start, end; // Positions of the first and last instruction using it.
+  
+  int reads, stores;
+  int calls; // In between, after which it has to get loaded again.
+  int kills; // Registers operators in between take for themselves (see f_op_kills()), as a mask.
+  
+  int is_loaded; // Read before being stored to, so it has to get loaded first.
+  int is_unfit;  // Used as wider than a register, or narrower than reg_min_width (see arch_t).
+  
+  int reg; // -1 if none.
+};
+
+// What lowering worked out about a value, so nothing has to go through everything computing it again (which
+// takes as long as the routine does, for a long enough expression).
+struct ir_value_t {
+  int kills; // Registers computing it takes (see f_ir_kills()), -1 until worked out.
+  int need;  // Values computing it sets aside (see f_ir_need()), -1 until worked out.
+  
+  int lowest, highest; // Values computing it goes through (see f_ir_span()), -1 until worked out.
+};
+
+// Arrays are kept from routine to routine (blocks keep their instruction arrays too), so an arena is fine
+// for them.
+struct ir_t {
+  arena_t *arena;
+  
+  uint32_t atom;
+  type_t exit_type;
+  int arg_size; // Pushed by callers, for tail calls to reuse.
+  int local_size;
+  
+  ir_block_t *blocks; // By name.
+  int block_count, block_capacity;
+  
+  int *order; // Names of placed blocks, in the order they get lowered in.
+  int order_count, order_capacity;
+  
+  int value_count;
+  
+  const ir_inst_t **defs; // Instruction defining each value, while lowering.
+  int def_capacity;
+  
+  ir_value_t *values; // By value, while lowering.
+  int value_capacity;
+  
+  ir_range_t *ranges; // Of every local used, while lowering.
+  int range_count, range_capacity;
+};
+
+// Optimization passes, which run on every routine in the order they got added, right before lowering.
+struct ir_pass_t {
+  const char *name;
+  void (*f_run)(const arch_t *arch, ir_t *ir);
+};
+
+void  f_ir_init(ir_t *ir, uint32_t atom, type_t exit_type, int arg_size, int local_size);
+ir_t *f_ir_copy(arena_t *arena, const ir_t *ir);
+
+int  f_ir_block(ir_t *ir);
+void f_ir_place(ir_t *ir, int block);
+
+int  f_ir_const(ir_t *ir, const_t value);
+int  f_ir_local(ir_t *ir, type_t type, int offset);
+int  f_ir_extend(ir_t *ir, int op, int value, type_t type);
+int  f_ir_binary(ir_t *ir, int op, int value_a, int value_b, type_t type);
+int  f_ir_call(ir_t *ir, uint32_t atom, type_t type, int size);
+void f_ir_arg(ir_t *ir, int value);
+void f_ir_store(ir_t *ir, int value, int offset);
+void f_ir_jump(ir_t *ir, int op, int value, int block);
+void f_ir_return(ir_t *ir, int value);
+
+void f_ir_add_pass(const ir_pass_t *pass);
+void f_ir_run(const arch_t *arch, ir_t *ir);
+void f_ir_defs(ir_t *ir);
+void f_ir_dump(const ir_t *ir);
+void f_ir_lower(const arch_t *arch, ir_t *ir);
+
+// inline.c
+
+// Calls to leaf routines get replaced by their bodies if that makes them no more than size instructions
+// larger (the call itself being worth one per argument, plus one). Names are case-insensitive.
+struct inline_t {
+  int size;
+  
+  const char **always; // Inlined whatever their size (if they can be), NULL-terminated.
+  const char **never;  // Same, never inlined.
+};
+
+int f_inline_cost(const arch_t *arch, const ir_t *body, const routine_t *routine, int *cost);
+int f_inline_fits(const ir_t *body, int is_used);
+int f_inline_is_flat(const ir_t *body);
+int f_inline(ir_t *ir, const ir_t *body, const routine_t *routine, const int *args);
+
+// loop.c
+
+// Passes over the loops wh* statements make (see f_parse_loop()): rotation moves their test to the bottom,
+// hoisting computes whatever they never change just once, before them. Best run in that order.
+extern const ir_pass_t loop_rotate;
+extern const ir_pass_t loop_hoist;
+
+// link.c
+
+// Whole-program pruning: top-level symbols get kept while parsing instead of emitted, so that only the ones
+// reachable from the roots (the entry routine and whatever else gets exported) end up in the output, along
+// with just the DATA strings those use.
+struct symbol_t {
+  uint32_t atom;
+  int is_routine;
+  
+  const_t value; // Of globals.
+  ir_t *ir;      // Of routines, copied after its passes ran.
+  
+  int is_reached;
+};
+
+struct link_t {
+  arena_t *arena;
+  const char **roots; // Names, NULL-terminated.
+  
+  symbol_t *symbols; // In the order they got parsed in.
+  int symbol_count, symbol_capacity;
+};
+
+void f_link_global(link_t *link, uint32_t atom, const_t value);
+void f_link_routine(link_t *link, const ir_t *ir);
+void f_link_emit(const arch_t *arch, link_t *link, const char *data, int data_length);
+
+// watch.c
+
+// Output of every top-level statement in the last compile, so watch mode only has to generate code for the
+// ones that changed. Statements are keyed by their words, as that is all their output depends on for now
+// (anything else the parser starts looking at has to be part of the key too, labels are local to routines).
+// The globals they declare are kept too, as those still have to be declared when replaying them.
+struct replay_t {
+  replay_entry_t *entries; // From the last compile, in the order it went through them.
+  int entry_count, entry_capacity;
+  
+  int *slots; // Hash table of indices into entries (plus one, 0 marks a free slot).
+  int slot_capacity;
+  
+  replay_entry_t *next_entries; // From the current one, to replace entries once it is done.
+  int next_count, next_capacity;
+  
+  int cursor; // Entry past the last one found, as statements mostly come in the same order every time.
+  int hit_count, statement_count;
+  
+  FILE *stream; // Output of the statement being parsed, if any.
+  char *stream_text;
+  size_t stream_length;
+};
+
+struct replay_entry_t {
+  uint64_t hash; // Of the words of the statement.
+  
+  char *text; // Owned by entries, shared with next_entries (as is globals).
+  size_t length;
+  
+  entry_t *globals; // Declared by the statement, to declare again when replaying it.
+  int global_count;
+  
+  int is_used; // Found by the current compile (for entries).
+  int is_new;  // Not found in entries (for next_entries).
+};
+
+uint64_t        f_replay_hash(uint64_t hash, const void *data, size_t length);
+replay_entry_t *f_replay_find(replay_t *replay, uint64_t hash);
+void            f_replay_add(replay_t *replay, uint64_t hash, char *text, size_t length, const entry_t *globals, int global_count);
+
+void f_watch(const arch_t *arch, const source_t *source, const char *path, const char *output_path);
 
 // Architecture stuff
 
@@ -203,25 +793,53 @@ struct arch_t {
   
   int is_big; // High if big endian, little endian otherwise.
   
+  int arg_offset; // Of the last argument pushed, from the frame f_init_routine() sets up.
+  int reg_count;  // Registers locals can be kept in (see f_keep_local()).
+  
+  int reg_min_width; // Narrowest locals worth keeping in one.
+  
   void (*f_init)(void);
+  void (*f_exit)(void);
   
   void (*f_global)(const char *name);
   void (*f_const)(const_t value);
   void (*f_data)(const void *data, int length);
   
+  // Whatever comes in between may get held back, to be printed (cleaned up, even) by f_exit_routine().
   void (*f_init_routine)(int offset);
   void (*f_exit_routine)(void);
   
   void (*f_load_const)(const_t value);
   void (*f_load_local)(int width, int offset);
+  void (*f_load_global)(const char *name); // Its address.
+  void (*f_store_local)(int width, int offset);
   void (*f_push)(int width);
   void (*f_pull)(int width);
   void (*f_call)(int offset);
   
+  // Same as calling name, then exiting with whatever it gives, but reusing the current routine's frame: the
+  // offset bytes pushed for the call (no more than its own arguments take) replace those, and it jumps there.
+  void (*f_tail_call)(const char *name, int offset);
+  
+  // Locals at most data_width bytes wide can be kept in registers (numbered from 0) instead, once loaded by
+  // f_keep_local() or stored to by f_store_reg(). Calls do not keep any.
+  void (*f_keep_local)(int reg, int offset);
+  void (*f_load_reg)(int reg);
+  void (*f_store_reg)(int reg);
+  
   void (*f_zero_extend)(int new_width, int old_width);
   void (*f_sign_extend)(int new_width, int old_width);
   
-  int  (*f_next)(void);
+  // Infix operators (ir_add to ir_xor) on the accumulator and either the value pushed last (which they pull,
+  // being the right operand, or the left one if swapped) or a constant. Whatever the architecture lacks can
+  // call helpers instead, which f_exit() emits once, if used.
+  void (*f_op)(int op, int width, int is_signed, int is_swapped);
+  void (*f_op_const)(int op, int width, int is_signed, uint64_t value);
+  
+  // Registers locals can be kept in (as a mask, bit n being register n) that either one takes for itself.
+  int  (*f_op_kills)(int op, int width, int is_const);
+  
+  int  (*f_next)(void); // Labels are local to the routine they are in, f_init_routine() starts them over.
   void (*f_label)(int label);
   
   void (*f_jump)(int label);
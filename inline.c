@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <rtbc.h>
+
+// Inlining is done by the parser as it finds calls, with the bodies of routines it parsed before (after their
+// passes ran). Only leaf routines get inlined, so inlined bodies never have calls of their own to inline in
+// turn, and a routine cannot end up inlined into itself however it recurses.
+
+static int f_inline_arg(const routine_t *routine, int offset) {
+  for (int i = 0; i < routine->arg_count; i++) {
+    if (routine->arg_offsets[i] == offset) {
+      return i;
+    }
+  }
+  
+  return -1;
+}
+
+// Returns whether body can be inlined at all, and if so, how many more instructions inlining it would take
+// than calling it.
+
+int f_inline_cost(const arch_t *arch, const ir_t *body, const routine_t *routine, int *cost) {
+  *cost = -(routine->arg_count + 1);
+  
+  for (int i = 0; i < body->order_count; i++) {
+    const ir_block_t *block = body->blocks + body->order[i];
+    
+    for (int j = 0; j < block->inst_count; j++) {
+      const ir_inst_t *inst = block->insts + j;
+      
+      if (inst->op == ir_call || inst->op == ir_arg || (inst->op == ir_store && inst->offset > 0)) {
+        return 0;
+      }
+      
+      // Arguments are read whole, anything else is not worth it.
+      
+      if (inst->op == ir_local && inst->offset > 0) {
+        int arg = f_inline_arg(routine, inst->offset);
+        
+        if (arg < 0 || f_type_size(arch, inst->type) != f_type_size(arch, routine->arg_types[arg])) {
+          return 0;
+        }
+      }
+      
+      if (inst->op != ir_return) {
+        (*cost)++;
+      }
+    }
+  }
+  
+  return 1;
+}
+
+// Bodies only have a value to give if they exit once, at their very end (there is nowhere else to keep
+// it), but can exit anywhere if it goes unused.
+
+int f_inline_fits(const ir_t *body, int is_used) {
+  if (!is_used) {
+    return 1;
+  }
+  
+  int return_count = 0;
+  
+  for (int i = 0; i < body->order_count; i++) {
+    const ir_block_t *block = body->blocks + body->order[i];
+    
+    for (int j = 0; j < block->inst_count; j++) {
+      return_count += (block->insts[j].op == ir_return);
+    }
+  }
+  
+  const ir_block_t *last = (body->order_count ? body->blocks + body->order[body->order_count - 1] : NULL);
+  
+  return (return_count == 1 && last && last->inst_count && last->insts[last->inst_count - 1].op == ir_return);
+}
+
+// Whether body only computes values and exits, leaving the accumulator alone until its value gets used.
+
+int f_inline_is_flat(const ir_t *body) {
+  if (body->order_count > 1) {
+    return 0;
+  }
+  
+  for (int i = 0; i < body->order_count; i++) {
+    const ir_block_t *block = body->blocks + body->order[i];
+    
+    for (int j = 0; j < block->inst_count - 1; j++) {
+      if (!f_ir_has_value(block->insts[j].op)) {
+        return 0;
+      }
+    }
+  }
+  
+  return 1;
+}
+
+// Copies body right where ir is at, with its arguments read from args (already cast to their types) and its
+// locals put past the ones ir has. Exits become jumps past the copy, and the value of the last one (if any)
+// is returned, -1 otherwise.
+
+int f_inline(ir_t *ir, const ir_t *body, const routine_t *routine, const int *args) {
+  int *values = f_arena_alloc(ir->arena, (body->value_count + 1) * sizeof(int));
+  int *blocks = f_arena_alloc(ir->arena, (body->block_count + 1) * sizeof(int));
+  
+  for (int i = 0; i < body->block_count; i++) {
+    blocks[i] = f_ir_block(ir);
+  }
+  
+  int exit_block = f_ir_block(ir);
+  int result = -1;
+  
+  int local_base = -1; // Locals only get room if actually read.
+  
+  for (int i = 0; i < body->order_count; i++) {
+    const ir_block_t *block = body->blocks + body->order[i];
+    f_ir_place(ir, blocks[body->order[i]]);
+    
+    for (int j = 0; j < block->inst_count; j++) {
+      const ir_inst_t *inst = block->insts + j;
+      int arg = (inst->args[0] >= 0 ? values[inst->args[0]] : -1);
+      
+      if (inst->op == ir_const) {
+        values[inst->value] = f_ir_const(ir, inst->constant);
+      } else if (inst->op == ir_local && inst->offset > 0) {
+        values[inst->value] = args[f_inline_arg(routine, inst->offset)];
+      } else if (inst->op == ir_local || inst->op == ir_store) {
+        if (local_base < 0) {
+          local_base = ir->local_size;
+          ir->local_size += body->local_size;
+        }
+        
+        if (inst->op == ir_local) {
+          values[inst->value] = f_ir_local(ir, inst->type, inst->offset - local_base);
+        } else {
+          f_ir_store(ir, arg, inst->offset - local_base);
+        }
+      } else if (inst->op == ir_zero_extend || inst->op == ir_sign_extend) {
+        values[inst->value] = f_ir_extend(ir, inst->op, arg, inst->type);
+      } else if (f_ir_is_binary(inst->op)) {
+        values[inst->value] = f_ir_binary(ir, inst->op, arg, values[inst->args[1]], inst->type);
+      } else if (inst->op == ir_return) {
+        if (i == body->order_count - 1 && j == block->inst_count - 1) {
+          result = arg;
+        } else {
+          f_ir_jump(ir, ir_jump, -1, exit_block);
+        }
+      } else if (f_ir_is_end(inst->op)) {
+        f_ir_jump(ir, inst->op, arg, blocks[inst->block]);
+      } else {
+        f_error("Cannot inline '%s' into '%s'.\n", f_atom_name(body->atom), f_atom_name(ir->atom));
+      }
+    }
+  }
+  
+  f_ir_place(ir, exit_block);
+  return result;
+}
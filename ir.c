@@ -0,0 +1,881 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <rtbc.h>
+
+#define IR_MAX_PASSES 32
+#define IR_MAX_REGS   8 // Kept locals in, whatever the architecture has past that goes unused.
+
+static const ir_pass_t *ir_passes[IR_MAX_PASSES];
+static int ir_pass_count = 0;
+
+static const char *ir_names[] = {
+  "const",
+  "local",
+  "zero_extend",
+  "sign_extend",
+  "add",
+  "sub",
+  "mul",
+  "div",
+  "mod",
+  "and",
+  "or",
+  "xor",
+  "call",
+  
+  "arg",
+  "store",
+  
+  "jump",
+  "jump_z",
+  "jump_nz",
+  "jump_p",
+  "jump_np",
+  "return",
+};
+
+void f_ir_init(ir_t *ir, uint32_t atom, type_t exit_type, int arg_size, int local_size) {
+  ir->atom = atom;
+  ir->exit_type = exit_type;
+  ir->arg_size = arg_size;
+  ir->local_size = local_size;
+  
+  ir->block_count = 0;
+  ir->order_count = 0;
+  
+  ir->value_count = 0;
+}
+
+// Copy of a routine's blocks that stays around after the next routine reuses the arrays, without any spare
+// capacity. Blocks nothing jumps to get merged into the one before them (unless that one jumps away), so
+// copies only have as many blocks as they need.
+
+ir_t *f_ir_copy(arena_t *arena, const ir_t *ir) {
+  int *names = f_arena_alloc(arena, (ir->block_count + 1) * sizeof(int)); // Of every block in the copy.
+  int block_count = 0, inst_count = 0;
+  
+  for (int i = 0; i < ir->block_count; i++) {
+    names[i] = -1;
+  }
+  
+  for (int i = 0; i < ir->order_count; i++) {
+    const ir_block_t *block = ir->blocks + ir->order[i];
+    
+    for (int j = 0; j < block->inst_count; j++) {
+      if (block->insts[j].block >= 0) {
+        names[block->insts[j].block] = 0;
+      }
+    }
+  }
+  
+  for (int i = 0; i < ir->order_count; i++) {
+    const ir_block_t *last = (i ? ir->blocks + ir->order[i - 1] : NULL);
+    int is_merged = (last && names[ir->order[i]] < 0 && (!last->inst_count || !f_ir_is_end(last->insts[last->inst_count - 1].op)));
+    
+    names[ir->order[i]] = (is_merged ? block_count - 1 : block_count++);
+    inst_count += ir->blocks[ir->order[i]].inst_count;
+  }
+  
+  ir_t *copy = f_arena_alloc(arena, sizeof(ir_t));
+  ir_inst_t *insts = f_arena_alloc(arena, (inst_count + 1) * sizeof(ir_inst_t));
+  
+  *copy = (ir_t){
+    .arena = arena,
+    
+    .atom = ir->atom,
+    .exit_type = ir->exit_type,
+    .arg_size = ir->arg_size,
+    .local_size = ir->local_size,
+    
+    .blocks = f_arena_alloc(arena, (block_count + 1) * sizeof(ir_block_t)),
+    .block_count = block_count,
+    .block_capacity = block_count,
+    
+    .order = f_arena_alloc(arena, (block_count + 1) * sizeof(int)),
+    .order_count = block_count,
+    .order_capacity = block_count,
+    
+    .value_count = ir->value_count,
+    
+    .defs = NULL,
+    .def_capacity = 0,
+    
+    .values = NULL,
+    .value_capacity = 0,
+    
+    .ranges = NULL,
+    .range_count = 0,
+    .range_capacity = 0,
+  };
+  
+  for (int i = 0; i < ir->order_count; i++) {
+    const ir_block_t *block = ir->blocks + ir->order[i];
+    ir_block_t *block_copy = copy->blocks + names[ir->order[i]];
+    
+    if (!i || names[ir->order[i]] != names[ir->order[i - 1]]) {
+      *block_copy = (ir_block_t){
+        .insts = insts,
+        .inst_count = 0,
+        .inst_capacity = 0,
+        
+        .is_placed = 1,
+        .label = -1,
+        .position = 0,
+      };
+      
+      copy->order[names[ir->order[i]]] = names[ir->order[i]];
+    }
+    
+    for (int j = 0; j < block->inst_count; j++) {
+      ir_inst_t *inst = block_copy->insts + (block_copy->inst_count++);
+      *inst = block->insts[j];
+      
+      if (inst->block >= 0) {
+        inst->block = names[inst->block];
+      }
+    }
+    
+    block_copy->inst_capacity = block_copy->inst_count;
+    insts += block->inst_count;
+  }
+  
+  return copy;
+}
+
+int f_ir_block(ir_t *ir) {
+  int capacity = ir->block_capacity;
+  ir->blocks = f_arena_reserve(ir->arena, ir->blocks, ir->block_count + 1, &(ir->block_capacity), sizeof(ir_block_t));
+  
+  for (int i = capacity; i < ir->block_capacity; i++) {
+    ir->blocks[i] = (ir_block_t){
+      .insts = NULL,
+      .inst_count = 0,
+      .inst_capacity = 0,
+      
+      .is_placed = 0,
+      .label = -1,
+      .position = 0,
+    };
+  }
+  
+  ir_block_t *block = ir->blocks + ir->block_count;
+  
+  block->inst_count = 0;
+  block->is_placed = 0;
+  block->label = -1;
+  
+  return ir->block_count++;
+}
+
+// New instructions go at the end of the last block placed.
+
+void f_ir_place(ir_t *ir, int block) {
+  if (ir->blocks[block].is_placed) {
+    f_error("Block %d of '%s' placed twice.\n", block, f_atom_name(ir->atom));
+  }
+  
+  ir->order = f_arena_reserve(ir->arena, ir->order, ir->order_count + 1, &(ir->order_capacity), sizeof(int));
+  ir->order[ir->order_count++] = block;
+  
+  ir->blocks[block].is_placed = 1;
+}
+
+static ir_inst_t *f_ir_emit(ir_t *ir, int op, type_t type) {
+  ir_block_t *block = (ir->order_count ? ir->blocks + ir->order[ir->order_count - 1] : NULL);
+  
+  if (!block || (block->inst_count && f_ir_is_end(block->insts[block->inst_count - 1].op))) {
+    // Anything after a jump is only reachable through a label, so it needs a block of its own.
+    
+    f_ir_place(ir, f_ir_block(ir));
+    block = ir->blocks + ir->order[ir->order_count - 1];
+  }
+  
+  block->insts = f_arena_reserve(ir->arena, block->insts, block->inst_count + 1, &(block->inst_capacity), sizeof(ir_inst_t));
+  ir_inst_t *inst = block->insts + (block->inst_count++);
+  
+  *inst = (ir_inst_t){
+    .op = op,
+    
+    .value = (f_ir_has_value(op) ? ir->value_count++ : -1),
+    .type = type,
+    
+    .args = {-1, -1},
+    .block = -1,
+    
+    .offset = 0,
+  };
+  
+  return inst;
+}
+
+int f_ir_const(ir_t *ir, const_t value) {
+  ir_inst_t *inst = f_ir_emit(ir, ir_const, value.type);
+  inst->constant = value;
+  
+  return inst->value;
+}
+
+int f_ir_local(ir_t *ir, type_t type, int offset) {
+  ir_inst_t *inst = f_ir_emit(ir, ir_local, type);
+  inst->offset = offset;
+  
+  return inst->value;
+}
+
+int f_ir_extend(ir_t *ir, int op, int value, type_t type) {
+  ir_inst_t *inst = f_ir_emit(ir, op, type);
+  inst->args[0] = value;
+  
+  return inst->value;
+}
+
+int f_ir_binary(ir_t *ir, int op, int value_a, int value_b, type_t type) {
+  ir_inst_t *inst = f_ir_emit(ir, op, type);
+  
+  inst->args[0] = value_a;
+  inst->args[1] = value_b;
+  
+  return inst->value;
+}
+
+int f_ir_call(ir_t *ir, uint32_t atom, type_t type, int size) {
+  ir_inst_t *inst = f_ir_emit(ir, ir_call, type);
+  
+  inst->call.atom = atom;
+  inst->call.size = size;
+  
+  return inst->value;
+}
+
+void f_ir_arg(ir_t *ir, int value) {
+  ir_inst_t *inst = f_ir_emit(ir, ir_arg, (type_t){
+    .base_width = 0,
+    .base_signed = 0,
+    
+    .point_count = 0,
+  });
+  
+  inst->args[0] = value;
+}
+
+void f_ir_store(ir_t *ir, int value, int offset) {
+  ir_inst_t *inst = f_ir_emit(ir, ir_store, (type_t){
+    .base_width = 0,
+    .base_signed = 0,
+    
+    .point_count = 0,
+  });
+  
+  inst->args[0] = value;
+  inst->offset = offset;
+}
+
+// Both plain jumps (with value being -1) and conditional ones.
+
+void f_ir_jump(ir_t *ir, int op, int value, int block) {
+  ir_inst_t *inst = f_ir_emit(ir, op, (type_t){
+    .base_width = 0,
+    .base_signed = 0,
+    
+    .point_count = 0,
+  });
+  
+  inst->args[0] = value;
+  inst->block = block;
+}
+
+void f_ir_return(ir_t *ir, int value) {
+  ir_inst_t *inst = f_ir_emit(ir, ir_return, ir->exit_type);
+  inst->args[0] = value;
+}
+
+void f_ir_add_pass(const ir_pass_t *pass) {
+  if (ir_pass_count == IR_MAX_PASSES) {
+    f_error("Too many passes, cannot add '%s'.\n", pass->name);
+  }
+  
+  ir_passes[ir_pass_count++] = pass;
+}
+
+void f_ir_run(const arch_t *arch, ir_t *ir) {
+  for (int i = 0; i < ir_pass_count; i++) {
+    ir_passes[i]->f_run(arch, ir);
+  }
+  
+  if (f_do_debug) {
+    f_ir_dump(ir);
+  }
+}
+
+// Points defs at the instruction defining every value placed, for passes to look at (and lowering).
+
+void f_ir_defs(ir_t *ir) {
+  ir->defs = f_arena_reserve(ir->arena, ir->defs, ir->value_count, &(ir->def_capacity), sizeof(const ir_inst_t *));
+  
+  for (int i = 0; i < ir->order_count; i++) {
+    const ir_block_t *block = ir->blocks + ir->order[i];
+    
+    for (int j = 0; j < block->inst_count; j++) {
+      if (block->insts[j].value >= 0) {
+        ir->defs[block->insts[j].value] = block->insts + j;
+      }
+    }
+  }
+}
+
+static void f_ir_dump_type(type_t type) {
+  f_debug("%c%d", type.base_signed ? 's' : 'u', type.base_width * 8);
+  
+  for (int i = 0; i < type.point_count; i++) {
+    f_debug("*");
+  }
+}
+
+void f_ir_dump(const ir_t *ir) {
+  f_debug("Routine '%s':\n", f_atom_name(ir->atom));
+  
+  for (int i = 0; i < ir->order_count; i++) {
+    const ir_block_t *block = ir->blocks + ir->order[i];
+    f_debug("  block %d:\n", ir->order[i]);
+    
+    for (int j = 0; j < block->inst_count; j++) {
+      const ir_inst_t *inst = block->insts + j;
+      f_debug("    ");
+      
+      if (inst->value >= 0) {
+        f_debug("%%%d = ", inst->value);
+      }
+      
+      f_debug("%s", ir_names[inst->op]);
+      
+      if (f_ir_has_value(inst->op)) {
+        f_debug(" ");
+        f_ir_dump_type(inst->type);
+      }
+      
+      if (inst->op == ir_const) {
+        if (inst->constant.is_data) {
+          f_debug(" DATA + %lu", inst->constant.offset);
+        } else {
+          f_debug(" %lu", inst->constant.ux);
+        }
+      } else if (inst->op == ir_local || inst->op == ir_store) {
+        f_debug(" [%d]", inst->offset);
+      } else if (inst->op == ir_call) {
+        f_debug(" %s (%d)", f_atom_name(inst->call.atom), inst->call.size);
+      }
+      
+      for (int k = 0; k < 2; k++) {
+        if (inst->args[k] >= 0) {
+          f_debug(" %%%d", inst->args[k]);
+        }
+      }
+      
+      if (inst->block >= 0) {
+        f_debug(" -> block %d", inst->block);
+      }
+      
+      f_debug("\n");
+    }
+  }
+}
+
+// Locals (arguments included) get kept in whatever registers the architecture has for them, by linear scan
+// over the positions they get used at in lowering order. Values only get computed once used (see below), so
+// reads happen at whatever instruction ends up using them. Locals that do not fit are left in memory all
+// along, starting with those keeping them saves the least loads and stores on. Registers operators take for
+// themselves while a local is live are out for it (see f_op_kills()).
+
+static ir_range_t *f_ir_range(ir_t *ir, int offset) {
+  for (int i = 0; i < ir->range_count; i++) {
+    if (ir->ranges[i].offset == offset) {
+      return ir->ranges + i;
+    }
+  }
+  
+  return NULL;
+}
+
+static ir_range_t *f_ir_touch(const arch_t *arch, ir_t *ir, int offset, int width, int position) {
+  ir_range_t *range = f_ir_range(ir, offset);
+  
+  if (!range) {
+    ir->ranges = f_arena_reserve(ir->arena, ir->ranges, ir->range_count + 1, &(ir->range_capacity), sizeof(ir_range_t));
+    range = ir->ranges + (ir->range_count++);
+    
+    *range = (ir_range_t){
+      .offset = offset,
+      .start = position,
+      .end = position,
+      
+      .reads = 0,
+      .stores = 0,
+      .calls = 0,
+      .kills = 0,
+      
+      .is_loaded = 0,
+      .is_unfit = 0,
+      
+      .reg = -1,
+    };
+  }
+  
+  range->end = position;
+  range->is_unfit |= (width > arch->data_width || width < arch->reg_min_width);
+  
+  return range;
+}
+
+static void f_ir_reads(const arch_t *arch, ir_t *ir, int value, int position) {
+  const ir_inst_t *inst = ir->defs[value];
+  
+  if (inst->op == ir_local) {
+    ir_range_t *range = f_ir_touch(arch, ir, inst->offset, f_type_size(arch, inst->type), position);
+    
+    range->reads++;
+    range->is_loaded |= !range->stores;
+  } else if (inst->op == ir_zero_extend || inst->op == ir_sign_extend) {
+    f_ir_reads(arch, ir, inst->args[0], position);
+  } else if (f_ir_is_binary(inst->op)) {
+    f_ir_reads(arch, ir, inst->args[0], position);
+    f_ir_reads(arch, ir, inst->args[1], position);
+  }
+}
+
+// Calls exited with right away (self-recursive ones included) become jumps, if there is room in our own
+// arguments for theirs.
+
+static int f_ir_is_tail_call(const ir_t *ir, const ir_block_t *block, int index) {
+  const ir_inst_t *inst = block->insts + index;
+  const ir_inst_t *next = (index < block->inst_count - 1 ? inst + 1 : NULL);
+  
+  return (next && next->op == ir_return && next->args[0] == inst->value && inst->call.size <= ir->arg_size);
+}
+
+// Registers computing value takes for operators, the way f_ir_value() goes about it.
+
+static int f_ir_kills(const arch_t *arch, ir_t *ir, int value) {
+  const ir_inst_t *inst = ir->defs[value];
+  ir_value_t *known = ir->values + value;
+  
+  if (known->kills >= 0) {
+    return known->kills;
+  } else if (inst->op == ir_zero_extend || inst->op == ir_sign_extend) {
+    known->kills = f_ir_kills(arch, ir, inst->args[0]);
+  } else if (f_ir_is_binary(inst->op)) {
+    const ir_inst_t *other = ir->defs[inst->args[1]];
+    int is_const = (other->op == ir_const && !other->constant.is_data);
+    
+    known->kills = (arch->f_op_kills(inst->op, f_type_size(arch, inst->type), is_const) |
+                    f_ir_kills(arch, ir, inst->args[0]) | f_ir_kills(arch, ir, inst->args[1]));
+  } else {
+    known->kills = 0;
+  }
+  
+  return known->kills;
+}
+
+// Loads and stores a register saves over memory, loading it again after every call included (along with
+// storing it to memory too, so there is something to load). Architectures can mostly read memory right
+// where they need it, so it takes saving more than one to be worth it.
+
+static int f_ir_saves(const ir_range_t *range) {
+  return range->reads + range->stores - range->is_loaded - range->calls - (range->calls ? range->stores : 0);
+}
+
+static void f_ir_alloc(const arch_t *arch, ir_t *ir) {
+  ir->range_count = 0;
+  
+  if (!arch->reg_count) {
+    return;
+  }
+  
+  for (int i = 0, position = 0; i < ir->order_count; i++) {
+    const ir_block_t *block = ir->blocks + ir->order[i];
+    
+    for (int j = 0; j < block->inst_count; j++, position++) {
+      const ir_inst_t *inst = block->insts + j;
+      
+      if (f_ir_has_value(inst->op) || inst->args[0] < 0) {
+        continue;
+      }
+      
+      f_ir_reads(arch, ir, inst->args[0], position);
+      
+      if (inst->op == ir_store) {
+        f_ir_touch(arch, ir, inst->offset, f_type_size(arch, ir->defs[inst->args[0]]->type), position)->stores++;
+      }
+    }
+  }
+  
+  // Locals loaded first have to be loaded where every path goes through, and those used in a loop have to
+  // stay there all the way around it.
+  
+  for (int i = 0; i < ir->range_count; i++) {
+    if (ir->ranges[i].is_loaded) {
+      ir->ranges[i].start = -1; // Before the very first instruction, which might be a call.
+    }
+  }
+  
+  for (int i = 0, position = 0; i < ir->order_count; i++) {
+    const ir_block_t *block = ir->blocks + ir->order[i];
+    
+    for (int j = 0; j < block->inst_count; j++, position++) {
+      const ir_inst_t *inst = block->insts + j;
+      int target = (inst->block >= 0 ? ir->blocks[inst->block].position : position + 1);
+      
+      for (int k = 0; k < ir->range_count && target <= position; k++) {
+        ir_range_t *range = ir->ranges + k;
+        
+        if (range->start <= position && range->end >= target) {
+          range->start = (range->start < target ? range->start : target);
+          range->end = (range->end > position ? range->end : position);
+        }
+      }
+    }
+  }
+  
+  // Only counted once they are stretched, as calls in a loop can come before the last use in it (tail calls
+  // never come back, so they do not count). Operators can take a register while it still has to be read at
+  // the same position, so those count there too.
+  
+  for (int i = 0, position = 0; i < ir->order_count; i++) {
+    const ir_block_t *block = ir->blocks + ir->order[i];
+    
+    for (int j = 0; j < block->inst_count; j++, position++) {
+      const ir_inst_t *inst = block->insts + j;
+      int kills = (f_ir_has_value(inst->op) || inst->args[0] < 0 ? 0 : f_ir_kills(arch, ir, inst->args[0]));
+      int is_call = (inst->op == ir_call && !f_ir_is_tail_call(ir, block, j));
+      
+      for (int k = 0; k < ir->range_count && (is_call || kills); k++) {
+        ir_range_t *range = ir->ranges + k;
+        
+        range->calls += (is_call && range->start < position && range->end > position);
+        range->kills |= (range->start < position && range->end >= position ? kills : 0);
+      }
+    }
+  }
+  
+  // Ranges are few, so sorting them by start by insertion (and going through every one before to find the
+  // active ones) is fine.
+  
+  for (int i = 1; i < ir->range_count; i++) {
+    ir_range_t range = ir->ranges[i];
+    int j = i;
+    
+    for (; j > 0 && ir->ranges[j - 1].start > range.start; j--) {
+      ir->ranges[j] = ir->ranges[j - 1];
+    }
+    
+    ir->ranges[j] = range;
+  }
+  
+  for (int i = 0; i < ir->range_count; i++) {
+    ir_range_t *range = ir->ranges + i;
+    
+    if (range->is_unfit || f_ir_saves(range) < 2) {
+      continue;
+    }
+    
+    int is_used[IR_MAX_REGS] = {0};
+    ir_range_t *cheapest = NULL; // Of those active, in a register range can take.
+    
+    for (int j = 0; j < i; j++) {
+      ir_range_t *other = ir->ranges + j;
+      
+      if (other->reg < 0 || other->end < range->start) {
+        continue;
+      }
+      
+      is_used[other->reg] = 1;
+      
+      if (!((range->kills >> other->reg) & 1) && (!cheapest || f_ir_saves(other) < f_ir_saves(cheapest))) {
+        cheapest = other;
+      }
+    }
+    
+    for (int j = 0; j < arch->reg_count && j < IR_MAX_REGS && range->reg < 0; j++) {
+      if (!is_used[j] && !((range->kills >> j) & 1)) {
+        range->reg = j;
+      }
+    }
+    
+    if (range->reg < 0 && cheapest && f_ir_saves(cheapest) < f_ir_saves(range)) {
+      range->reg = cheapest->reg;
+      cheapest->reg = -1;
+    }
+  }
+}
+
+// The architectures only have an accumulator for now (besides registers for locals), so lowering mostly means
+// making sure the value an instruction uses is the one in there. Values only get computed once used (calls
+// aside), and computed again if something else went in there meanwhile, which calls cannot be: their values
+// have to be used right away (the parser makes sure of that, see call_t), or at least before anything else
+// goes in there.
+
+// Lowest and highest values computing value goes through (itself included), so that f_ir_uses() only has to
+// look where the one in the accumulator could be.
+
+static const ir_value_t *f_ir_span(ir_t *ir, int value) {
+  const ir_inst_t *inst = ir->defs[value];
+  ir_value_t *known = ir->values + value;
+  
+  if (known->lowest >= 0) {
+    return known;
+  }
+  
+  known->lowest = value;
+  known->highest = value;
+  
+  int is_extend = (inst->op == ir_zero_extend || inst->op == ir_sign_extend);
+  int arg_count = (f_ir_is_binary(inst->op) ? 2 : is_extend);
+  
+  for (int i = 0; i < arg_count; i++) {
+    const ir_value_t *arg = f_ir_span(ir, inst->args[i]);
+    
+    known->lowest = (arg->lowest < known->lowest ? arg->lowest : known->lowest);
+    known->highest = (arg->highest > known->highest ? arg->highest : known->highest);
+  }
+  
+  return known;
+}
+
+// Whether computing value takes the one in the accumulator.
+
+static int f_ir_uses(ir_t *ir, int value, int acc) {
+  const ir_value_t *known = f_ir_span(ir, value);
+  
+  if (value == acc) {
+    return 1;
+  } else if (acc < known->lowest || acc > known->highest) {
+    return 0;
+  }
+  
+  const ir_inst_t *inst = ir->defs[value];
+  
+  if (inst->op == ir_zero_extend || inst->op == ir_sign_extend) {
+    return f_ir_uses(ir, inst->args[0], acc);
+  } else if (f_ir_is_binary(inst->op)) {
+    return (f_ir_uses(ir, inst->args[0], acc) || f_ir_uses(ir, inst->args[1], acc));
+  }
+  
+  return 0;
+}
+
+// How many values computing value has to set aside at once (its Sethi-Ullman number), with either operand of
+// each operator going first. Constants and locals get used right where they are, so they take none.
+
+static int f_ir_need(ir_t *ir, int value) {
+  const ir_inst_t *inst = ir->defs[value];
+  ir_value_t *known = ir->values + value;
+  
+  if (known->need >= 0) {
+    return known->need;
+  } else if (inst->op == ir_zero_extend || inst->op == ir_sign_extend) {
+    known->need = f_ir_need(ir, inst->args[0]);
+  } else if (!f_ir_is_binary(inst->op)) {
+    known->need = 0;
+  } else if (ir->defs[inst->args[1]]->op == ir_const || ir->defs[inst->args[1]]->op == ir_local) {
+    known->need = f_ir_need(ir, inst->args[0]);
+  } else {
+    int need_a = f_ir_need(ir, inst->args[0]);
+    int need_b = f_ir_need(ir, inst->args[1]);
+    
+    known->need = (need_a == need_b ? need_a + 1 : (need_a > need_b ? need_a : need_b));
+  }
+  
+  return known->need;
+}
+
+static void f_ir_value(const arch_t *arch, ir_t *ir, int value, int *acc) {
+  if (*acc == value) {
+    return;
+  }
+  
+  const ir_inst_t *inst = ir->defs[value];
+  
+  if (inst->op == ir_const) {
+    arch->f_load_const(inst->constant);
+  } else if (inst->op == ir_local) {
+    const ir_range_t *range = f_ir_range(ir, inst->offset);
+    
+    if (range && range->reg >= 0) {
+      arch->f_load_reg(range->reg);
+    } else {
+      arch->f_load_local(f_type_size(arch, inst->type), inst->offset);
+    }
+  } else if (inst->op == ir_zero_extend || inst->op == ir_sign_extend) {
+    int old_width = f_type_size(arch, ir->defs[inst->args[0]]->type);
+    int new_width = f_type_size(arch, inst->type);
+    
+    f_ir_value(arch, ir, inst->args[0], acc);
+    
+    if (inst->op == ir_zero_extend) {
+      arch->f_zero_extend(new_width, old_width);
+    } else {
+      arch->f_sign_extend(new_width, old_width);
+    }
+  } else if (f_ir_is_binary(inst->op)) {
+    const ir_inst_t *other = ir->defs[inst->args[1]];
+    
+    int width = f_type_size(arch, inst->type);
+    int is_signed = (inst->type.base_signed && !inst->type.point_count);
+    
+    // Whichever operand needs more values set aside goes first (the right one if tied), unless either one is
+    // the one already in the accumulator.
+    
+    int is_left_first = (f_ir_uses(ir, inst->args[0], *acc) || (!f_ir_uses(ir, inst->args[1], *acc) &&
+                         f_ir_need(ir, inst->args[0]) > f_ir_need(ir, inst->args[1])));
+                         
+    if (other->op == ir_const && !other->constant.is_data) {
+      f_ir_value(arch, ir, inst->args[0], acc);
+      arch->f_op_const(inst->op, width, is_signed, other->constant.ux);
+    } else if (is_left_first) {
+      f_ir_value(arch, ir, inst->args[0], acc);
+      arch->f_push(width);
+      
+      f_ir_value(arch, ir, inst->args[1], acc);
+      arch->f_op(inst->op, width, is_signed, 1);
+    } else {
+      f_ir_value(arch, ir, inst->args[1], acc);
+      arch->f_push(width);
+      
+      f_ir_value(arch, ir, inst->args[0], acc);
+      arch->f_op(inst->op, width, is_signed, 0);
+    }
+  } else {
+    f_error("Cannot compute value %%%d of '%s' again.\n", value, f_atom_name(ir->atom));
+  }
+  
+  *acc = value;
+}
+
+void f_ir_lower(const arch_t *arch, ir_t *ir) {
+  f_ir_defs(ir);
+  int exit_label = -1;
+  
+  ir->values = f_arena_reserve(ir->arena, ir->values, ir->value_count, &(ir->value_capacity), sizeof(ir_value_t));
+  
+  for (int i = 0; i < ir->value_count; i++) {
+    ir->values[i] = (ir_value_t){
+      .kills = -1,
+      .need = -1,
+      
+      .lowest = -1,
+      .highest = -1,
+    };
+  }
+  
+  arch->f_global(f_atom_name(ir->atom));
+  arch->f_init_routine(ir->local_size);
+  
+  // Labels go to blocks something jumps to, and to the exit if anything but the very last instruction
+  // returns.
+  
+  for (int i = 0, position = 0; i < ir->order_count; i++) {
+    ir_block_t *block = ir->blocks + ir->order[i];
+    
+    block->position = position;
+    position += block->inst_count;
+    
+    for (int j = 0; j < block->inst_count; j++) {
+      const ir_inst_t *inst = block->insts + j;
+      
+      if (inst->block >= 0 && ir->blocks[inst->block].label < 0) {
+        ir->blocks[inst->block].label = arch->f_next();
+      } else if (inst->op == ir_return && exit_label < 0 && (i < ir->order_count - 1 || j < block->inst_count - 1)) {
+        exit_label = arch->f_next();
+      }
+    }
+  }
+  
+  f_ir_alloc(arch, ir);
+  
+  for (int i = 0; i < ir->range_count; i++) {
+    if (ir->ranges[i].reg >= 0 && ir->ranges[i].is_loaded) {
+      arch->f_keep_local(ir->ranges[i].reg, ir->ranges[i].offset);
+    }
+  }
+  
+  int acc = -1; // Value in the accumulator, if any.
+  
+  for (int i = 0; i < ir->order_count; i++) {
+    const ir_block_t *block = ir->blocks + ir->order[i];
+    
+    if (block->label >= 0) {
+      arch->f_label(block->label);
+      acc = -1;
+    }
+    
+    for (int j = 0; j < block->inst_count; j++) {
+      const ir_inst_t *inst = block->insts + j;
+      int position = block->position + j;
+      
+      if (inst->op == ir_call) {
+        if (f_ir_is_tail_call(ir, block, j)) {
+          arch->f_tail_call(f_atom_name(inst->call.atom), inst->call.size);
+          
+          j++;
+          continue;
+        }
+        
+        arch->f_load_global(f_atom_name(inst->call.atom));
+        arch->f_call(inst->call.size);
+        
+        for (int k = 0; k < ir->range_count; k++) {
+          const ir_range_t *range = ir->ranges + k;
+          
+          if (range->reg >= 0 && range->start < position && range->end > position) {
+            arch->f_keep_local(range->reg, range->offset);
+          }
+        }
+        
+        acc = inst->value;
+        continue;
+      } else if (f_ir_has_value(inst->op)) {
+        continue;
+      }
+      
+      if (inst->args[0] >= 0) {
+        f_ir_value(arch, ir, inst->args[0], &acc);
+      }
+      
+      int width = (inst->args[0] >= 0 ? f_type_size(arch, ir->defs[inst->args[0]]->type) : 0);
+      int label = (inst->block >= 0 ? ir->blocks[inst->block].label : -1);
+      
+      if (inst->op == ir_arg) {
+        arch->f_push(width);
+      } else if (inst->op == ir_store) {
+        const ir_range_t *range = f_ir_range(ir, inst->offset);
+        
+        if (!range || range->reg < 0 || range->calls) {
+          arch->f_store_local(width, inst->offset);
+        }
+        
+        if (range && range->reg >= 0) {
+          arch->f_store_reg(range->reg);
+        }
+      } else if (inst->op == ir_jump) {
+        arch->f_jump(label);
+      } else if (inst->op == ir_jump_z) {
+        arch->f_jump_z(width, label);
+      } else if (inst->op == ir_jump_nz) {
+        arch->f_jump_nz(width, label);
+      } else if (inst->op == ir_jump_p) {
+        arch->f_jump_p(width, label);
+      } else if (inst->op == ir_jump_np) {
+        arch->f_jump_np(width, label);
+      } else if (inst->op == ir_return && exit_label >= 0 && (i < ir->order_count - 1 || j < block->inst_count - 1)) {
+        arch->f_jump(exit_label);
+      }
+    }
+  }
+  
+  if (exit_label >= 0) {
+    arch->f_label(exit_label);
+  }
+  
+  arch->f_exit_routine();
+}
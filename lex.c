@@ -0,0 +1,917 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <rtbc.h>
+
+#define LEX_THREAD_LENGTH 1048576 // Bytes of queued headers worth starting the lexing threads for.
+
+enum {
+  unit_queued,
+  unit_lexing,
+  unit_done,
+};
+
+// Keyword lookup, switching on length and first character so any identifier needs at most a couple of
+// comparisons. Keep in sync with the k_* entries in rtbc.h.
+
+static int f_keyword(const char *name, int length) {
+  #define KEYWORD(text, type) if (!memcmp(name, text, length)) return type
+  
+  switch (length) {
+    case 1:
+      KEYWORD("S", k_s);
+      KEYWORD("L", k_l);
+      break;
+    case 2:
+      if (name[0] == 'U') {
+        KEYWORD("US", k_us);
+        KEYWORD("UL", k_ul);
+        KEYWORD("U8", k_u8);
+      }
+      
+      break;
+    case 3:
+      switch (name[0]) {
+        case 'U':
+          KEYWORD("U16", k_u16);
+          KEYWORD("U32", k_u32);
+          KEYWORD("U64", k_u64);
+          KEYWORD("USE", k_use);
+          break;
+        case 'I':
+          KEYWORD("IFZ", k_ifz);
+          KEYWORD("IFP", k_ifp);
+          break;
+        case 'W':
+          KEYWORD("WHZ", k_whz);
+          KEYWORD("WHP", k_whp);
+          break;
+      }
+      
+      break;
+    case 4:
+      switch (name[0]) {
+        case 'I':
+          KEYWORD("IFNZ", k_ifnz);
+          KEYWORD("IFNP", k_ifnp);
+          break;
+        case 'W':
+          KEYWORD("WHNZ", k_whnz);
+          KEYWORD("WHNP", k_whnp);
+          break;
+        case 'E':
+          KEYWORD("ELSE", k_else);
+          break;
+        case 'N':
+          KEYWORD("NEXT", k_next);
+          break;
+        case 'O':
+          KEYWORD("ONLY", k_only);
+          break;
+      }
+      
+      break;
+    case 5:
+      switch (name[0]) {
+        case 'B':
+          KEYWORD("BREAK", k_break);
+          break;
+        case 'M':
+          KEYWORD("MACRO", k_macro);
+          break;
+      }
+      
+      break;
+  }
+  
+  #undef KEYWORD
+  return l_name;
+}
+
+// Value of a digit in any base up to 16 (whatever the base, like before), -1 if not a digit at all.
+
+static int f_lex_digit(char chr) {
+  uint8_t upper = (uint8_t)(chr) & ~0x20;
+  
+  if (chr >= '0' && chr <= '9') {
+    return chr - '0';
+  } else if (upper >= 'A' && upper <= 'F') {
+    return (upper - 'A') + 10;
+  }
+  
+  return -1;
+}
+
+// Maps the whole file in memory, falling back to a single bulk read for pipes and other files mmap() cannot
+// handle. Returns 0 if the file cannot be read at all. If mtime is not NULL, it gets the mtime of the file as
+// it was opened (in nanoseconds), or -1 if it is not a regular file.
+
+int f_lex_map(const char *path, char **buffer, size_t *length, int *is_mapped, int64_t *mtime) {
+  int fd = open(path, O_RDONLY);
+  struct stat info;
+  
+  *buffer = NULL;
+  *length = 0;
+  *is_mapped = 0;
+  
+  if (mtime) {
+    *mtime = -1;
+  }
+  
+  if (fd < 0) {
+    return 0;
+  }
+  
+  if (!fstat(fd, &info) && S_ISREG(info.st_mode)) {
+    if (mtime) {
+      *mtime = (int64_t)(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    }
+    
+    if (!info.st_size) {
+      close(fd);
+      return 1;
+    }
+    
+    *buffer = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    if (*buffer != MAP_FAILED) {
+      madvise(*buffer, info.st_size, MADV_SEQUENTIAL);
+      close(fd);
+      
+      *length = info.st_size;
+      *is_mapped = 1;
+      
+      return 1;
+    }
+    
+    *buffer = NULL;
+  }
+  
+  size_t capacity = 0;
+  
+  for (;;) {
+    if (*length == capacity) {
+      capacity = (capacity ? capacity * 2 : 65536);
+      *buffer = realloc(*buffer, capacity);
+    }
+    
+    ssize_t count = read(fd, *buffer + *length, capacity - *length);
+    
+    if (count < 0) {
+      free(*buffer);
+      close(fd);
+      
+      *buffer = NULL;
+      return 0;
+    } else if (!count) {
+      break;
+    }
+    
+    *length += count;
+  }
+  
+  close(fd);
+  return 1;
+}
+
+void f_lex_unmap(char *buffer, size_t length, int is_mapped) {
+  if (is_mapped) {
+    munmap(buffer, length);
+  } else {
+    free(buffer);
+  }
+}
+
+void f_lex_locate(const char *buffer, size_t length, size_t offset, int *line, int *column) {
+  *line = 1;
+  *column = 1;
+  
+  for (size_t i = 0; i < offset && i < length; i++) {
+    if (buffer[i] == '\n') {
+      (*line)++;
+      *column = 1;
+    } else {
+      (*column)++;
+    }
+  }
+}
+
+// Errors found while lexing are only kept in the unit, as it might never get used (say, if a guard rejects
+// it, or it was prefetched for nothing). It is up to whoever splices the unit to report it.
+
+static void f_lex_error(unit_t *unit, const char *buffer, size_t length, size_t offset, const char *format, ...) {
+  char message[512];
+  int line, column;
+  
+  va_list args;
+  va_start(args, format);
+  
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  
+  f_lex_locate(buffer, length, offset, &line, &column);
+  
+  size_t error_length = snprintf(NULL, 0, "(At '%s', line %d, column %d) %s", unit->name, line, column, message);
+  unit->error = f_arena_alloc(&(unit->arena), error_length + 1);
+  
+  snprintf(unit->error, error_length + 1, "(At '%s', line %d, column %d) %s", unit->name, line, column, message);
+}
+
+static uint32_t f_lex_hash(const char *name, int length) {
+  uint32_t hash = 2166136261u;
+  
+  for (int i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)(name[i])) * 16777619u;
+  }
+  
+  return hash;
+}
+
+static uint64_t *f_lex_slot(unit_t *unit, const char *name, int length, uint32_t hash) {
+  int index = hash & (unit->name_slot_capacity - 1);
+  
+  for (;;) {
+    uint64_t *slot = unit->name_slots + index;
+    
+    if (!*slot) {
+      return slot;
+    }
+    
+    if ((uint32_t)(*slot >> 32) == hash) {
+      const char *other = unit->name_data + unit->name_offsets[(uint32_t)(*slot) - 1];
+      
+      if (!memcmp(other, name, length) && !other[length]) {
+        return slot;
+      }
+    }
+    
+    index = (index + 1) & (unit->name_slot_capacity - 1);
+  }
+}
+
+static void f_lex_grow(unit_t *unit) {
+  uint64_t *slots = unit->name_slots;
+  int capacity = unit->name_slot_capacity;
+  
+  unit->name_slot_capacity = (capacity ? capacity * 2 : 64);
+  unit->name_slots = f_arena_alloc(&(unit->arena), unit->name_slot_capacity * sizeof(uint64_t));
+  
+  memset(unit->name_slots, 0, unit->name_slot_capacity * sizeof(uint64_t));
+  
+  for (int i = 0; i < capacity; i++) {
+    if (!slots[i]) {
+      continue;
+    }
+    
+    int index = (uint32_t)(slots[i] >> 32) & (unit->name_slot_capacity - 1);
+    
+    while (unit->name_slots[index]) {
+      index = (index + 1) & (unit->name_slot_capacity - 1);
+    }
+    
+    unit->name_slots[index] = slots[i];
+  }
+}
+
+// Interns a name into the unit's own atoms (see unit_t).
+
+static uint32_t f_lex_name(unit_t *unit, const char *name, int length) {
+  if ((unit->name_count + 1) * 2 > unit->name_slot_capacity) {
+    f_lex_grow(unit);
+  }
+  
+  uint32_t hash = f_lex_hash(name, length);
+  uint64_t *slot = f_lex_slot(unit, name, length, hash);
+  
+  if (*slot) {
+    return (uint32_t)(*slot) - 1;
+  }
+  
+  unit->name_data = f_arena_reserve(&(unit->arena), unit->name_data, unit->name_data_length + length + 1, &(unit->name_data_capacity), 1);
+  unit->name_offsets = f_arena_reserve(&(unit->arena), unit->name_offsets, unit->name_count + 1, &(unit->name_capacity), sizeof(uint32_t));
+  
+  memcpy(unit->name_data + unit->name_data_length, name, length);
+  unit->name_data[unit->name_data_length + length] = '\0';
+  
+  unit->name_offsets[unit->name_count] = unit->name_data_length;
+  unit->name_data_length += length + 1;
+  
+  *slot = ((uint64_t)(hash) << 32) | (unit->name_count + 1);
+  return unit->name_count++;
+}
+
+static void f_lex_push(unit_t *unit, const word_t *word, uint32_t offset) {
+  int count = unit->word_count;
+  
+  if (count == unit->word_capacity) {
+    int capacity = unit->word_capacity;
+    
+    unit->word_types = f_arena_reserve(&(unit->arena), unit->word_types, count + 1, &capacity, sizeof(uint8_t));
+    unit->word_offsets = f_arena_reserve(&(unit->arena), unit->word_offsets, count + 1, &(unit->word_capacity), sizeof(uint32_t));
+  }
+  
+  unit->word_types[count] = word->type;
+  unit->word_offsets[count] = offset;
+  
+  unit->word_count++;
+  
+  if (f_word_has_value(word->type)) {
+    unit->values = f_arena_reserve(&(unit->arena), unit->values, unit->value_count + 1, &(unit->value_capacity), sizeof(value_t));
+    memcpy(unit->values + (unit->value_count++), &(word->ux), sizeof(value_t));
+  }
+  
+  if (word->type == l_str) {
+    unit->string_lengths = f_arena_reserve(&(unit->arena), unit->string_lengths, unit->string_count + 1, &(unit->string_capacity), sizeof(int));
+    unit->string_lengths[unit->string_count++] = unit->data_length - (int)(word->str);
+  }
+}
+
+// Lexes a whole file on its own, without looking at "only", "use" or "macro" at all (those are handled
+// while splicing units into a source), or loads it from its cache entry if it has a valid one. Safe to run
+// on any thread.
+
+static void f_lex_unit(unit_t *unit, const char *cache_path) {
+  if (f_cache_load(unit, cache_path)) {
+    return;
+  }
+  
+  char *buffer;
+  size_t length;
+  int is_mapped;
+  int64_t mtime; // As it got opened, since it can be touched while lexing it.
+  
+  if (!f_lex_map(unit->path, &buffer, &length, &is_mapped, &mtime)) {
+    size_t error_length = snprintf(NULL, 0, "Cannot open file: '%s'\n", unit->name);
+    unit->error = f_arena_alloc(&(unit->arena), error_length + 1);
+    
+    snprintf(unit->error, error_length + 1, "Cannot open file: '%s'\n", unit->name);
+    return;
+  }
+  
+  const char *file_ptr = buffer, *file_end = buffer + length;
+  int is_end = 0;
+  
+  word_t word = (word_t){
+    .type = w_invalid,
+    .index = -1,
+  };
+  
+  uint32_t word_offset = 0;
+  int in_use = 0;
+  
+  int64_t temp = 0; // Length for names and strings, bases for numbers, etc.
+  int reuse_chr = 0, done = 0;
+  
+  char chr = '\0';
+  char name[MAX_LENGTH + 1];
+  
+  for (;;) {
+    if (word.type != w_invalid && done) {
+      if (word.type == l_name) {
+        word.type = f_keyword(name, temp);
+        
+        if (word.type == l_name) {
+          word.atom = f_lex_name(unit, name, temp);
+        }
+      }
+      
+      // Remember what "use" statements point at, so those files can be lexed ahead of time.
+      
+      if (word.type == k_use) {
+        in_use = 1;
+      } else if (word.type == s_semicolon) {
+        in_use = 0;
+      } else if (word.type == l_str && in_use) {
+        unit->uses = f_arena_reserve(&(unit->arena), unit->uses, unit->use_count + 1, &(unit->use_capacity), sizeof(char *));
+        unit->uses[unit->use_count++] = f_arena_strdup(&(unit->arena), unit->data_buffer + word.str);
+      }
+      
+      f_lex_push(unit, &word, word_offset);
+      done = 0;
+      
+      word = (word_t){
+        .type = w_invalid,
+        .index = -1,
+      };
+    }
+    
+    if (reuse_chr) {
+      reuse_chr = 0;
+    } else {
+      if (file_ptr < file_end) {
+        chr = *(file_ptr++);
+      } else if (!is_end) {
+        // Feed a single EOF past the end, so the last word gets terminated just like any other one.
+        
+        chr = (char)(EOF);
+        is_end = 1;
+      } else {
+        break;
+      }
+    }
+    
+    if (word.type == w_invalid) {
+      word_offset = (file_ptr - buffer) - 1;
+      
+      if (chr == ' ' || chr == '\t' || chr == '\n' || chr == '\r') {
+        file_ptr = f_scan_space(file_ptr, file_end);
+      } else if (isalpha(chr) || chr == '_' || chr == '$') {
+        // Find where the name ends first, so its characters only get looked at once more to copy them.
+        
+        const char *next = f_scan_name(file_ptr, file_end);
+        
+        if (next - file_ptr >= MAX_LENGTH) {
+          f_lex_error(unit, buffer, length, word_offset, "Identifiers can only be %d characters long, found '%c'.\n", MAX_LENGTH, file_ptr[MAX_LENGTH - 1]);
+          break;
+        }
+        
+        word.type = l_name;
+        name[0] = toupper(chr);
+        
+        for (temp = 1; file_ptr < next; temp++) {
+          name[temp] = toupper(*(file_ptr++));
+        }
+        
+        done = 1;
+      } else if (isdigit(chr)) {
+        word.type = l_x;
+        word.x = (chr - '0');
+        
+        if (chr == '0') {
+          word.type = l_ux;
+          temp = 8;
+        } else {
+          temp = 10;
+        }
+      } else if (chr == '\'') {
+        word.type = l_chr;
+        word.chr = '\0';
+      } else if (chr == '"') {
+        word.type = l_str;
+        word.str = unit->data_length;
+      } else if (chr == '(') {
+        word.type = s_l_paren;
+        done = 1;
+      } else if (chr == ')') {
+        word.type = s_r_paren;
+        done = 1;
+      } else if (chr == '[') {
+        word.type = s_l_bracket;
+        done = 1;
+      } else if (chr == ']') {
+        word.type = s_r_bracket;
+        done = 1;
+      } else if (chr == ':') {
+        word.type = s_colon;
+        done = 1;
+      } else if (chr == ';') {
+        word.type = s_semicolon;
+        done = 1;
+      } else if (chr == ',') {
+        word.type = s_comma;
+        done = 1;
+      } else if (chr == '<') {
+        word.type = s_l_shift;
+        done = 1;
+      } else if (chr == '>') {
+        word.type = s_r_shift;
+        done = 1;
+      } else if (chr == '!') {
+        word.type = s_not;
+        done = 1;
+      } else if (chr == '&') {
+        word.type = s_and;
+        done = 1;
+      } else if (chr == '\\') {
+        word.type = s_or;
+        done = 1;
+      } else if (chr == '^') {
+        word.type = s_xor;
+        done = 1;
+      } else if (chr == '+') {
+        word.type = s_add;
+        done = 1;
+      } else if (chr == '-') {
+        word.type = s_sub;
+        done = 1;
+      } else if (chr == '*') {
+        word.type = s_mul;
+        done = 1;
+      } else if (chr == '/') {
+        word.type = s_div;
+        done = 1;
+      } else if (chr == '%') {
+        word.type = s_mod;
+        done = 1;
+      } else if (chr == '=') {
+        word.type = s_assign;
+        done = 1;
+      } else if (chr == '#') {
+        word.type = w_comment;
+      } else if (chr == '@') {
+        word.type = w_at;
+      }
+    } else if (word.type == w_comment) {
+      if (chr == '\n') {
+        word.type = w_invalid;
+      } else {
+        // Jump right before the next newline, nothing inside a comment matters.
+        
+        const char *next = memchr(file_ptr, '\n', file_end - file_ptr);
+        
+        if (!next) {
+          next = file_end;
+        }
+        
+        file_ptr = next;
+      }
+    } else if (word.type == l_ux || word.type == l_x) {
+      int digit = f_lex_digit(chr);
+      
+      if (digit >= 0) {
+        word.x = word.x * temp + digit;
+      } else {
+        if (!word.x && temp == 8 && toupper(chr) == 'X') {
+          temp = 16;
+        } else if (toupper(chr) == 'U') {
+          word.type = l_ux;
+          done = 1;
+        } else if (isalnum(chr)) {
+          f_lex_error(unit, buffer, length, word_offset, "Expected base %ld digit, found '%c'.\n", temp, chr);
+          break;
+        } else {
+          reuse_chr = 1;
+          done = 1;
+        }
+      }
+    } else if (word.type == l_chr) {
+      if (chr == '\\') {
+        word.type = w_chr_slash;
+        temp = 0;
+      } else if (chr == '\'') {
+        done = 1;
+      } else {
+        word.chr = (word.chr << 8) | (uint64_t)(chr);
+      }
+    } else if (word.type == l_str) {
+      if (chr == '\\') {
+        word.type = w_str_slash;
+        temp = 0;
+        
+        unit->data_buffer = f_arena_reserve(&(unit->arena), unit->data_buffer, unit->data_length + 1, &(unit->data_capacity), 1);
+        unit->data_buffer[unit->data_length] = '\0';
+      } else if (chr == '"') {
+        unit->data_buffer = f_arena_reserve(&(unit->arena), unit->data_buffer, unit->data_length + 1, &(unit->data_capacity), 1);
+        unit->data_buffer[unit->data_length++] = '\0';
+        
+        done = 1;
+      } else {
+        // Copy the whole run of plain characters at once, up to the next quote or backslash.
+        
+        const char *next = f_scan_string(file_ptr, file_end);
+        
+        int run_length = 1 + (int)(next - file_ptr);
+        
+        unit->data_buffer = f_arena_reserve(&(unit->arena), unit->data_buffer, unit->data_length + run_length, &(unit->data_capacity), 1);
+        unit->data_buffer[unit->data_length] = chr;
+        
+        memcpy(unit->data_buffer + unit->data_length + 1, file_ptr, run_length - 1);
+        unit->data_length += run_length;
+        
+        file_ptr = next;
+      }
+    } else if (word.type == w_chr_slash || word.type == w_str_slash) {
+      uint8_t last_chr, next_chr;
+      int slash_done = 0, slash_first = !temp;
+      
+      if (word.type == w_chr_slash) {
+        last_chr = (uint8_t)(word.chr & 0xFF);
+      } else if (word.type == w_str_slash) {
+        last_chr = unit->data_buffer[unit->data_length];
+      }
+      
+      if (temp == 0) {
+        if (toupper(chr) == 'B') {
+          next_chr = '\b';
+          slash_done = 1;
+        } else if (toupper(chr) == 'E') {
+          next_chr = '\e';
+          slash_done = 1;
+        } else if (toupper(chr) == 'N') {
+          next_chr = '\n';
+          slash_done = 1;
+        } else if (toupper(chr) == 'R') {
+          next_chr = '\r';
+          slash_done = 1;
+        } else if (toupper(chr) == 'T') {
+          next_chr = '\t';
+          slash_done = 1;
+        } else if (toupper(chr) == 'X') {
+          next_chr = '\0';
+          temp = 16;
+        } else if (chr == '0') {
+          next_chr = '\0';
+          temp = 8;
+        } else if (isdigit(chr)) {
+          next_chr = chr - '0';
+          temp = 10;
+        } else {
+          next_chr = chr;
+          slash_done = 1;
+        }
+      } else {
+        int digit = f_lex_digit(chr);
+        
+        if (digit >= 0) {
+          next_chr = last_chr * temp + digit;
+        } else {
+          slash_done = 1;
+          reuse_chr = 1;
+        }
+      }
+      
+      if (word.type == w_chr_slash) {
+        if (slash_first) {
+          word.chr = (word.chr << 8) | (uint64_t)(next_chr);
+        } else if (!reuse_chr) {
+          word.chr = (word.chr & ~((uint64_t)(0xFF))) | (uint64_t)(next_chr);
+        }
+        
+        if (slash_done) {
+          word.type = l_chr;
+        }
+      } else if (word.type == w_str_slash) {
+        if (!reuse_chr) {
+          unit->data_buffer[unit->data_length] = (char)(next_chr);
+        }
+        
+        if (slash_done) {
+          word.type = l_str;
+          unit->data_length++;
+        }
+      }
+    } else if (word.type == w_at) {
+      if (chr == '(') {
+        word.type = s_a_paren;
+        done = 1;
+      } else if (chr == '[') {
+        word.type = s_a_bracket;
+        done = 1;
+      } else if (chr == ';') {
+        word.type = s_exit;
+        done = 1;
+      } else if (chr == '<') {
+        word.type = s_l_rotate;
+        done = 1;
+      } else if (chr == '>') {
+        word.type = s_r_rotate;
+        done = 1;
+      } else if (chr == '+') {
+        word.type = s_inc;
+        done = 1;
+      } else if (chr == '-') {
+        word.type = s_dec;
+        done = 1;
+      } else {
+        f_lex_error(unit, buffer, length, word_offset, "Expected double-char symbol, found '@%c'.\n", chr);
+        break;
+      }
+    }
+  }
+  
+  f_cache_save(unit, cache_path, buffer, length, mtime);
+  f_lex_unmap(buffer, length, is_mapped);
+}
+
+static unit_t *f_lexer_find(lexer_t *lexer, const char *path) {
+  for (int i = 0; i < lexer->unit_count; i++) {
+    if (!strcmp(lexer->units[i]->path, path)) {
+      return lexer->units[i];
+    }
+  }
+  
+  return NULL;
+}
+
+static void f_lexer_start(lexer_t *lexer);
+
+// Looks up (or queues, if new) the unit for a path, starting the threads once enough is queued for them to
+// be worth it (so small trees get lexed in place, as fast as serially). Must be called with the lock held.
+
+static unit_t *f_lexer_want(lexer_t *lexer, const char *name) {
+  char *real_path = realpath(name, NULL);
+  unit_t *unit = f_lexer_find(lexer, real_path ? real_path : name);
+  
+  if (unit) {
+    free(real_path);
+    return unit;
+  }
+  
+  unit = calloc(1, sizeof(unit_t));
+  
+  unit->path = f_arena_strdup(&(unit->arena), real_path ? real_path : name);
+  unit->name = f_arena_strdup(&(unit->arena), name);
+  unit->state = unit_queued;
+  
+  free(real_path);
+  
+  lexer->units = realloc(lexer->units, (lexer->unit_count + 1) * sizeof(unit_t *));
+  lexer->units[lexer->unit_count++] = unit;
+  
+  if (lexer->thread_count) {
+    struct stat info;
+    
+    lexer->queue = realloc(lexer->queue, (lexer->queue_count + 1) * sizeof(unit_t *));
+    lexer->queue[lexer->queue_count++] = unit;
+    
+    if (!stat(unit->path, &info)) {
+      lexer->queue_length += info.st_size;
+    }
+    
+    if (!lexer->threads && lexer->queue_length >= LEX_THREAD_LENGTH) {
+      f_lexer_start(lexer);
+    }
+    
+    pthread_cond_signal(&(lexer->cond));
+  }
+  
+  return unit;
+}
+
+// Lexes a unit marked as unit_lexing, then queues whatever it uses. Must be called with the lock held,
+// which gets released while lexing.
+
+static void f_lexer_run(lexer_t *lexer, unit_t *unit) {
+  pthread_mutex_unlock(&(lexer->lock));
+  f_lex_unit(unit, lexer->cache_path);
+  pthread_mutex_lock(&(lexer->lock));
+  
+  unit->state = unit_done;
+  
+  for (int i = 0; i < unit->use_count; i++) {
+    f_lexer_want(lexer, unit->uses[i]);
+  }
+  
+  pthread_cond_broadcast(&(lexer->cond));
+}
+
+static void *f_lexer_thread(void *data) {
+  lexer_t *lexer = data;
+  pthread_mutex_lock(&(lexer->lock));
+  
+  for (;;) {
+    while (lexer->queue_start == lexer->queue_count && !lexer->is_done) {
+      pthread_cond_wait(&(lexer->cond), &(lexer->lock));
+    }
+    
+    if (lexer->is_done) {
+      break;
+    }
+    
+    unit_t *unit = lexer->queue[lexer->queue_start++];
+    
+    if (unit->state == unit_queued) {
+      unit->state = unit_lexing;
+      f_lexer_run(lexer, unit);
+    }
+  }
+  
+  pthread_mutex_unlock(&(lexer->lock));
+  return NULL;
+}
+
+static void f_lexer_start(lexer_t *lexer) {
+  lexer->threads = calloc(lexer->thread_count, sizeof(pthread_t));
+  
+  for (int i = 0; i < lexer->thread_count; i++) {
+    pthread_create(lexer->threads + i, NULL, f_lexer_thread, lexer);
+  }
+}
+
+void f_lexer_init(lexer_t *lexer, int thread_count, const char *cache_path) {
+  *lexer = (lexer_t){
+    .units = NULL,
+    .unit_count = 0,
+    
+    .queue = NULL,
+    .queue_start = 0,
+    .queue_count = 0,
+    .queue_length = 0,
+    
+    .threads = NULL,
+    .thread_count = (thread_count > 1 ? thread_count - 1 : 0), // The thread splicing units lexes too.
+    
+    .cache_path = cache_path,
+    .is_done = 0,
+  };
+  
+  f_scan_init();
+  
+  pthread_mutex_init(&(lexer->lock), NULL);
+  pthread_cond_init(&(lexer->cond), NULL);
+}
+
+// Returns the (fully lexed) unit for a path, lexing it right away unless some thread is already on it.
+
+unit_t *f_lexer_get(lexer_t *lexer, const char *name) {
+  pthread_mutex_lock(&(lexer->lock));
+  unit_t *unit = f_lexer_want(lexer, name);
+  
+  if (unit->state == unit_queued) {
+    unit->state = unit_lexing;
+    f_lexer_run(lexer, unit);
+  }
+  
+  while (unit->state != unit_done) {
+    pthread_cond_wait(&(lexer->cond), &(lexer->lock));
+  }
+  
+  pthread_mutex_unlock(&(lexer->lock));
+  return unit;
+}
+
+// Frees everything a unit holds but its path, leaving it to be lexed again if it is ever needed again. Must
+// be called with the lock held.
+
+static void f_lexer_reset(unit_t *unit) {
+  if (unit->state == unit_done) {
+    char *path = strdup(unit->path);
+    char *name = strdup(unit->name);
+    
+    if (unit->cache_buffer) {
+      f_lex_unmap(unit->cache_buffer, unit->cache_length, unit->cache_is_mapped);
+    }
+    
+    f_arena_free(&(unit->arena));
+    memset(unit, 0, sizeof(unit_t));
+    
+    unit->path = f_arena_strdup(&(unit->arena), path);
+    unit->name = f_arena_strdup(&(unit->arena), name);
+    unit->state = unit_queued;
+    
+    free(path);
+    free(name);
+  }
+}
+
+void f_lexer_drop(lexer_t *lexer, unit_t *unit) {
+  pthread_mutex_lock(&(lexer->lock));
+  f_lexer_reset(unit);
+  pthread_mutex_unlock(&(lexer->lock));
+}
+
+// Forgets whatever got lexed from a (canonical) path, as the file changed since. Units some thread is lexing
+// right now might have read it before the change, so those get waited for and dropped too.
+
+void f_lexer_touch(lexer_t *lexer, const char *path) {
+  pthread_mutex_lock(&(lexer->lock));
+  unit_t *unit = f_lexer_find(lexer, path);
+  
+  if (unit) {
+    while (unit->state == unit_lexing) {
+      pthread_cond_wait(&(lexer->cond), &(lexer->lock));
+    }
+    
+    f_lexer_reset(unit);
+  }
+  
+  pthread_mutex_unlock(&(lexer->lock));
+}
+
+void f_lexer_free(lexer_t *lexer) {
+  pthread_mutex_lock(&(lexer->lock));
+  
+  lexer->is_done = 1;
+  pthread_cond_broadcast(&(lexer->cond));
+  
+  pthread_mutex_unlock(&(lexer->lock));
+  
+  for (int i = 0; lexer->threads && i < lexer->thread_count; i++) {
+    pthread_join(lexer->threads[i], NULL);
+  }
+  
+  for (int i = 0; i < lexer->unit_count; i++) {
+    if (lexer->units[i]->cache_buffer) {
+      f_lex_unmap(lexer->units[i]->cache_buffer, lexer->units[i]->cache_length, lexer->units[i]->cache_is_mapped);
+    }
+    
+    f_arena_free(&(lexer->units[i]->arena));
+    free(lexer->units[i]);
+  }
+  
+  pthread_mutex_destroy(&(lexer->lock));
+  pthread_cond_destroy(&(lexer->cond));
+  
+  free(lexer->units);
+  free(lexer->queue);
+  free(lexer->threads);
+}
@@ -0,0 +1,233 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rtbc.h>
+
+void f_link_global(link_t *link, uint32_t atom, const_t value) {
+  link->symbols = f_arena_reserve(link->arena, link->symbols, link->symbol_count + 1, &(link->symbol_capacity), sizeof(symbol_t));
+  
+  link->symbols[link->symbol_count++] = (symbol_t){
+    .atom = atom,
+    .is_routine = 0,
+    
+    .value = value,
+    .ir = NULL,
+    
+    .is_reached = 0,
+  };
+}
+
+void f_link_routine(link_t *link, const ir_t *ir) {
+  link->symbols = f_arena_reserve(link->arena, link->symbols, link->symbol_count + 1, &(link->symbol_capacity), sizeof(symbol_t));
+  
+  link->symbols[link->symbol_count++] = (symbol_t){
+    .atom = ir->atom,
+    .is_routine = 1,
+    
+    .ir = f_ir_copy(link->arena, ir),
+    
+    .is_reached = 0,
+  };
+}
+
+// Calls f_data_ref() on every DATA-relative constant a symbol uses, and f_call_ref() on every routine it
+// calls (if not NULL). Globals cannot be named from routines yet, so those only get reached as roots.
+
+static void f_link_refs(symbol_t *symbol, void (*f_data_ref)(const_t *value, void *data),
+                        void (*f_call_ref)(uint32_t atom, void *data), void *data) {
+  if (!symbol->is_routine) {
+    if (symbol->value.is_data && f_data_ref) {
+      f_data_ref(&(symbol->value), data);
+    }
+    
+    return;
+  }
+  
+  ir_t *ir = symbol->ir;
+  
+  for (int i = 0; i < ir->order_count; i++) {
+    ir_block_t *block = ir->blocks + ir->order[i];
+    
+    for (int j = 0; j < block->inst_count; j++) {
+      ir_inst_t *inst = block->insts + j;
+      
+      if (inst->op == ir_const && inst->constant.is_data && f_data_ref) {
+        f_data_ref(&(inst->constant), data);
+      } else if (inst->op == ir_call && f_call_ref) {
+        f_call_ref(inst->call.atom, data);
+      }
+    }
+  }
+}
+
+// DATA is made of null-terminated strings (some pointing into the tails of others), which get kept or
+// dropped whole. Offsets past the end of DATA just get moved back with everything else.
+
+typedef struct data_map_t data_map_t;
+
+struct data_map_t {
+  int *starts; // Of every string, in order.
+  int *moves;  // How far back each string ends up, once the unused ones before it are gone.
+  int *is_used;
+  int count, length;
+};
+
+static int f_data_find(const data_map_t *map, uint64_t offset) {
+  if (offset >= (uint64_t)(map->length)) {
+    return map->count;
+  }
+  
+  int low = 0, high = map->count - 1;
+  
+  while (low < high) {
+    int middle = (low + high + 1) / 2;
+    
+    if (map->starts[middle] <= (int)(offset)) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  
+  return low;
+}
+
+static void f_data_use(const_t *value, void *data) {
+  data_map_t *map = data;
+  int index = f_data_find(map, value->offset);
+  
+  if (index < map->count) {
+    map->is_used[index] = 1;
+  }
+}
+
+static void f_data_move(const_t *value, void *data) {
+  data_map_t *map = data;
+  value->offset -= map->moves[f_data_find(map, value->offset)];
+}
+
+// Symbols to go through, with the ones defined with the same name (if any) before each.
+
+typedef struct reach_t reach_t;
+
+struct reach_t {
+  link_t *link;
+  table_t names;
+  
+  int *sames;
+  int *stack;
+  int stack_count;
+};
+
+static void f_link_reach(uint32_t atom, void *data) {
+  reach_t *reach = data;
+  
+  for (int i = f_table_find(&(reach->names), atom); i >= 0; i = reach->sames[i]) {
+    if (!reach->link->symbols[i].is_reached) {
+      reach->link->symbols[i].is_reached = 1;
+      reach->stack[reach->stack_count++] = i;
+    }
+  }
+}
+
+// Emits the symbols reachable from the roots in the order they got parsed, then whatever DATA they use. Roots
+// are case-insensitive, just like names are once lexed.
+
+void f_link_emit(const arch_t *arch, link_t *link, const char *data, int data_length) {
+  reach_t reach = (reach_t){
+    .link = link,
+    .names = (table_t){
+      .slots = NULL,
+      .slot_capacity = 0,
+      
+      .binds = NULL,
+      .bind_count = 0,
+      .bind_capacity = 0,
+    },
+    
+    .sames = f_arena_alloc(link->arena, (link->symbol_count + 1) * sizeof(int)),
+    .stack = f_arena_alloc(link->arena, (link->symbol_count + 1) * sizeof(int)),
+    .stack_count = 0,
+  };
+  
+  for (int i = 0; i < link->symbol_count; i++) {
+    reach.sames[i] = f_table_find(&(reach.names), link->symbols[i].atom);
+    f_table_bind(link->arena, &(reach.names), link->symbols[i].atom, i);
+  }
+  
+  for (int i = 0; link->roots[i]; i++) {
+    f_link_reach(f_atom_upper(link->roots[i]), &reach);
+  }
+  
+  while (reach.stack_count) {
+    f_link_refs(link->symbols + reach.stack[--reach.stack_count], NULL, f_link_reach, &reach);
+  }
+  
+  data_map_t map = (data_map_t){
+    .starts = f_arena_alloc(link->arena, (data_length + 1) * sizeof(int)),
+    .moves = NULL,
+    .is_used = NULL,
+    
+    .count = 0,
+    .length = data_length,
+  };
+  
+  for (int i = 0; i < data_length; i++) {
+    if (!i || !data[i - 1]) {
+      map.starts[map.count++] = i;
+    }
+  }
+  
+  map.moves = f_arena_alloc(link->arena, (map.count + 1) * sizeof(int));
+  map.is_used = f_arena_alloc(link->arena, (map.count + 1) * sizeof(int));
+  
+  memset(map.is_used, 0, (map.count + 1) * sizeof(int));
+  
+  for (int i = 0; i < link->symbol_count; i++) {
+    if (link->symbols[i].is_reached) {
+      f_link_refs(link->symbols + i, f_data_use, NULL, &map);
+    }
+  }
+  
+  char *new_data = f_arena_alloc(link->arena, data_length + 1);
+  int new_length = 0;
+  
+  for (int i = 0; i < map.count; i++) {
+    int end = (i + 1 < map.count ? map.starts[i + 1] : data_length);
+    map.moves[i] = map.starts[i] - new_length;
+    
+    if (map.is_used[i]) {
+      memcpy(new_data + new_length, data + map.starts[i], end - map.starts[i]);
+      new_length += end - map.starts[i];
+    }
+  }
+  
+  map.moves[map.count] = data_length - new_length;
+  int reached_count = 0;
+  
+  for (int i = 0; i < link->symbol_count; i++) {
+    symbol_t *symbol = link->symbols + i;
+    
+    if (!symbol->is_reached) {
+      continue;
+    }
+    
+    f_link_refs(symbol, f_data_move, NULL, &map);
+    reached_count++;
+    
+    if (symbol->is_routine) {
+      f_ir_lower(arch, symbol->ir);
+    } else {
+      arch->f_global(f_atom_name(symbol->atom));
+      arch->f_const(symbol->value);
+    }
+  }
+  
+  if (new_length) {
+    arch->f_global("DATA");
+    arch->f_data(new_data, new_length);
+  }
+  
+  f_debug("Linked %d out of %d symbols, DATA cut from %d to %d bytes.\n", reached_count, link->symbol_count, data_length,
+          new_length);
+}
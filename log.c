@@ -1,18 +1,37 @@
 #include <stdarg.h>
 #include <stdlib.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <rtbc.h>
 
 int f_do_debug = 0;
 
-void f_error(const char *format, ...) {
+_Thread_local FILE *f_output = NULL;
+_Thread_local jmp_buf *f_error_jump = NULL;
+
+_Thread_local int f_error_is_kept = 0;
+_Thread_local char f_error_message[1024];
+
+_Noreturn void f_error(const char *format, ...) {
   va_list args;
   va_start(args, format); 
   
+  if (f_error_jump && f_error_is_kept) {
+    vsnprintf(f_error_message, sizeof(f_error_message), format, args);
+    va_end(args);
+    
+    longjmp(*f_error_jump, 1);
+  }
+  
   fprintf(stderr, "Error: ");
   vfprintf(stderr, format, args);
   
   va_end(args);
+  
+  if (f_error_jump) {
+    longjmp(*f_error_jump, 1);
+  }
+  
   exit(1);
 }
 
@@ -27,3 +46,11 @@ void f_debug(const char *format, ...) {
   vfprintf(stderr, format, args);
   va_end(args);
 }
+
+void f_print(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  
+  vfprintf(f_output ? f_output : stdout, format, args);
+  va_end(args);
+}
@@ -0,0 +1,429 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rtbc.h>
+
+// Loops get found from the order blocks are lowered in: a jump to a block placed no later than its own one
+// closes a loop, made of every block in between (the head being the first, the latch the last). That is all
+// f_parse_loop() ever makes, inlined bodies included.
+
+#define LOOP_MAX_HEAD 16 // Instructions in heads worth copying to the bottom of their loop.
+
+typedef struct loop_t loop_t;
+
+struct loop_t {
+  int head, latch; // By name, as positions change with every preheader added.
+};
+
+static int f_loop_find(const ir_t *ir, int block) {
+  for (int i = 0; i < ir->order_count; i++) {
+    if (ir->order[i] == block) {
+      return i;
+    }
+  }
+  
+  return -1;
+}
+
+// Every loop in ir, innermost (shortest) first, and only once per head.
+
+static loop_t *f_loop_collect(ir_t *ir, int *count) {
+  loop_t *loops = NULL;
+  int capacity = 0;
+  
+  *count = 0;
+  
+  for (int i = 0; i < ir->order_count; i++) {
+    const ir_block_t *block = ir->blocks + ir->order[i];
+    const ir_inst_t *last = (block->inst_count ? block->insts + block->inst_count - 1 : NULL);
+    
+    if (!last || last->block < 0) {
+      continue;
+    }
+    
+    int head = f_loop_find(ir, last->block);
+    int is_new = (head >= 0 && head <= i);
+    
+    for (int j = 0; j < *count && is_new; j++) {
+      is_new = (loops[j].head != last->block);
+    }
+    
+    if (!is_new) {
+      continue;
+    }
+    
+    loops = f_arena_reserve(ir->arena, loops, *count + 1, &capacity, sizeof(loop_t));
+    int j = (*count)++;
+    
+    for (; j > 0 && f_loop_find(ir, loops[j - 1].latch) - f_loop_find(ir, loops[j - 1].head) > i - head; j--) {
+      loops[j] = loops[j - 1];
+    }
+    
+    loops[j] = (loop_t){
+      .head = last->block,
+      .latch = ir->order[i],
+    };
+  }
+  
+  return loops;
+}
+
+static ir_inst_t *f_loop_append(ir_t *ir, int block, ir_inst_t inst) {
+  ir_block_t *dest = ir->blocks + block;
+  
+  dest->insts = f_arena_reserve(ir->arena, dest->insts, dest->inst_count + 1, &(dest->inst_capacity), sizeof(ir_inst_t));
+  dest->insts[dest->inst_count] = inst;
+  
+  return dest->insts + (dest->inst_count++);
+}
+
+// Rotation: loops test their condition at the top, so every trip takes two jumps (the one back to the head
+// and the one past the exit). Copying the head into the bottom of the loop, with its test turned around to
+// jump back to the block right after the head, leaves the head as a guard run once, and a single jump per
+// trip. Only done for heads that end in a test and define nothing used past them.
+
+static void f_loop_rotate(const arch_t *arch, ir_t *ir) {
+  (void)(arch); // Rotating only moves IR around, whatever the target.
+  
+  const int flipped_ops[] = {ir_jump_nz, ir_jump_z, ir_jump_np, ir_jump_p}; // From ir_jump_z on.
+  
+  int loop_count;
+  loop_t *loops = f_loop_collect(ir, &loop_count);
+  
+  int *values = NULL;
+  
+  for (int i = 0; i < loop_count; i++) {
+    int h = f_loop_find(ir, loops[i].head), l = f_loop_find(ir, loops[i].latch);
+    
+    const ir_block_t *head = ir->blocks + loops[i].head;
+    const ir_block_t *latch = ir->blocks + loops[i].latch;
+    
+    if (h >= l || !head->inst_count || head->inst_count > LOOP_MAX_HEAD) {
+      continue;
+    }
+    
+    const ir_inst_t *test = head->insts + head->inst_count - 1;
+    int exit = f_loop_find(ir, test->block);
+    
+    if (test->op < ir_jump_z || test->op > ir_jump_np || (exit > h && exit <= l)) {
+      continue;
+    }
+    
+    if (latch->insts[latch->inst_count - 1].op != ir_jump) {
+      continue;
+    }
+    
+    int is_used = 0;
+    
+    for (int j = 0; j < ir->order_count && !is_used; j++) {
+      const ir_block_t *block = ir->blocks + ir->order[j];
+      
+      for (int k = 0; k < block->inst_count && j != h && !is_used; k++) {
+        for (int m = 0; m < head->inst_count && !is_used; m++) {
+          int value = head->insts[m].value;
+          is_used = (value >= 0 && (block->insts[k].args[0] == value || block->insts[k].args[1] == value));
+        }
+      }
+    }
+    
+    if (is_used) {
+      continue;
+    }
+    
+    if (!values) {
+      values = f_arena_alloc(ir->arena, (ir->value_count + 1) * sizeof(int));
+    }
+    
+    int target = test->block;
+    ir->blocks[loops[i].latch].inst_count--;
+    
+    for (int j = 0; j < head->inst_count; j++) {
+      ir_inst_t inst = head->insts[j];
+      
+      for (int k = 0; k < 2; k++) {
+        for (int m = 0; m < j && inst.args[k] >= 0; m++) {
+          if (head->insts[m].value == inst.args[k]) {
+            inst.args[k] = values[inst.args[k]];
+            break;
+          }
+        }
+      }
+      
+      if (inst.value >= 0) {
+        values[inst.value] = ir->value_count;
+        inst.value = ir->value_count++;
+      }
+      
+      if (j == head->inst_count - 1) {
+        inst.op = flipped_ops[inst.op - ir_jump_z];
+        inst.block = ir->order[h + 1];
+      }
+      
+      f_loop_append(ir, loops[i].latch, inst);
+    }
+    
+    if (l + 1 >= ir->order_count || ir->order[l + 1] != target) {
+      f_loop_append(ir, loops[i].latch, (ir_inst_t){
+        .op = ir_jump,
+        
+        .value = -1,
+        .type = test->type,
+        
+        .args = {-1, -1},
+        .block = target,
+        
+        .offset = 0,
+      });
+    }
+    
+    if (f_do_debug) {
+      f_debug("rotate: '%s', block %d.\n", f_atom_name(ir->atom), loops[i].head);
+    }
+  }
+}
+
+// Hoisting: values get computed again right where they are used (see f_ir_lower()), so whatever a loop
+// computes from values it never changes gets computed again on every trip. Those get computed once into a
+// local of their own instead, in a preheader block right before the loop, for the register allocator to
+// keep around if it is worth it. Calls are never moved, and neither is anything that could trap.
+
+typedef struct hoist_t hoist_t;
+
+struct hoist_t {
+  int start, end; // Positions of the blocks in the loop.
+  int preheader;  // Name, -1 until needed.
+  int value_count; // When the loop got looked at, values past it are new.
+  
+  signed char *is_invariant; // By value, -1 if not known yet.
+  int *copies;               // In the preheader, by value, -1 if none.
+};
+
+static int f_loop_is_stored(const ir_t *ir, const hoist_t *hoist, int offset) {
+  for (int i = hoist->start; i <= hoist->end; i++) {
+    const ir_block_t *block = ir->blocks + ir->order[i];
+    
+    for (int j = 0; j < block->inst_count; j++) {
+      if (block->insts[j].op == ir_store && block->insts[j].offset == offset) {
+        return 1;
+      }
+    }
+  }
+  
+  return 0;
+}
+
+static int f_loop_is_invariant(const arch_t *arch, const ir_t *ir, hoist_t *hoist, int value) {
+  if (value < 0 || value >= hoist->value_count) {
+    return 0;
+  }
+  
+  if (hoist->is_invariant[value] >= 0) {
+    return hoist->is_invariant[value];
+  }
+  
+  const ir_inst_t *inst = ir->defs[value];
+  int is_invariant = 0;
+  
+  if (inst->op == ir_const) {
+    is_invariant = 1;
+  } else if (inst->op == ir_local) {
+    is_invariant = !f_loop_is_stored(ir, hoist, inst->offset);
+  } else if (inst->op == ir_zero_extend || inst->op == ir_sign_extend) {
+    is_invariant = f_loop_is_invariant(arch, ir, hoist, inst->args[0]);
+  } else if (f_ir_is_binary(inst->op)) {
+    is_invariant = (f_loop_is_invariant(arch, ir, hoist, inst->args[0]) && f_loop_is_invariant(arch, ir, hoist, inst->args[1]));
+    
+    if (inst->op == ir_div || inst->op == ir_mod) {
+      // Only by constants that cannot trap, as the loop might have never got that far.
+      
+      const ir_inst_t *other = ir->defs[inst->args[1]];
+      int width = f_type_size(arch, inst->type);
+      uint64_t mask = (width >= 8 ? UINT64_MAX : (1ull << (width * 8)) - 1);
+      
+      is_invariant = (is_invariant && other->op == ir_const && !other->constant.is_data && (other->constant.ux & mask) &&
+                      (other->constant.ux & mask) != mask);
+    }
+  }
+  
+  hoist->is_invariant[value] = is_invariant;
+  return is_invariant;
+}
+
+static int f_loop_copy(ir_t *ir, hoist_t *hoist, int preheader, int value) {
+  if (hoist->copies[value] >= 0) {
+    return hoist->copies[value];
+  }
+  
+  ir_inst_t inst = *(ir->defs[value]);
+  
+  for (int i = 0; i < 2; i++) {
+    if (inst.op != ir_const && inst.op != ir_local && inst.args[i] >= 0) {
+      inst.args[i] = f_loop_copy(ir, hoist, preheader, inst.args[i]);
+    }
+  }
+  
+  inst.value = ir->value_count++;
+  f_loop_append(ir, preheader, inst);
+  
+  return (hoist->copies[value] = inst.value);
+}
+
+// Preheaders only get placed once something gets hoisted, right before the head (which then moves along).
+
+static int f_loop_preheader(ir_t *ir, hoist_t *hoist) {
+  if (hoist->preheader < 0) {
+    hoist->preheader = f_ir_block(ir);
+    
+    ir->order = f_arena_reserve(ir->arena, ir->order, ir->order_count + 1, &(ir->order_capacity), sizeof(int));
+    memmove(ir->order + hoist->start + 1, ir->order + hoist->start, (ir->order_count - hoist->start) * sizeof(int));
+    
+    ir->order[hoist->start] = hoist->preheader;
+    ir->order_count++;
+    
+    ir->blocks[hoist->preheader].is_placed = 1;
+    hoist->start++, hoist->end++;
+  }
+  
+  return hoist->preheader;
+}
+
+static void f_loop_hoist(const arch_t *arch, ir_t *ir) {
+  int loop_count;
+  loop_t *loops = f_loop_collect(ir, &loop_count);
+  
+  int local_base = ir->local_size; // Locals past it are the ones hoisted into.
+  
+  for (int i = 0; i < loop_count; i++) {
+    hoist_t hoist = (hoist_t){
+      .start = f_loop_find(ir, loops[i].head),
+      .end = f_loop_find(ir, loops[i].latch),
+      .preheader = -1,
+      .value_count = ir->value_count,
+      
+      .is_invariant = f_arena_alloc(ir->arena, ir->value_count + 1),
+      .copies = f_arena_alloc(ir->arena, (ir->value_count + 1) * sizeof(int)),
+    };
+    
+    memset(hoist.is_invariant, -1, ir->value_count + 1);
+    memset(hoist.copies, -1, (ir->value_count + 1) * sizeof(int));
+    
+    // Preheaders only get run on the way in if that is the only way into the loop.
+    
+    int is_entered = 0;
+    
+    for (int j = 0; j < ir->order_count && !is_entered; j++) {
+      const ir_block_t *block = ir->blocks + ir->order[j];
+      
+      for (int k = 0; k < block->inst_count && (j < hoist.start || j > hoist.end); k++) {
+        is_entered = (is_entered || block->insts[k].block == loops[i].head);
+      }
+    }
+    
+    if (is_entered) {
+      continue;
+    }
+    
+    f_ir_defs(ir);
+    
+    int *reads = f_arena_alloc(ir->arena, (ir->value_count + 1) * sizeof(int)); // Of the local each value got hoisted into.
+    memset(reads, -1, (ir->value_count + 1) * sizeof(int));
+    
+    for (int j = hoist.start; j <= hoist.end; j++) {
+      int name = ir->order[j]; // Blocks move around as preheaders get named.
+      
+      for (int k = 0; k < ir->blocks[name].inst_count; k++) {
+        ir_inst_t *inst = ir->blocks[name].insts + k;
+        
+        if (inst->value >= 0 && f_loop_is_invariant(arch, ir, &hoist, inst->value)) {
+          continue; // Part of a bigger tree, if used at all.
+        }
+        
+        // Locals hoisted out of an inner loop only get stored to there, so they can go further out as a whole.
+        
+        if (inst->op == ir_store && inst->offset < -local_base && f_loop_is_invariant(arch, ir, &hoist, inst->args[0])) {
+          int preheader = f_loop_preheader(ir, &hoist);
+          ir_inst_t store = *inst;
+          
+          store.args[0] = f_loop_copy(ir, &hoist, preheader, store.args[0]);
+          f_loop_append(ir, preheader, store);
+          
+          ir_block_t *block = ir->blocks + name;
+          memmove(inst, inst + 1, (block->inst_count - k - 1) * sizeof(ir_inst_t));
+          
+          block->inst_count--, k--;
+          j += (ir->order[j] != name);
+          
+          f_ir_defs(ir);
+          memset(hoist.is_invariant, -1, hoist.value_count + 1);
+          
+          continue;
+        }
+        
+        for (int m = 0; m < 2; m++) {
+          int value = inst->args[m];
+          
+          if (!f_loop_is_invariant(arch, ir, &hoist, value) || ir->defs[value]->op == ir_const || ir->defs[value]->op == ir_local) {
+            continue;
+          }
+          
+          if (reads[value] < 0) {
+            int preheader = f_loop_preheader(ir, &hoist);
+            j += (ir->order[j] != name);
+            
+            type_t type = ir->defs[value]->type;
+            int width = f_type_size(arch, type);
+            
+            ir->local_size += ((width + arch->data_width - 1) / arch->data_width) * arch->data_width;
+            
+            f_loop_append(ir, preheader, (ir_inst_t){
+              .op = ir_store,
+              
+              .value = -1,
+              .type = (type_t){
+                .base_width = 0,
+                .base_signed = 0,
+                
+                .point_count = 0,
+              },
+              
+              .args = {f_loop_copy(ir, &hoist, preheader, value), -1},
+              .block = -1,
+              
+              .offset = -ir->local_size,
+            });
+            
+            f_loop_append(ir, preheader, (ir_inst_t){
+              .op = ir_local,
+              
+              .value = ir->value_count,
+              .type = type,
+              
+              .args = {-1, -1},
+              .block = -1,
+              
+              .offset = -ir->local_size,
+            });
+            
+            reads[value] = ir->value_count++;
+            
+            if (f_do_debug) {
+              f_debug("hoist: '%s', %%%d out of block %d.\n", f_atom_name(ir->atom), value, loops[i].head);
+            }
+          }
+          
+          inst->args[m] = reads[value];
+        }
+      }
+    }
+  }
+}
+
+const ir_pass_t loop_rotate = (ir_pass_t){
+  .name = "rotate",
+  .f_run = f_loop_rotate,
+};
+
+const ir_pass_t loop_hoist = (ir_pass_t){
+  .name = "hoist",
+  .f_run = f_loop_hoist,
+};
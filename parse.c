@@ -1,13 +1,15 @@
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <rtbc.h>
 
-#define _f_parse_error(format, word, ...) f_error("(At '%s', line %d, column %d) " format, source->files[word.file], word.line, word.column, __VA_ARGS__)
+#define _f_parse_error(format, word, ...) f_source_error_at(source, (word).index, format, __VA_ARGS__)
 #define f_parse_error(format, ...) _f_parse_error(format, __VA_ARGS__, 0)
 
-#define last_word (source->words[source->word_index - 1])
-#define curr_word (source->words[source->word_index])
+#define last_word ((word_t){.type = w_invalid, .index = source->word_index - 1})
+#define curr_word ((word_t){.type = w_invalid, .index = source->word_index})
 
 int f_type_size(const arch_t *arch, type_t type) {
   int width = type.base_width;
@@ -20,32 +22,28 @@ int f_type_size(const arch_t *arch, type_t type) {
 }
 
 static int expect(source_t *source, int type, word_t *word) {
-  if (source->word_index == source->word_count) {
-    return 0;
-  }
-  
-  if (curr_word.type == type) {
-    if (word) {
-      *word = curr_word;
-    }
-    
-    source->word_index++;
+  if (f_source_peek(source) == type) {
+    f_source_read(source, word);
     return 1;
   }
   
   return 0;
 }
 
-static void skip_block(source_t *source) {
+// Returns 0 if the words run out before the closing parenthesis.
+
+static int skip_block(source_t *source) {
   for (;;) {
     if (expect(source, s_l_paren, NULL) || expect(source, s_a_paren, NULL)) {
-      skip_block(source);
+      if (!skip_block(source)) {
+        return 0;
+      }
     } else if (expect(source, s_r_paren, NULL)) {
-      return;
-    } else if (source->word_index == source->word_count) {
-      f_parse_error("Expected closing parenthesis.\n", last_word);
+      return 1;
+    } else if (f_source_peek(source) == w_invalid) {
+      return 0;
     } else {
-      source->word_index++;
+      f_source_read(source, NULL);
     }
   }
 }
@@ -84,186 +82,1229 @@ int f_parse_type(const arch_t *arch, source_t *source, type_t *type) {
   while (expect(source, s_mul, NULL)) {
     type->point_count++;
   }
-  
-  return 1;
+  
+  return 1;
+}
+
+// Prefix operators bind tightest, then infix ones by level, each level being left-associative.
+
+static int f_parse_level(int type) {
+  if (type == s_mul || type == s_div || type == s_mod) {
+    return 5;
+  } else if (type == s_add || type == s_sub) {
+    return 4;
+  } else if (type == s_and) {
+    return 3;
+  } else if (type == s_xor) {
+    return 2;
+  } else if (type == s_or) {
+    return 1;
+  }
+  
+  return 0;
+}
+
+static const_t f_parse_const_n(const arch_t *arch, source_t *source, int level);
+
+static const_t f_parse_const_0(const arch_t *arch, source_t *source) {
+  const_t value;
+  type_t type;
+  word_t word;
+  
+  if (expect(source, l_name, &word)) {
+    f_parse_error("Constant expressions cannot contain lvalues, found '%s'.\n", word, f_atom_name(word.atom));
+  } else if (expect(source, l_ux, &word) || expect(source, l_x, &word) || expect(source, l_chr, &word)) {
+    int min_width = 1;
+    
+    while (min_width < 64 && word.ux >= (((uint64_t)(1)) << min_width)) {
+      min_width++;
+    }
+    
+    if (word.type == l_x) {
+      min_width++;
+    }
+    
+    min_width = (min_width + 7) / 8;
+    
+    // Only widths some type has, which is all the backends handle (3 bytes being 4, 5 to 7 being 8).
+    
+    while (min_width < 8 && (min_width & (min_width - 1))) {
+      min_width++;
+    }
+    
+    return (const_t){
+      .type = (type_t){
+        .base_width = (min_width > 8 ? 8 : min_width),
+        .base_signed = (word.type == l_x),
+        
+        .point_count = 0,
+      },
+      
+      .is_data = 0,
+      .ux = word.ux,
+    };
+  } else if (expect(source, l_str, &word)) {
+    return (const_t){
+      .type = (type_t){
+        .base_width = 1,
+        .base_signed = 0,
+        
+        .point_count = 1,
+      },
+      
+      .is_data = 1,
+      .offset = word.str,
+    };
+  } else if (expect(source, s_l_paren, &word)) {
+    if (f_parse_type(arch, source, &type)) {
+      if (!expect(source, s_r_paren, NULL)) {
+        f_parse_error("Expected closing parenthesis after cast.\n", curr_word);
+      }
+      
+      return f_fold_cast(arch, type, f_parse_const_0(arch, source));
+    }
+    
+    value = f_parse_const_n(arch, source, 1);
+    
+    if (!expect(source, s_r_paren, NULL)) {
+      f_parse_error("Expected closing parenthesis.\n", curr_word);
+    }
+    
+    return value;
+  } else if (expect(source, s_sub, &word) || expect(source, s_not, &word) || expect(source, s_l_shift, &word) ||
+             expect(source, s_r_shift, &word) || expect(source, s_l_rotate, &word) || expect(source, s_r_rotate, &word)) {
+    const char *error = f_fold_unary(arch, word.type, f_parse_const_0(arch, source), &value);
+    
+    if (error) {
+      f_parse_error("%s\n", word, error);
+    }
+    
+    return value;
+  }
+  
+  f_parse_error("Expected constant expression.\n", curr_word);
+}
+
+static const_t f_parse_const_n(const arch_t *arch, source_t *source, int level) {
+  const_t value = f_parse_const_0(arch, source);
+  word_t word;
+  
+  for (;;) {
+    int op_level = f_parse_level(f_source_peek(source));
+    
+    if (!op_level || op_level < level) {
+      return value;
+    }
+    
+    f_source_read(source, &word);
+    
+    const_t other = f_parse_const_n(arch, source, op_level + 1);
+    const char *error = f_fold_binary(arch, word.type, value, other, &value);
+    
+    if (error) {
+      f_parse_error("%s\n", word, error);
+    }
+  }
+}
+
+static const_t f_parse_const(const arch_t *arch, source_t *source) {
+  return f_parse_const_n(arch, source, 1);
+}
+
+// Values in routine bodies: constants (whatever only uses those gets folded), locals and arguments, calls,
+// and operators on any of them. Constants and names only reach the IR once used, cast to whatever they get
+// used as.
+
+typedef struct call_t call_t;
+
+// Calls push their arguments as they go, unless they might get inlined, which keeps them as operands until
+// the closing parenthesis instead. Anything that does push (or call) commits every call around it first, so
+// arguments always get pushed in order, and values of calls always get used (pushed) right away. Infix
+// operators keep their left operand the same way while parsing the right one (with no routine), and commit
+// it to a local of its own.
+
+struct call_t {
+  call_t *outer;
+  
+  const routine_t *routine;
+  int arg_base, arg_count; // In context->operands.
+  
+  int is_committed;
+};
+
+static entry_t *f_parse_find(context_t *context, uint32_t atom, int *is_local);
+static const ir_t *f_pool_wait(pool_t *pool, const routine_t *routine, int body_index);
+static operand_t f_parse_value(const arch_t *arch, source_t *source, context_t *context, ir_t *ir, call_t *call);
+
+static int f_parse_use(const arch_t *arch, ir_t *ir, operand_t operand, type_t type) {
+  if (operand.kind == operand_const) {
+    return f_ir_const(ir, f_fold_cast(arch, type, operand.constant));
+  }
+  
+  int value = (operand.kind == operand_local ? f_ir_local(ir, operand.type, operand.offset) : operand.value);
+  
+  int old_width = f_type_size(arch, operand.type);
+  int new_width = f_type_size(arch, type);
+  
+  // Same as f_fold_cast(), so constants do not change whether they get folded or not.
+  
+  if (new_width > old_width && operand.type.base_signed && type.base_signed) {
+    return f_ir_extend(ir, ir_sign_extend, value, type);
+  } else if (new_width != old_width) {
+    return f_ir_extend(ir, ir_zero_extend, value, type); // Does nothing if smaller, but the type is right.
+  }
+  
+  return value;
+}
+
+// Puts a left operand (see call_t) where calls cannot touch it, if it is not a constant or a local already.
+
+static void f_parse_spill(const arch_t *arch, context_t *context, ir_t *ir, call_t *call) {
+  operand_t *operand = context->operands + call->arg_base;
+  call->is_committed = 1;
+  
+  if (operand->kind != operand_value) {
+    return;
+  }
+  
+  int width = f_type_size(arch, operand->type);
+  
+  ir->local_size += ((width + arch->data_width - 1) / arch->data_width) * arch->data_width;
+  f_ir_store(ir, operand->value, -ir->local_size);
+  
+  *operand = (operand_t){
+    .kind = operand_local,
+    .type = operand->type,
+    
+    .offset = -ir->local_size,
+  };
+}
+
+// Calls outside might have been left alone by an operator committing (see f_parse_call()), so those always
+// get checked.
+
+static void f_parse_commit(const arch_t *arch, context_t *context, ir_t *ir, call_t *call) {
+  if (!call) {
+    return;
+  }
+  
+  f_parse_commit(arch, context, ir, call->outer);
+  
+  if (call->is_committed) {
+    return;
+  } else if (!call->routine) {
+    f_parse_spill(arch, context, ir, call);
+    return;
+  }
+  
+  for (int i = 0; i < call->arg_count; i++) {
+    f_ir_arg(ir, f_parse_use(arch, ir, context->operands[call->arg_base + i], call->routine->arg_types[i]));
+  }
+  
+  call->is_committed = 1;
+}
+
+static void f_parse_body(const arch_t *arch, source_t *source, context_t *context, ir_t *ir);
+
+// Copy of the body of a routine just parsed to keep for it, if worth inlining (NULL otherwise).
+
+static ir_t *f_parse_keep(const arch_t *arch, source_t *source, context_t *context, const routine_t *routine,
+                          const ir_t *ir) {
+  int cost;
+  
+  if (!context->inlining) {
+    return NULL;
+  }
+  
+  int override = f_table_find(&(context->inline_names), ir->atom);
+  
+  if (!override || !f_inline_cost(arch, ir, routine, &cost)) {
+    return NULL;
+  }
+  
+  if (override > 0 || cost <= context->inlining->size) {
+    return f_ir_copy(source->arena, ir);
+  }
+  
+  return NULL;
+}
+
+// Parses the body of a routine again, for a call to it (see routine_t).
+
+static void f_parse_lazy(const arch_t *arch, source_t *source, context_t *context, const entry_t *entry) {
+  routine_t *routine = entry->routine;
+  
+  int word_index = source->word_index;
+  int value_index = source->value_index;
+  
+  source->word_index = routine->word_index;
+  source->value_index = routine->value_index;
+  
+  routine->state = routine_busy;
+  
+  f_ir_init(context->lazy_ir, entry->atom, entry->type, routine->arg_size, routine->local_size);
+  f_parse_body(arch, source, NULL, context->lazy_ir);
+  
+  routine->body = f_parse_keep(arch, source, context, routine, context->lazy_ir);
+  routine->state = routine_done;
+  
+  source->word_index = word_index;
+  source->value_index = value_index;
+}
+
+static operand_t f_parse_call(const arch_t *arch, source_t *source, context_t *context, ir_t *ir, const entry_t *entry,
+                              call_t *outer) {
+  routine_t *routine = entry->routine;
+  const ir_t *body = NULL;
+  
+  // Workers wait for the routines generated before theirs instead of parsing them again (see f_pool_wait()).
+  
+  if (context->body_index) {
+    body = (context->inlining ? f_pool_wait(context->pool, routine, context->body_index) : NULL);
+  } else {
+    if (routine->state == routine_lazy && context->inlining) {
+      f_parse_lazy(arch, source, context, entry);
+    }
+    
+    body = (routine->state == routine_done ? routine->body : NULL);
+  }
+  
+  call_t call = (call_t){
+    .outer = outer,
+    
+    .routine = routine,
+    .arg_base = context->operand_count,
+    .arg_count = 0,
+    
+    .is_committed = 0,
+  };
+  
+  context->is_dependent = 1;
+  
+  // Calls from a routine to itself find it busy, without a body yet, so recursion never gets inlined.
+  
+  if (!body) {
+    f_parse_commit(arch, context, ir, &call);
+  }
+  
+  for (;;) {
+    if (expect(source, s_r_paren, NULL)) {
+      break;
+    } else if (call.arg_count && !expect(source, s_comma, NULL)) {
+      f_parse_error("Expected comma or closing parenthesis after argument.\n", curr_word);
+    }
+    
+    if (call.arg_count == routine->arg_count) {
+      f_parse_error("Too many arguments for '%s', expected %d.\n", curr_word, f_atom_name(entry->atom), routine->arg_count);
+    }
+    
+    operand_t arg = f_parse_value(arch, source, context, ir, &call);
+    
+    if (call.is_committed) {
+      f_ir_arg(ir, f_parse_use(arch, ir, arg, routine->arg_types[call.arg_count]));
+    }
+    
+    context->operands = f_arena_reserve(source->arena, context->operands, context->operand_count + 1, &(context->operand_capacity), sizeof(operand_t));
+    context->operands[context->operand_count++] = arg;
+    
+    call.arg_count++;
+  }
+  
+  if (call.arg_count < routine->arg_count) {
+    f_parse_error("Too few arguments for '%s', expected %d.\n", last_word, f_atom_name(entry->atom), routine->arg_count);
+  }
+  
+  int is_used = (outer || f_source_peek(source) != s_semicolon);
+  int value;
+  
+  if (!call.is_committed && f_inline_fits(body, is_used)) {
+    int *args = f_arena_alloc(source->arena, (call.arg_count + 1) * sizeof(int));
+    
+    // Bodies that jump around (or store) use the accumulator before their value gets used, so left operands
+    // have to get out of the way, but calls outside can still get inlined.
+    
+    for (call_t *frame = outer; frame && !f_inline_is_flat(body); frame = frame->outer) {
+      if (!frame->routine && !frame->is_committed) {
+        f_parse_spill(arch, context, ir, frame);
+      }
+    }
+    
+    for (int i = 0; i < call.arg_count; i++) {
+      args[i] = f_parse_use(arch, ir, context->operands[call.arg_base + i], routine->arg_types[i]);
+    }
+    
+    value = f_inline(ir, body, routine, args);
+  } else {
+    f_parse_commit(arch, context, ir, &call);
+    value = f_ir_call(ir, entry->atom, entry->type, routine->arg_size);
+  }
+  
+  context->operand_count = call.arg_base;
+  
+  return (operand_t){
+    .kind = operand_value,
+    .type = entry->type,
+    
+    .value = value,
+  };
+}
+
+static operand_t f_parse_value_n(const arch_t *arch, source_t *source, context_t *context, ir_t *ir, call_t *outer,
+                                 int level);
+                                 
+static operand_t f_parse_value_0(const arch_t *arch, source_t *source, context_t *context, ir_t *ir, call_t *outer) {
+  operand_t value;
+  type_t type;
+  word_t word;
+  
+  if (expect(source, l_name, &word)) {
+    int is_local = 0;
+    entry_t *entry = (context ? f_parse_find(context, word.atom, &is_local) : NULL);
+    
+    if (!entry) {
+      f_parse_error("Unknown name '%s'.\n", word, f_atom_name(word.atom));
+    }
+    
+    context->is_named = 1;
+    
+    if (is_local) {
+      return (operand_t){
+        .kind = operand_local,
+        .type = entry->type,
+        
+        .offset = entry->offset,
+      };
+    } else if (!entry->is_routine) {
+      f_parse_error("Globals cannot be used in routines, found '%s'.\n", word, f_atom_name(word.atom));
+    } else if (!expect(source, s_l_paren, NULL)) {
+      f_parse_error("Expected opening parenthesis after routine name.\n", curr_word);
+    }
+    
+    return f_parse_call(arch, source, context, ir, entry, outer);
+  } else if (expect(source, s_l_paren, &word)) {
+    if (f_parse_type(arch, source, &type)) {
+      if (!expect(source, s_r_paren, NULL)) {
+        f_parse_error("Expected closing parenthesis after cast.\n", curr_word);
+      }
+      
+      value = f_parse_value_0(arch, source, context, ir, outer);
+      
+      if (value.kind == operand_const) {
+        value.constant = f_fold_cast(arch, type, value.constant);
+      } else {
+        value.value = f_parse_use(arch, ir, value, type);
+        value.kind = operand_value;
+      }
+      
+      value.type = type;
+      return value;
+    }
+    
+    value = f_parse_value_n(arch, source, context, ir, outer, 1);
+    
+    if (!expect(source, s_r_paren, NULL)) {
+      f_parse_error("Expected closing parenthesis.\n", curr_word);
+    }
+    
+    return value;
+  } else if (expect(source, s_sub, &word) || expect(source, s_not, &word) || expect(source, s_l_shift, &word) ||
+             expect(source, s_r_shift, &word) || expect(source, s_l_rotate, &word) || expect(source, s_r_rotate, &word)) {
+    value = f_parse_value_0(arch, source, context, ir, outer);
+    
+    if (value.kind == operand_const) {
+      const char *error = f_fold_unary(arch, word.type, value.constant, &(value.constant));
+      
+      if (error) {
+        f_parse_error("%s\n", word, error);
+      }
+      
+      value.type = value.constant.type;
+      return value;
+    } else if (word.type != s_sub && word.type != s_not) {
+      f_parse_error("Shifts and rotates cannot be used on values yet.\n", word);
+    }
+    
+    // Negating is subtracting from zero, and not-ing is xor-ing with every bit set.
+    
+    int other = f_ir_const(ir, (const_t){
+      .type = value.type,
+      .is_data = 0,
+      
+      .ux = (word.type == s_sub ? 0 : ~((uint64_t)(0))),
+    });
+    
+    int operand = f_parse_use(arch, ir, value, value.type);
+    
+    return (operand_t){
+      .kind = operand_value,
+      .type = value.type,
+      
+      .value = (word.type == s_sub ? f_ir_binary(ir, ir_sub, other, operand, value.type) :
+                                     f_ir_binary(ir, ir_xor, operand, other, value.type)),
+    };
+  } else if (f_source_peek(source) != l_ux && f_source_peek(source) != l_x && f_source_peek(source) != l_chr &&
+             f_source_peek(source) != l_str) {
+    f_parse_error("Expected expression.\n", curr_word);
+  }
+  
+  const_t constant = f_parse_const_0(arch, source);
+  
+  return (operand_t){
+    .kind = operand_const,
+    .type = constant.type,
+    
+    .constant = constant,
+  };
+}
+
+// Same rules as constants (see f_fold_binary()), which is what anything only using those still gets.
+
+static operand_t f_parse_binary(const arch_t *arch, source_t *source, context_t *context, ir_t *ir, word_t word,
+                                operand_t value_a, operand_t value_b) {
+  if (value_a.kind == operand_const && value_b.kind == operand_const) {
+    const char *error = f_fold_binary(arch, word.type, value_a.constant, value_b.constant, &(value_a.constant));
+    
+    if (error) {
+      f_parse_error("%s\n", word, error);
+    }
+    
+    value_a.type = value_a.constant.type;
+    return value_a;
+  }
+  
+  int is_data_a = (value_a.kind == operand_const && value_a.constant.is_data);
+  int is_data_b = (value_b.kind == operand_const && value_b.constant.is_data);
+  
+  if ((is_data_a || is_data_b) && word.type != s_add && (word.type != s_sub || is_data_b)) {
+    f_parse_error("DATA-relative addresses can only be added to or subtracted from.\n", word);
+  }
+  
+  type_t type = f_fold_type(value_a.type, value_b.type);
+  int op = ir_xor;
+  
+  if (word.type == s_add) {
+    op = ir_add;
+  } else if (word.type == s_sub) {
+    op = ir_sub;
+  } else if (word.type == s_mul) {
+    op = ir_mul;
+  } else if (word.type == s_div) {
+    op = ir_div;
+  } else if (word.type == s_mod) {
+    op = ir_mod;
+  } else if (word.type == s_and) {
+    op = ir_and;
+  } else if (word.type == s_or) {
+    op = ir_or;
+  }
+  
+  if ((op == ir_div || op == ir_mod) && value_b.kind == operand_const &&
+      !f_fold_fit(arch, f_fold_cast(arch, type, value_b.constant)).ux) {
+    f_parse_error("Division by zero.\n", word);
+  }
+  
+  // Constants go on the right wherever they can, where the architecture can do the most with them.
+  
+  if (value_a.kind == operand_const && op != ir_sub && op != ir_div && op != ir_mod) {
+    operand_t value = value_a;
+    
+    value_a = value_b;
+    value_b = value;
+  }
+  
+  // These can call helpers, which only come with the output of a whole compile (see arch_t).
+  
+  if (op == ir_mul || op == ir_div || op == ir_mod) {
+    context->is_dependent = 1;
+  }
+  
+  int operand_a = f_parse_use(arch, ir, value_a, type);
+  int operand_b = f_parse_use(arch, ir, value_b, type);
+  
+  return (operand_t){
+    .kind = operand_value,
+    .type = type,
+    
+    .value = f_ir_binary(ir, op, operand_a, operand_b, type),
+  };
+}
+
+static operand_t f_parse_value_n(const arch_t *arch, source_t *source, context_t *context, ir_t *ir, call_t *outer,
+                                 int level) {
+  operand_t value = f_parse_value_0(arch, source, context, ir, outer);
+  word_t word;
+  
+  for (;;) {
+    int op_level = f_parse_level(f_source_peek(source));
+    
+    if (!op_level || op_level < level) {
+      return value;
+    }
+    
+    f_source_read(source, &word);
+    
+    // Constants and locals can be read again whenever, values wait for the right operand (see call_t).
+    
+    int is_kept = (value.kind == operand_value);
+    
+    call_t left = (call_t){
+      .outer = outer,
+      
+      .routine = NULL,
+      .arg_base = (is_kept ? context->operand_count : 0),
+      .arg_count = 1,
+      
+      .is_committed = 0,
+    };
+    
+    if (is_kept) {
+      context->operands = f_arena_reserve(source->arena, context->operands, context->operand_count + 1, &(context->operand_capacity), sizeof(operand_t));
+      context->operands[context->operand_count++] = value;
+    }
+    
+    operand_t other = f_parse_value_n(arch, source, context, ir, (is_kept ? &left : outer), op_level + 1);
+    
+    if (is_kept) {
+      value = context->operands[left.arg_base];
+      context->operand_count = left.arg_base;
+    }
+    
+    value = f_parse_binary(arch, source, context, ir, word, value, other);
+  }
+}
+
+static operand_t f_parse_value(const arch_t *arch, source_t *source, context_t *context, ir_t *ir, call_t *call) {
+  return f_parse_value_n(arch, source, context, ir, call, 1);
+}
+
+// Returns whether the expression exited the routine. Values that are not used (or exited with) only get as
+// far as the IR if they have side effects, which only calls do.
+
+static int f_parse_expr(const arch_t *arch, source_t *source, context_t *context, ir_t *ir) {
+  operand_t value = f_parse_value(arch, source, context, ir, NULL);
+  
+  if (expect(source, s_semicolon, NULL)) {
+    return 0;
+  } else if (expect(source, s_exit, NULL)) {
+    f_ir_return(ir, f_parse_use(arch, ir, value, ir->exit_type));
+    return 1;
+  }
+  
+  f_parse_error("Expected semicolon or exit after local statement.\n", curr_word);
+}
+
+static int f_parse_statement(const arch_t *arch, source_t *source, context_t *context, ir_t *ir);
+
+// Statements up to the closing parenthesis of a block, returning whether it exited (the rest of it being
+// skipped then, as nothing can reach it).
+
+static int f_parse_block(const arch_t *arch, source_t *source, context_t *context, ir_t *ir) {
+  for (;;) {
+    if (expect(source, s_r_paren, NULL)) {
+      return 0;
+    }
+    
+    if (f_parse_statement(arch, source, context, ir)) {
+      if (!skip_block(source)) {
+        f_parse_error("Expected closing parenthesis.\n", last_word);
+      }
+      
+      return 1;
+    }
+  }
+}
+
+// Loops get emitted just as they read, testing their condition at the top (exiting if it is not met) and
+// jumping back to it at the bottom, see loop.c for what passes make of that.
+
+static void f_parse_loop(const arch_t *arch, source_t *source, context_t *context, ir_t *ir, word_t word) {
+  const int exit_ops[] = {ir_jump_nz, ir_jump_z, ir_jump_np, ir_jump_p}; // From k_whz on.
+  
+  if (!expect(source, s_l_paren, NULL)) {
+    f_parse_error("Expected opening parenthesis after loop keyword.\n", word);
+  }
+  
+  int head = f_ir_block(ir), body = f_ir_block(ir), exit = f_ir_block(ir);
+  f_ir_place(ir, head);
+  
+  operand_t value = f_parse_value(arch, source, context, ir, NULL);
+  
+  if (!expect(source, s_r_paren, NULL)) {
+    f_parse_error("Expected closing parenthesis after loop condition.\n", curr_word);
+  }
+  
+  f_ir_jump(ir, exit_ops[word.type - k_whz], f_parse_use(arch, ir, value, value.type), exit);
+  f_ir_place(ir, body);
+  
+  int is_exited = (expect(source, s_a_paren, NULL) ? f_parse_block(arch, source, context, ir) :
+                                                      f_parse_statement(arch, source, context, ir));
+                                                      
+  // Bodies that always exit never get back to the test, leaving just a conditional.
+  
+  if (!is_exited) {
+    f_ir_jump(ir, ir_jump, -1, head);
+  }
+  
+  f_ir_place(ir, exit);
+}
+
+// Returns whether the statement exited the routine, which loops never do (as they might not run at all).
+
+static int f_parse_statement(const arch_t *arch, source_t *source, context_t *context, ir_t *ir) {
+  word_t word;
+  
+  if (expect(source, k_whz, &word) || expect(source, k_whnz, &word) || expect(source, k_whp, &word) ||
+      expect(source, k_whnp, &word)) {
+    f_parse_loop(arch, source, context, ir, word);
+    return 0;
+  }
+  
+  return f_parse_expr(arch, source, context, ir);
+}
+
+// Everything after the opening "@(" of a routine, which is all that goes into its IR.
+
+static void f_parse_body(const arch_t *arch, source_t *source, context_t *context, ir_t *ir) {
+  f_parse_block(arch, source, context, ir);
+  f_ir_run(arch, ir);
+}
+
+// Routine bodies can get generated by worker threads instead, each one printing into a buffer of its own
+// (labels being per thread too, see arch_t). The main thread parses every declaration and routine header,
+// queueing bodies with the arguments and locals it found, and the workers only start once it is done, so the
+// globals and names it leaves are frozen and shared. Each worker binds the locals of its routine in a table of
+// its own, and only sees the globals declared before the routine, as would happen serially. Calls only inline
+// routines whose body comes first, waiting for whichever worker has it (see f_pool_wait()).
+//
+// Once every body is done, their output gets put back in between the main thread's in source order, so it all
+// comes out just like generating them one after another would. Errors get kept instead of printed for the
+// same reason, and only the first one in source order gets reported.
+
+#define POOL_TAKE 8 // Routines a worker takes at once (locking for each one would take longer).
+
+typedef struct job_t job_t;
+typedef struct worker_t worker_t;
+
+struct job_t {
+  uint32_t atom;
+  type_t exit_type;
+  routine_t *routine;
+  
+  entry_t *locals; // Arguments and locals, as the main thread parsed them.
+  int local_count;
+  int global_count; // Declared before the body, which can only name those.
+  
+  int word_index, value_index; // Right past the opening "@(".
+  long offset;                 // Where its output goes, in the main thread's.
+  
+  int worker;         // That generated it,
+  long start, length; // and where its output is, in that worker's.
+  
+  char *error; // From malloc(), if it failed.
+};
+
+struct worker_t {
+  pool_t *pool;
+  pthread_t thread;
+  
+  FILE *stream;
+  char *text;
+  size_t length;
+  
+  arena_t arena;
+  context_t context;
+  ir_t ir;
+};
+
+struct pool_t {
+  const arch_t *arch;
+  source_t source; // Copy of the main thread's, which has every word spliced already.
+  
+  worker_t *workers;
+  int worker_count;
+  
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // Broadcast whenever a routine is done.
+  
+  job_t **jobs; // All queued before any worker starts (from the main thread's arena).
+  int job_count, job_capacity;
+  int job_next;
+  
+  FILE *stream; // Output of the main thread.
+  char *text;
+  size_t length;
+};
+
+// Body of a routine to inline a call with, from a worker. Routines whose body comes before body_index would be
+// done already if generating serially, so those get waited for, any other one just gets called.
+
+static const ir_t *f_pool_wait(pool_t *pool, const routine_t *routine, int body_index) {
+  const ir_t *body;
+  
+  if (!routine->word_index || routine->word_index >= body_index) {
+    return NULL;
+  }
+  
+  pthread_mutex_lock(&(pool->lock));
+  
+  while (routine->state != routine_done) {
+    pthread_cond_wait(&(pool->wake), &(pool->lock));
+  }
+  
+  body = routine->body;
+  
+  pthread_mutex_unlock(&(pool->lock));
+  return body;
+}
+
+// Generates a routine into the worker's output, keeping its error if it fails. Either way the routine ends up
+// done, so no worker waits on it forever. The setjmp() gets a frame of its own so nothing the caller loops with
+// gets clobbered by the longjmp().
+
+static void f_pool_job(worker_t *worker, job_t *job) {
+  pool_t *pool = worker->pool;
+  context_t *context = &(worker->context);
+  source_t source = pool->source;
+  
+  jmp_buf jump;
+  
+  source.arena = &(worker->arena);
+  source.word_index = job->word_index;
+  source.value_index = job->value_index;
+  
+  context->locals = job->locals;
+  context->local_count = job->local_count;
+  context->global_count = job->global_count;
+  context->operand_count = 0;
+  context->body_index = job->word_index;
+  
+  int scope = f_table_scope(&(context->names));
+  
+  for (int i = 0; i < job->local_count; i++) {
+    f_table_bind(source.arena, &(context->names), job->locals[i].atom, (i << 1) | 1);
+  }
+  
+  job->worker = worker - pool->workers;
+  job->start = ftell(worker->stream);
+  
+  f_error_jump = &jump;
+  
+  if (!setjmp(jump)) {
+    f_ir_init(&(worker->ir), job->atom, job->exit_type, job->routine->arg_size, job->routine->local_size);
+    f_parse_body(pool->arch, &source, context, &(worker->ir));
+    
+    // Copied before taking the lock, as copying can fail (running out of memory), and the longjmp() would
+    // take it again.
+    
+    ir_t *body = f_parse_keep(pool->arch, &source, context, job->routine, &(worker->ir));
+    pthread_mutex_lock(&(pool->lock));
+    
+    job->routine->state = routine_done;
+    job->routine->body = body;
+    
+    pthread_cond_broadcast(&(pool->wake));
+    pthread_mutex_unlock(&(pool->lock));
+    
+    f_ir_lower(pool->arch, &(worker->ir));
+  } else {
+    job->error = strdup(f_error_message);
+    pthread_mutex_lock(&(pool->lock));
+    
+    if (job->routine->state != routine_done) {
+      job->routine->state = routine_done;
+      job->routine->body = NULL;
+    }
+    
+    pthread_cond_broadcast(&(pool->wake));
+    pthread_mutex_unlock(&(pool->lock));
+  }
+  
+  f_error_jump = NULL;
+  f_table_pop(&(context->names), scope);
+  
+  job->length = ftell(worker->stream) - job->start;
+}
+
+static void *f_pool_thread(void *data) {
+  worker_t *worker = data;
+  pool_t *pool = worker->pool;
+  
+  f_output = worker->stream;
+  f_error_is_kept = 1;
+  
+  for (;;) {
+    job_t *jobs[POOL_TAKE];
+    int job_count = 0;
+    
+    pthread_mutex_lock(&(pool->lock));
+    
+    while (job_count < POOL_TAKE && pool->job_next < pool->job_count) {
+      jobs[job_count++] = pool->jobs[pool->job_next++];
+    }
+    
+    pthread_mutex_unlock(&(pool->lock));
+    
+    if (!job_count) {
+      break;
+    }
+    
+    for (int i = 0; i < job_count; i++) {
+      f_pool_job(worker, jobs[i]);
+    }
+  }
+  
+  return NULL;
+}
+
+static pool_t *f_pool_start(const arch_t *arch, int thread_count) {
+  pool_t *pool = malloc(sizeof(pool_t));
+  
+  *pool = (pool_t){
+    .arch = arch,
+    
+    .workers = malloc(thread_count * sizeof(worker_t)),
+    .worker_count = thread_count,
+    
+    .jobs = NULL,
+    .job_count = 0,
+    .job_capacity = 0,
+    .job_next = 0,
+    
+    .text = NULL,
+    .length = 0,
+  };
+  
+  pthread_mutex_init(&(pool->lock), NULL);
+  pthread_cond_init(&(pool->wake), NULL);
+  
+  pool->stream = open_memstream(&(pool->text), &(pool->length));
+  return pool;
+}
+
+// Hands the body of a routine (at word_index and value_index) over to the workers, to be put where the main
+// thread's output is at right now, with the arguments and locals in context.
+
+static void f_parse_queue(pool_t *pool, source_t *source, const context_t *context, const entry_t *entry,
+                          int word_index, int value_index) {
+  job_t *job = f_arena_alloc(source->arena, sizeof(job_t));
+  entry_t *locals = f_arena_alloc(source->arena, (context->local_count + 1) * sizeof(entry_t));
+  
+  if (context->local_count) {
+    memcpy(locals, context->locals, context->local_count * sizeof(entry_t));
+  }
+  
+  *job = (job_t){
+    .atom = entry->atom,
+    .exit_type = entry->type,
+    .routine = entry->routine,
+    
+    .locals = locals,
+    .local_count = context->local_count,
+    .global_count = context->global_count,
+    
+    .word_index = word_index,
+    .value_index = value_index,
+    .offset = ftell(pool->stream),
+    
+    .worker = 0,
+    .start = 0,
+    .length = 0,
+    
+    .error = NULL,
+  };
+  
+  pool->jobs = f_arena_reserve(source->arena, pool->jobs, pool->job_count + 1, &(pool->job_capacity), sizeof(job_t *));
+  pool->jobs[pool->job_count++] = job;
+}
+
+// Runs the workers over every routine queued, each with a context of its own on top of the (now frozen) one of
+// the main thread.
+
+static void f_pool_run(pool_t *pool, const source_t *source, const context_t *context) {
+  pool->source = *source;
+  
+  for (int i = 0; i < pool->worker_count; i++) {
+    worker_t *worker = pool->workers + i;
+    
+    *worker = (worker_t){
+      .pool = pool,
+      
+      .text = NULL,
+      .length = 0,
+      
+      .arena = (arena_t){
+        .chunk = NULL,
+        .large = NULL,
+        .chunk_length = 0,
+        
+        .allocated = 0,
+        .reserved = 0,
+      },
+    };
+    
+    worker->ir = (ir_t){
+      .arena = &(worker->arena),
+      
+      .blocks = NULL,
+      .block_count = 0,
+      .block_capacity = 0,
+      
+      .order = NULL,
+      .order_count = 0,
+      .order_capacity = 0,
+      
+      .value_count = 0,
+      
+      .defs = NULL,
+      .def_capacity = 0,
+      
+      .values = NULL,
+      .value_capacity = 0,
+      
+      .ranges = NULL,
+      .range_count = 0,
+      .range_capacity = 0,
+    };
+    
+    worker->context = (context_t){
+      .globals = context->globals,
+      .global_count = 0,
+      .global_capacity = 0,
+      
+      .locals = NULL,
+      .local_count = 0,
+      .local_capacity = 0,
+      
+      .arg_types = NULL,
+      .arg_capacity = 0,
+      
+      .operands = NULL,
+      .operand_count = 0,
+      .operand_capacity = 0,
+      
+      .names = (table_t){
+        .slots = NULL,
+        .slot_capacity = 0,
+        
+        .binds = NULL,
+        .bind_count = 0,
+        .bind_capacity = 0,
+      },
+      .global_names = &(context->names),
+      
+      .ir = &(worker->ir),
+      .lazy_ir = NULL,
+      
+      .inlining = context->inlining,
+      .inline_names = context->inline_names,
+      
+      .is_named = 0,
+      .is_dependent = 0,
+      .body_index = 0,
+      
+      .pool = pool,
+      .link = NULL,
+      
+      .enums = context->enums,
+      .enum_count = context->enum_count,
+    };
+    
+    worker->stream = open_memstream(&(worker->text), &(worker->length));
+    pthread_create(&(worker->thread), NULL, f_pool_thread, worker);
+  }
 }
 
-static const_t cast(const arch_t *arch, type_t type, const_t value) {
-  int type_width = f_type_size(arch, type);
-  int width = f_type_size(arch, value.type);
+// Waits for every routine, and prints it all in order up to the first error (error being the main thread's,
+// from malloc(), which comes after any routine it queued).
+
+static void f_pool_done(pool_t *pool, FILE *output, char *error) {
+  for (int i = 0; i < pool->worker_count; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+    fclose(pool->workers[i].stream);
+  }
+  
+  fclose(pool->stream);
   
-  if (value.is_data && type_width < width) {
-    f_error("Cannot cast DATA-relative address to smaller size.\n");
+  if (!output) {
+    output = stdout;
   }
   
-  if (type_width > width) {
-    value.ux &= (((uint64_t)(1)) << (width * 8)) - 1;
-    int sign_bit = (value.ux >> (width * 8 - 1)) & 1;
+  long offset = 0;
+  int is_failed = 0;
+  
+  for (int i = 0; i < pool->job_count; i++) {
+    const job_t *job = pool->jobs[i];
+    const worker_t *worker = pool->workers + job->worker;
+    
+    fwrite(pool->text + offset, 1, job->offset - offset, output);
+    fwrite(worker->text + job->start, 1, job->length, output);
     
-    if (value.type.base_signed && type.base_signed && sign_bit) {
-      value.ux |= ((~((uint64_t)(0))) << (width * 8));
+    offset = job->offset;
+    
+    if (job->error) {
+      free(error);
+      error = job->error;
+      
+      is_failed = 1;
+      break;
     }
   }
   
-  value.type = type;
-  return value;
-}
-
-static type_t type_max(const arch_t *arch, type_t type_a, type_t type_b) {
-  if (type_a.point_count && type_b.point_count) {
-    if (type_a.base_width != type_b.base_width ||
-        type_a.base_signed != type_b.base_signed ||
-        type_a.point_count != type_b.point_count) {
-      f_error("Cannot operate with two pointers of different type.\n");
+  if (!is_failed) {
+    fwrite(pool->text + offset, 1, pool->length - offset, output);
+  }
+  
+  for (int i = 0; i < pool->job_count; i++) {
+    if (pool->jobs[i]->error != error) {
+      free(pool->jobs[i]->error);
     }
-    
-    return type_a;
-  } else if (type_a.point_count) {
-    return type_a;
-  } else if (type_b.point_count) {
-    return type_b;
   }
   
-  return (type_t){
-    .base_width = (type_a.base_width > type_b.base_width ? type_a.base_width : type_b.base_width),
-    .base_signed = (type_a.base_signed && type_b.base_signed),
+  for (int i = 0; i < pool->worker_count; i++) {
+    free(pool->workers[i].text);
+    f_arena_free(&(pool->workers[i].arena));
+  }
+  
+  pthread_mutex_destroy(&(pool->lock));
+  pthread_cond_destroy(&(pool->wake));
+  
+  free(pool->workers);
+  free(pool->text);
+  free(pool);
+  
+  if (error) {
+    snprintf(f_error_message, sizeof(f_error_message), "%s", error);
+    free(error);
     
-    .point_count = 0,
-  };
+    f_error("%s", f_error_message);
+  }
 }
 
-static const_t f_parse_const_0(const arch_t *arch, source_t *source) {
-  word_t word;
+// Names in context->names are bound to (index << 1) | is_local, indices being into globals or locals. Locals
+// get bound in a scope of their own, popped once their routine is done. Workers only bind locals, and look
+// globals up in the main thread's names, up to the ones declared before their routine (see pool_t).
+
+static entry_t *f_parse_find(context_t *context, uint32_t atom, int *is_local) {
+  int value = f_table_find(&(context->names), atom);
   
-  if (expect(source, l_name, &word)) {
-    f_parse_error("Constant expressions cannot contain lvalues, found '%s'.\n", word, word.name);
-  } else if (expect(source, l_ux, &word) || expect(source, l_x, &word) || expect(source, l_chr, &word)) {
-    int min_width = 0;
+  if (value < 0 && context->global_names) {
+    value = f_table_find(context->global_names, atom);
     
-    while (word.ux >= (((uint64_t)(1)) << min_width)) {
-      min_width++;
-    }
-    
-    if (word.type == l_x) {
-      min_width++;
+    if ((value >> 1) >= context->global_count) {
+      value = -1;
     }
-    
-    min_width = (min_width + 7) / 8;
-    
-    return (const_t){
-      .type = (type_t){
-        .base_width = min_width,
-        .base_signed = (word.type == l_x),
-        
-        .point_count = 0,
-      },
-      
-      .is_data = 0,
-      .ux = word.ux,
-    };
   }
   
-  f_parse_error("Expected constant expression.\n", curr_word);
-}
-
-static const_t f_parse_const(const arch_t *arch, source_t *source) {
-  return f_parse_const_0(arch, source);
+  if (value < 0) {
+    return NULL;
+  }
+  
+  *is_local = (value & 1);
+  return (*is_local ? context->locals : context->globals) + (value >> 1);
 }
 
-static void f_cast(const arch_t *arch, source_t *source, type_t old_type, type_t new_type) {
-  int old_width = f_type_size(arch, old_type);
-  int new_width = f_type_size(arch, new_type);
+static void f_parse_local(source_t *source, context_t *context, entry_t entry, word_t word, const char *kind) {
+  int is_local;
   
-  if (old_type.point_count || new_type.point_count) {
-    old_type.base_signed = 0;
+  if (f_parse_find(context, entry.atom, &is_local) && is_local) {
+    f_parse_error("%s '%s' already exists.\n", word, kind, f_atom_name(entry.atom));
   }
   
-  if (new_width > old_width) {
-    if (old_type.base_signed && new_type.base_signed) {
-      arch->f_sign_extend(new_width, old_width);
-    } else {
-      arch->f_zero_extend(new_width, old_width);
+  context->locals = f_arena_reserve(source->arena, context->locals, context->local_count + 1, &context->local_capacity, sizeof(entry_t));
+  context->locals[context->local_count] = entry;
+  
+  f_table_bind(source->arena, &(context->names), entry.atom, (context->local_count++ << 1) | 1);
+}
+
+// Routines can be declared any number of times (say, in a header and then defined), anything else only once.
+// Returns the entry declared (or the one from before, for routines).
+
+static entry_t *f_parse_declare(source_t *source, context_t *context, entry_t entry, word_t word) {
+  int is_local;
+  entry_t *old_entry = f_parse_find(context, entry.atom, &is_local);
+  
+  if (old_entry) {
+    if (!old_entry->is_routine || !entry.is_routine) {
+      f_parse_error("Global '%s' already exists.\n", word, f_atom_name(entry.atom));
     }
+    
+    return old_entry;
   }
+  
+  context->globals = f_arena_reserve(source->arena, context->globals, context->global_count + 1, &context->global_capacity, sizeof(entry_t));
+  context->globals[context->global_count] = entry;
+  
+  f_table_bind(source->arena, &(context->names), entry.atom, context->global_count << 1);
+  return context->globals + (context->global_count++);
 }
 
-static type_t f_parse_expr_0(const arch_t *arch, source_t *source) {
-  type_t type;
-  word_t word;
+// Arguments of the first declaration of a routine, which any other has to match. Arguments take whole words
+// on the stack, the last one being closest to the frame.
+
+static void f_parse_signature(const arch_t *arch, source_t *source, entry_t *entry, const type_t *arg_types, int arg_count) {
+  routine_t *routine = entry->routine;
   
-  if (expect(source, l_name, &word)) {
-    // TODO
-  } else if (expect(source, l_ux, &word) || expect(source, l_x, &word) || expect(source, l_chr, &word)) {
-    int min_width = 1;
+  if (routine) {
+    int is_same = (routine->arg_count == arg_count);
     
-    while (word.ux >= (((uint64_t)(1)) << min_width)) {
-      min_width++;
+    for (int i = 0; is_same && i < arg_count; i++) {
+      is_same = (routine->arg_types[i].base_width == arg_types[i].base_width &&
+                 routine->arg_types[i].base_signed == arg_types[i].base_signed &&
+                 routine->arg_types[i].point_count == arg_types[i].point_count);
     }
     
-    if (word.type == l_x) {
-      min_width++;
+    if (!is_same) {
+      f_parse_error("Routine '%s' declared again with different arguments.\n", last_word, f_atom_name(entry->atom));
     }
     
-    min_width = (min_width + 7) / 8;
-    
-    type_t type = (type_t){
-      .base_width = min_width,
-      .base_signed = (word.type == l_x),
-      
-      .point_count = 0,
-    };
-    
-    arch->f_load_const((const_t){
-      .type = type,
-      
-      .is_data = 0,
-      .ux = word.ux,
-    });
-    
-    return type;
-  } else if (expect(source, s_l_paren, NULL)) {
-    if (f_parse_type(arch, source, &type)) {
-      // Cast!
-    } else {
-      // Just a regular parenthesized expression...
-    }
+    return;
   }
   
-  f_parse_error("Expected expression.\n", curr_word);
-}
-
-static int f_parse_expr(const arch_t *arch, source_t *source, type_t exit_type, int exit_label, int in_root) {
-  type_t type = f_parse_expr_0(arch, source);
+  // All in one go, as there is one for every routine.
   
-  if (expect(source, s_semicolon, NULL)) {
-    return exit_label;
-  } else if (expect(source, s_exit, NULL)) {
-    f_cast(arch, source, type, exit_type);
+  routine = f_arena_alloc(source->arena, sizeof(routine_t) + arg_count * (sizeof(type_t) + sizeof(int)));
+  
+  *routine = (routine_t){
+    .arg_types = (type_t *)(routine + 1),
+    .arg_offsets = (int *)((type_t *)(routine + 1) + arg_count),
+    .arg_count = arg_count,
+    .arg_size = 0,
     
-    if (in_root) {
-      return -2;
-    }
+    .state = routine_declared,
+    .word_index = 0,
+    .value_index = 0,
+    .local_size = 0,
     
-    if (exit_label < 0) {
-      exit_label = arch->f_next();
-    }
+    .body = NULL,
+  };
+  
+  if (arg_count) {
+    memcpy(routine->arg_types, arg_types, arg_count * sizeof(type_t));
+  }
+  
+  for (int i = arg_count - 1; i >= 0; i--) {
+    int width = f_type_size(arch, arg_types[i]);
     
-    arch->f_jump(exit_label);
-    return exit_label;
+    routine->arg_offsets[i] = arch->arg_offset + routine->arg_size;
+    routine->arg_size += ((width + arch->data_width - 1) / arch->data_width) * arch->data_width;
   }
   
-  f_parse_error("Expected semicolon or exit after local statement.\n", curr_word);
+  entry->routine = routine;
 }
 
-static void f_parse_routine(const arch_t *arch, source_t *source, context_t *context, type_t exit_type, const char *name) {
-  int arg_offset = arch->point_width; // Shift one pointer forward (return address!).
+static void f_parse_routine(const arch_t *arch, source_t *source, context_t *context, entry_t *routine_entry) {
+  uint32_t atom = routine_entry->atom;
+  type_t exit_type = routine_entry->type;
+  
+  int arg_count = 0;
+  
   int local_offset = 0;
   
   type_t type;
   word_t word;
   
-  context->locals = NULL;
-  context->local_count = 0;
+  context->local_count = 0; // The locals array itself is reused from routine to routine.
+  int scope = f_table_scope(&(context->names));
   
   if (f_type_size(arch, exit_type) > arch->data_width) {
     f_parse_error("Return values cannot be larger than %d bytes.\n", last_word, arch->data_width);
@@ -273,7 +1314,7 @@ static void f_parse_routine(const arch_t *arch, source_t *source, context_t *con
     if (expect(source, s_r_paren, NULL)) {
       break;
     } else if (expect(source, s_comma, NULL)) {
-      if (!context->local_count) {
+      if (!arg_count) {
         f_parse_error("Unexpected comma.\n", last_word);
       }
     }
@@ -283,30 +1324,31 @@ static void f_parse_routine(const arch_t *arch, source_t *source, context_t *con
     }
     
     if (expect(source, l_name, &word)) {
-      for (int i = 0; i < context->local_count; i++) {
-        if (!strcmp(context->locals[i].name, word.name)) {
-          f_parse_error("Argument '%s' already exists.\n", word, word.name);
-        }
-      }
-      
       entry_t entry = (entry_t){
+        .atom = word.atom,
         .type = type,
-        .offset = arg_offset,
+        .offset = arg_count, // Until every argument is known.
+        
+        .routine = NULL,
       };
       
-      strcpy(entry.name, word.name);
-      
-      context->locals = realloc(context->locals, (context->local_count + 1) * sizeof(entry_t));
-      context->locals[context->local_count++] = entry;
+      f_parse_local(source, context, entry, word, "Argument");
     }
     
-    arg_offset += f_type_size(arch, type);
+    context->arg_types = f_arena_reserve(source->arena, context->arg_types, arg_count + 1, &(context->arg_capacity), sizeof(type_t));
+    context->arg_types[arg_count++] = type;
   }
   
-  if (expect(source, s_semicolon, NULL)) {
+  f_parse_signature(arch, source, routine_entry, context->arg_types, arg_count);
+  routine_t *routine = routine_entry->routine;
+  
+  for (int i = 0; i < context->local_count; i++) {
+    context->locals[i].offset = routine->arg_offsets[context->locals[i].offset];
+  }
+  
+  if (f_source_peek(source) == s_semicolon) {
     // TODO: We *might* try to make something out of this? (header momento)
-    
-    free(context->locals);
+    f_table_pop(&(context->names), scope);
     return;
   }
   
@@ -319,7 +1361,7 @@ static void f_parse_routine(const arch_t *arch, source_t *source, context_t *con
       if (expect(source, s_r_paren, NULL)) {
         break;
       } else if (expect(source, s_comma, NULL)) {
-        if (!arg_offset) {
+        if (!local_offset) {
           f_parse_error("Unexpected comma.\n", last_word);
         }
       }
@@ -331,55 +1373,69 @@ static void f_parse_routine(const arch_t *arch, source_t *source, context_t *con
       local_offset += f_type_size(arch, type);
       
       if (expect(source, l_name, &word)) {
-        for (int i = 0; i < context->local_count; i++) {
-          if (!strcmp(context->locals[i].name, word.name)) {
-            f_parse_error("Local '%s' already exists.\n", word, word.name);
-          }
-        }
-        
         entry_t entry = (entry_t){
+          .atom = word.atom,
           .type = type,
           .offset = -local_offset,
+          
+          .routine = NULL,
         };
         
-        strcpy(entry.name, word.name);
-        
-        context->locals = realloc(context->locals, (context->local_count + 1) * sizeof(entry_t));
-        context->locals[context->local_count++] = entry;
+        f_parse_local(source, context, entry, word, "Local");
       }
     }
   }
   
-  arch->f_global(name);
-  arch->f_init_routine(local_offset);
-  
-  int exit_label = -1;
-  
   if (!expect(source, s_a_paren, NULL)) {
     f_parse_error("Expected opening code block in function declaration.\n", curr_word);
   }
   
-  for (;;) {
-    if (expect(source, s_r_paren, NULL)) {
-      break;
-    }
+  int word_index = source->word_index;
+  int value_index = source->value_index;
+  
+  routine->local_size = local_offset;
+  
+  // Bodies that never get closed are parsed right here instead, so the error is the same as serially.
+  
+  if (context->pool && skip_block(source)) {
+    f_parse_queue(context->pool, source, context, routine_entry, word_index, value_index);
     
-    exit_label = f_parse_expr(arch, source, exit_type, exit_label, 1);
+    routine->state = routine_queued;
+    routine->word_index = word_index;
+    routine->value_index = value_index;
     
-    if (exit_label == -2) {
-      skip_block(source);
-      break;
-    }
+    f_table_pop(&(context->names), scope);
+    return;
+  }
+  
+  source->word_index = word_index;
+  source->value_index = value_index;
+  
+  routine->state = routine_busy;
+  context->is_named = 0;
+  
+  f_ir_init(context->ir, atom, exit_type, routine->arg_size, local_offset);
+  f_parse_body(arch, source, context, context->ir);
+  
+  if (!context->is_named && !source->is_streaming) {
+    routine->state = routine_lazy;
+    routine->word_index = word_index;
+    routine->value_index = value_index;
+  } else {
+    routine->body = f_parse_keep(arch, source, context, routine, context->ir);
+    routine->state = routine_done;
   }
   
-  if (exit_label >= 0) {
-    arch->f_label(exit_label);
+  if (context->link) {
+    f_link_routine(context->link, context->ir);
+  } else {
+    f_ir_lower(arch, context->ir);
   }
   
-  arch->f_exit_routine();
+  f_table_pop(&(context->names), scope);
 }
 
-static void f_parse_global(const arch_t *arch, source_t *source, context_t *context, type_t type, const char *name) {
+static void f_parse_global(const arch_t *arch, source_t *source, context_t *context, type_t type, uint32_t atom) {
   const_t value = (const_t){
     .type = type,
     .is_data = 0,
@@ -388,41 +1444,153 @@ static void f_parse_global(const arch_t *arch, source_t *source, context_t *cont
   };
   
   if (expect(source, s_assign, NULL)) {
-    value = cast(arch, type, f_parse_const(arch, source));
+    value = f_fold_cast(arch, type, f_parse_const(arch, source));
   }
   
-  arch->f_global(name);
+  if (context->link) {
+    f_link_global(context->link, atom, value);
+    return;
+  }
+  
+  arch->f_global(f_atom_name(atom));
   arch->f_const(value);
 }
 
-void f_parse_root(const arch_t *arch, source_t *source) {
-  context_t context = (context_t){
-    .globals = NULL,
-    .global_count = 0,
+// Finds the end of the top-level statement at the cursor (the word past its semicolon, -1 if there is none)
+// and hashes its words on the way, strings included.
+
+static int f_parse_end(source_t *source, int *value_end, uint64_t *hash) {
+  int value_index = source->value_index;
+  int depth = 0;
+  
+  *hash = f_replay_hash(0, NULL, 0);
+  
+  for (int i = source->word_index; i < source->word_count; i++) {
+    uint8_t type = source->word_types[i - source->word_base];
+    *hash = f_replay_hash(*hash, &type, sizeof(type));
     
-    .locals = NULL,
-    .local_count = 0,
+    if (f_word_has_value(type)) {
+      const value_t *value = source->values + (value_index++ - source->value_base);
+      *hash = f_replay_hash(*hash, value, sizeof(value_t));
+      
+      if (type == l_str) {
+        const char *string = source->data_buffer + value->str;
+        *hash = f_replay_hash(*hash, string, strlen(string) + 1);
+      }
+    }
     
-    .enums = NULL,
-    .enum_count = 0,
-  };
+    if (type == s_l_paren || type == s_a_paren) {
+      depth++;
+    } else if (type == s_r_paren) {
+      depth--;
+    } else if (type == s_semicolon && !depth) {
+      *value_end = value_index;
+      return i + 1;
+    }
+  }
+  
+  return -1;
+}
+
+// Prints the output of the statement at the cursor from the last compiles and skips it, if there is any.
+// Otherwise starts capturing its output, which f_parse_record() keeps once it is done.
+
+static int f_parse_replay(source_t *source, context_t *context, replay_t *replay, uint64_t *hash) {
+  int value_end;
+  int end = f_parse_end(source, &value_end, hash);
+  
+  replay->statement_count++;
   
+  if (end < 0) {
+    return 0; // Let the parser complain about it.
+  }
+  
+  replay_entry_t *entry = f_replay_find(replay, *hash);
+  
+  if (entry) {
+    for (int i = 0; i < entry->global_count; i++) {
+      f_parse_declare(source, context, entry->globals[i], curr_word);
+    }
+    
+    fwrite(entry->text, 1, entry->length, f_output ? f_output : stdout);
+    
+    source->word_index = end;
+    source->value_index = value_end;
+    
+    replay->hit_count++;
+    return 1;
+  }
+  
+  replay->stream = open_memstream(&(replay->stream_text), &(replay->stream_length));
+  return 0;
+}
+
+static void f_parse_record(context_t *context, replay_t *replay, FILE *output, uint64_t hash, int global_base) {
+  if (!replay->stream) {
+    return;
+  }
+  
+  fclose(replay->stream);
+  replay->stream = NULL;
+  
+  fwrite(replay->stream_text, 1, replay->stream_length, output ? output : stdout);
+  
+  // Calls depend on what they call, which is not part of the statement.
+  
+  if (context->is_dependent) {
+    free(replay->stream_text);
+  } else {
+    f_replay_add(replay, hash, replay->stream_text, replay->stream_length, context->globals + global_base,
+                 context->global_count - global_base);
+  }
+  
+  replay->stream_text = NULL;
+}
+
+static void f_parse_all(const arch_t *arch, source_t *source, context_t *context, replay_t *replay) {
   type_t type;
   word_t word;
   
-  arch->f_init();
+  FILE *output = f_output;
   
-  while (source->word_index < source->word_count) {
+  while (f_source_peek(source) != w_invalid) {
+    uint64_t hash = 0;
+    int global_base = context->global_count;
+    
+    context->is_dependent = 0;
+    
+    if (replay && !source->is_streaming) {
+      if (f_parse_replay(source, context, replay, &hash)) {
+        continue;
+      }
+      
+      if (replay->stream) {
+        f_output = replay->stream;
+      }
+    }
+    
     if (f_parse_type(arch, source, &type)) {
       if (!expect(source, l_name, &word)) {
         f_parse_error("Expected identifier after type.\n", curr_word);
       }
       
+      entry_t entry = (entry_t){
+        .atom = word.atom,
+        .type = type,
+        .is_routine = 0,
+        
+        .routine = NULL,
+      };
+      
       if (expect(source, s_l_paren, NULL)) {
-        f_parse_routine(arch, source, &context, type, word.name);
+        entry.is_routine = 1;
+        f_parse_routine(arch, source, context, f_parse_declare(source, context, entry, word));
       } else {
         for (;;) {
-          f_parse_global(arch, source, &context, type, word.name);
+          entry.atom = word.atom;
+          f_parse_declare(source, context, entry, word);
+          
+          f_parse_global(arch, source, context, type, word.atom);
           
           if (expect(source, s_comma, NULL)) {
             if (!expect(source, l_name, &word)) {
@@ -440,10 +1608,161 @@ void f_parse_root(const arch_t *arch, source_t *source) {
     if (!expect(source, s_semicolon, NULL)) {
       f_parse_error("Expected semicolon after global statement.\n", curr_word);
     }
+    
+    if (replay) {
+      f_output = output;
+      f_parse_record(context, replay, output, hash, global_base);
+    }
+    
+    f_source_release(source);
   }
   
-  if (source->data_length) {
+  if (context->link) {
+    f_link_emit(arch, context->link, source->data_buffer, source->data_length);
+  } else if (source->data_length) {
     arch->f_global("DATA");
     arch->f_data(source->data_buffer, source->data_length);
   }
 }
+
+// Routine bodies get generated by thread_count threads, unless there is just one, or words go away as the
+// parser is done with them (streamed sources), or there is a replay to keep statements for. With roots given
+// (NULL-terminated), only what those reach gets emitted, once everything is parsed (see link.c). Routines get
+// inlined as inlining says, unless replaying (statements only get replayed for what their own words say).
+
+void f_parse_root(const arch_t *arch, source_t *source, replay_t *replay, const char **roots, const inline_t *inlining,
+                  int thread_count) {
+  ir_t ir = (ir_t){
+    .arena = source->arena,
+    
+    .blocks = NULL,
+    .block_count = 0,
+    .block_capacity = 0,
+    
+    .order = NULL,
+    .order_count = 0,
+    .order_capacity = 0,
+    
+    .value_count = 0,
+    
+    .defs = NULL,
+    .def_capacity = 0,
+    
+    .values = NULL,
+    .value_capacity = 0,
+    
+    .ranges = NULL,
+    .range_count = 0,
+    .range_capacity = 0,
+  };
+  
+  ir_t lazy_ir = ir;
+  
+  context_t context = (context_t){
+    .globals = NULL,
+    .global_count = 0,
+    .global_capacity = 0,
+    
+    .locals = NULL,
+    .local_count = 0,
+    .local_capacity = 0,
+    
+    .arg_types = NULL,
+    .arg_capacity = 0,
+    
+    .operands = NULL,
+    .operand_count = 0,
+    .operand_capacity = 0,
+    
+    .names = (table_t){
+      .slots = NULL,
+      .slot_capacity = 0,
+      
+      .binds = NULL,
+      .bind_count = 0,
+      .bind_capacity = 0,
+    },
+    .global_names = NULL,
+    
+    .ir = &ir,
+    .lazy_ir = &lazy_ir,
+    
+    .inlining = (replay ? NULL : inlining),
+    .inline_names = (table_t){
+      .slots = NULL,
+      .slot_capacity = 0,
+      
+      .binds = NULL,
+      .bind_count = 0,
+      .bind_capacity = 0,
+    },
+    
+    .is_named = 0,
+    .is_dependent = 0,
+    .body_index = 0,
+    
+    .pool = NULL,
+    .link = NULL,
+    
+    .enums = NULL,
+    .enum_count = 0,
+  };
+  
+  link_t link = (link_t){
+    .arena = source->arena,
+    .roots = roots,
+    
+    .symbols = NULL,
+    .symbol_count = 0,
+    .symbol_capacity = 0,
+  };
+  
+  if (roots) {
+    context.link = &link;
+  }
+  
+  for (int i = 0; context.inlining && context.inlining->always && context.inlining->always[i]; i++) {
+    f_table_bind(source->arena, &(context.inline_names), f_atom_upper(context.inlining->always[i]), 1);
+  }
+  
+  for (int i = 0; context.inlining && context.inlining->never && context.inlining->never[i]; i++) {
+    f_table_bind(source->arena, &(context.inline_names), f_atom_upper(context.inlining->never[i]), 0);
+  }
+  
+  arch->f_init();
+  
+  if (thread_count <= 1 || source->is_streaming || replay || roots) {
+    f_parse_all(arch, source, &context, replay);
+    arch->f_exit();
+    
+    return;
+  }
+  
+  FILE *output = f_output;
+  jmp_buf *error_jump = f_error_jump;
+  int error_is_kept = f_error_is_kept;
+  
+  pool_t *pool = f_pool_start(arch, thread_count);
+  char *error = NULL;
+  
+  jmp_buf jump;
+  context.pool = pool;
+  
+  f_output = pool->stream;
+  f_error_jump = &jump;
+  f_error_is_kept = 1;
+  
+  if (!setjmp(jump)) {
+    f_parse_all(arch, source, &context, NULL);
+  } else {
+    error = strdup(f_error_message);
+  }
+  
+  f_output = output;
+  f_error_jump = error_jump;
+  f_error_is_kept = error_is_kept;
+  
+  f_pool_run(pool, source, &context);
+  f_pool_done(pool, output, error);
+  arch->f_exit(); // Only once every worker is done, as that is the end of the output.
+}
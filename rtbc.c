@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
 #include <rtbc.h>
 
 extern const arch_t arch_x86;
@@ -6,24 +10,118 @@ extern const arch_t arch_x86;
 int main(void) {
   // f_do_debug = 1;
   
+  // Cores this process may actually run on, which can be fewer than the ones online (taskset, containers).
+  cpu_set_t cpus;
+  int core_count = (sched_getaffinity(0, sizeof(cpus), &cpus) ? (int)(sysconf(_SC_NPROCESSORS_ONLN)) : CPU_COUNT(&cpus));
+  
+  arena_t arena = (arena_t){
+    .chunk = NULL,
+    .large = NULL,
+    .chunk_length = 0,
+    
+    .allocated = 0,
+    .reserved = 0,
+  };
+  
   source_t source = (source_t){
+    .arena = &arena,
+    
+    .lexer = NULL,
+    .thread_count = core_count,
+    
+    .is_lexer_kept = 0,
+    
+    .cache_path = ".rtbc",
+    
+    .is_streaming = 0, // Set to only keep the words of one top-level statement at a time (no DATA packing).
+    .word_base = 0,
+    .value_base = 0,
+    
+    .frames = NULL,
+    .frame_count = 0,
+    .frame_capacity = 0,
+    
     .files = NULL,
     .file_count = 0,
+    .file_capacity = 0,
     
-    .words = NULL,
+    .word_types = NULL,
+    .word_offsets = NULL,
     .word_index = 0,
     .word_count = 0,
+    .word_capacity = 0,
+    
+    .values = NULL,
+    .value_index = 0,
+    .value_count = 0,
+    .value_capacity = 0,
+    
+    .spans = NULL,
+    .span_count = 0,
+    .span_capacity = 0,
     
     .macros = NULL,
     .macro_count = 0,
+    .macro_capacity = 0,
+    .macro_table = (table_t){
+      .slots = NULL,
+      .slot_capacity = 0,
+      
+      .binds = NULL,
+      .bind_count = 0,
+      .bind_capacity = 0,
+    },
+    
+    .guards = NULL,
+    .guard_count = 0,
+    .guard_capacity = 0,
+    .guard_table = (table_t){
+      .slots = NULL,
+      .slot_capacity = 0,
+      
+      .binds = NULL,
+      .bind_count = 0,
+      .bind_capacity = 0,
+    },
     
     .data_buffer = NULL,
     .data_length = 0,
+    .data_capacity = 0,
+    
+    .strings = NULL,
+    .string_count = 0,
+    .string_capacity = 0,
   };
   
+  // Set to keep compiling into a file every time a source file changes, instead of compiling just once.
+  const char *watch_path = NULL;
+  
+  if (watch_path) {
+    f_watch(&arch_x86, &source, "test.tbc", watch_path);
+  }
+  
   f_source_load(&source, "test.tbc");
   
-  f_parse_root(&arch_x86, &source);
+  if (!source.is_streaming) {
+    f_source_pack(&source);
+  }
+  
+  // Set to only emit what these (and whatever they use) need, instead of every routine and global.
+  const char **roots = NULL; // (const char *[]){"MAIN", NULL};
+  
+  // Calls get inlined if that takes at most size more instructions than calling (see inline_t), set to NULL to
+  // never inline.
+  inline_t inlining = (inline_t){
+    .size = 4,
+    
+    .always = NULL,
+    .never = NULL,
+  };
+  
+  f_ir_add_pass(&loop_rotate);
+  f_ir_add_pass(&loop_hoist);
+  
+  f_parse_root(&arch_x86, &source, NULL, roots, &inlining, source.thread_count); // Generates routines on as many threads as it lexes on.
   
   /*
   arch->f_label("MAIN");
@@ -33,5 +131,8 @@ int main(void) {
   arch->f_exit();
   */
   
+  f_debug("Arena: %zu bytes allocated, %zu bytes reserved.\n", arena.allocated, arena.reserved);
+  f_arena_free(&arena);
+  
   return 0;
 }
@@ -1,12 +1,17 @@
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <rtbc.h>
 
-#define f_source_error(format, ...) f_error("(At '%s', line %d, column %d) " format, path, word.line, word.column, __VA_ARGS__)
+#define f_source_error(format, ...) f_source_error_in(source, file_id, unit->word_offsets[i], format, __VA_ARGS__)
 
 static const char *word_types[] = {
   "W_INVALID",
@@ -69,418 +74,840 @@ static const char *word_types[] = {
   "K_MACRO",
 };
 
-void f_source_load(source_t *source, const char *path) {
-  FILE *file = fopen(path, "r");
-  int file_id = source->file_count++;
+static uint32_t f_string_hash(const char *data, int length) {
+  uint32_t hash = 2166136261u;
   
-  if (!file) {
-    f_error("Cannot open file: '%s'\n", path);
+  for (int i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)(data[i])) * 16777619u;
   }
   
-  source->files = realloc(source->files, source->file_count * sizeof(char *));
-  source->files[file_id] = strdup(path);
-  
-  int is_once = 1;
+  return hash;
+}
+
+// Interns the string that was just appended at the end of DATA (starting at offset), returning the offset
+// of the first identical string and dropping the new copy if there was one already.
+
+static int f_string_intern(source_t *source, int offset) {
+  int length = source->data_length - offset;
   
-  for (int i = 0; i < file_id; i++) {
-    if (!strcmp(source->files[i], source->files[file_id])) {
-      is_once = 0;
-      break;
+  if ((source->string_count + 1) * 2 > source->string_capacity) {
+    string_t *old_strings = source->strings;
+    int old_capacity = source->string_capacity;
+    
+    source->string_capacity = (old_capacity ? old_capacity * 2 : 256);
+    source->strings = f_arena_alloc(source->arena, source->string_capacity * sizeof(string_t));
+    
+    memset(source->strings, 0, source->string_capacity * sizeof(string_t));
+    
+    for (int i = 0; i < old_capacity; i++) {
+      if (!old_strings[i].length) {
+        continue;
+      }
+      
+      uint32_t index = f_string_hash(source->data_buffer + old_strings[i].offset, old_strings[i].length);
+      
+      while (source->strings[index & (source->string_capacity - 1)].length) {
+        index++;
+      }
+      
+      source->strings[index & (source->string_capacity - 1)] = old_strings[i];
     }
   }
   
-  int file_line = 1, file_column = 1;
+  uint32_t index = f_string_hash(source->data_buffer + offset, length);
   
-  word_t word = (word_t){
-    .type = w_invalid,
-    .file = file_id,
+  for (;; index++) {
+    string_t *string = source->strings + (index & (source->string_capacity - 1));
     
-    .line = file_line,
-    .column = file_column,
-  };
+    if (!string->length) {
+      *string = (string_t){
+        .offset = offset,
+        .length = length,
+      };
+      
+      source->string_count++;
+      return offset;
+    }
+    
+    if (string->length == length && !memcmp(source->data_buffer + string->offset, source->data_buffer + offset, length)) {
+      source->data_length = offset;
+      return string->offset;
+    }
+  }
+}
+
+static const char *pack_buffer;
+
+// Orders strings by their reversed contents, so any string ends up right before the ones it is a suffix of.
+
+static int f_string_compare(const void *a_ptr, const void *b_ptr) {
+  const string_t *a = a_ptr, *b = b_ptr;
   
-  int last_only = -1, last_use = -1;
-  int only_not = 0;
+  for (int i = 1; i <= a->length && i <= b->length; i++) {
+    uint8_t a_chr = pack_buffer[a->offset + a->length - i];
+    uint8_t b_chr = pack_buffer[b->offset + b->length - i];
+    
+    if (a_chr != b_chr) {
+      return (int)(a_chr) - (int)(b_chr);
+    }
+  }
   
-  int64_t temp = 0; // Length for names and strings, bases for numbers, etc.
-  int reuse_chr = 0, done = 0;
+  return a->length - b->length;
+}
+
+static int f_string_order(const void *a_ptr, const void *b_ptr) {
+  const string_t *a = a_ptr, *b = b_ptr;
+  return a->offset - b->offset;
+}
+
+static int f_string_find(const void *offset_ptr, const void *string_ptr) {
+  const string_t *string = string_ptr;
+  return *((const int *)(offset_ptr)) - string->offset;
+}
+
+static uint64_t f_string_move(const string_t *strings, const int *offsets, int count, uint64_t offset) {
+  int key = (int)(offset);
+  const string_t *string = bsearch(&key, strings, count, sizeof(string_t), f_string_find);
   
-  const char *digits = "0123456789ABCDEF";
-  char chr;
+  return offsets[string - strings];
+}
+
+void f_source_pack(source_t *source) {
+  int count = 0;
   
-  f_debug("File '%s':\n", path);
+  // Only strings still referenced by a word make it into DATA ("use" paths are gone by now).
   
-  for (;;) {
-    if (word.type != w_invalid && done) {
-      // Name-to-keyword section:
-      
-      if (word.type == l_name) {
-        word.name[temp] = '\0';
-        
-        for (int i = w_keywords; i < w_count; i++) {
-          if (!strcmp(word.name, word_types[i] + 2)) {
-            word.type = i;
-            break;
-          }
-        }
-      }
-      
-      // Word debugging section:
-      
-      f_debug("  [%-11s", word_types[word.type]);
-      
-      if (word.type == l_name) {
-        f_debug(": %s", word.name);
-      } else if (word.type == l_ux) {
-        f_debug(": %lu", word.ux);
-      } else if (word.type == l_x) {
-        f_debug(": %ld", word.x);
-      } else if (word.type == l_chr) {
-        f_debug(": '%c'", (uint8_t)(word.chr));
-      } else if (word.type == l_str) {
-        f_debug(": \"%s\"", source->data_buffer + word.str);
+  int *is_used = f_arena_alloc(source->arena, (source->data_length + 1) * sizeof(int));
+  memset(is_used, 0, (source->data_length + 1) * sizeof(int));
+  
+  for (int i = 0, j = 0; i < source->word_count; i++) {
+    if (!f_word_has_value(source->word_types[i])) {
+      continue;
+    }
+    
+    if (source->word_types[i] == l_str) {
+      is_used[source->values[j].str] = 1;
+    }
+    
+    j++;
+  }
+  
+  for (int i = 0; i < source->macro_count; i++) {
+    for (int j = 0; j < source->macros[i].word_count; j++) {
+      if (source->macros[i].words[j].type == l_str) {
+        is_used[source->macros[i].words[j].str] = 1;
       }
+    }
+  }
+  
+  string_t *strings = f_arena_alloc(source->arena, (source->string_count + 1) * sizeof(string_t));
+  
+  for (int i = 0; i < source->string_capacity; i++) {
+    if (source->strings[i].length && is_used[source->strings[i].offset]) {
+      strings[count++] = source->strings[i];
+    }
+  }
+  
+  // Sort by reversed contents, then walk backwards: a string is either a suffix of the closest longer
+  // string kept so far, or it has to be kept itself.
+  
+  string_t *sorted = f_arena_alloc(source->arena, (count + 1) * sizeof(string_t));
+  memcpy(sorted, strings, count * sizeof(string_t));
+  
+  pack_buffer = source->data_buffer;
+  qsort(sorted, count, sizeof(string_t), f_string_compare);
+  
+  int *owners = is_used; // Reused, indexed by old offset from now on.
+  int owner = -1;
+  
+  for (int i = count - 1; i >= 0; i--) {
+    if (owner >= 0 && sorted[i].length <= sorted[owner].length &&
+        !memcmp(source->data_buffer + sorted[owner].offset + sorted[owner].length - sorted[i].length,
+                source->data_buffer + sorted[i].offset, sorted[i].length)) {
+      owners[sorted[i].offset] = owner;
+    } else {
+      owners[sorted[i].offset] = i;
+      owner = i;
+    }
+  }
+  
+  // Lay out the kept strings in their original order, then point the merged ones into their tails.
+  
+  qsort(strings, count, sizeof(string_t), f_string_order);
+  
+  int *offsets = f_arena_alloc(source->arena, (count + 1) * sizeof(int));
+  int *sorted_offsets = f_arena_alloc(source->arena, (count + 1) * sizeof(int));
+  
+  char *data_buffer = f_arena_alloc(source->arena, source->data_length + 1);
+  int data_length = 0;
+  
+  for (int i = 0; i < count; i++) {
+    int index = owners[strings[i].offset];
+    
+    if (sorted[index].offset == strings[i].offset) {
+      memcpy(data_buffer + data_length, source->data_buffer + strings[i].offset, strings[i].length);
       
-      f_debug("]\n");
-      
-      // Check for "only (macro), !(macro), ...;":
+      offsets[i] = data_length;
+      sorted_offsets[index] = data_length;
       
-      if (last_only >= 0) {
-        if (word.type == s_comma) {
-          only_not = 0;
-        } else if (word.type == s_semicolon) {
-          source->word_count = last_only;
-          done = 0;
-          
-          last_only = -1;
-          only_not = 0;
-        } else if (word.type == s_not && !only_not) {
-          only_not = 1;
-        } else if (word.type == l_name) {
-          int valid = 0;
-          
-          for (int i = 0; i < source->macro_count; i++) {
-            if (!strcmp(source->macros[i].name, word.name)) {
-              valid = 1;
-              break;
-            }
-          }
-          
-          if (only_not) {
-            valid = !valid;
-          }
-          
-          if (!valid) {
-            source->word_count = last_only;
-            break;
-          }
-        } else {
-          f_error("Expected identifier or valid symbol, found %s.\n", word_types[word.type]);
-        }
-      } else if (word.type == k_only) {
-        last_only = source->word_count;
+      data_length += strings[i].length;
+    }
+  }
+  
+  for (int i = 0; i < count; i++) {
+    int index = owners[strings[i].offset];
+    
+    if (sorted[index].offset != strings[i].offset) {
+      offsets[i] = sorted_offsets[index] + sorted[index].length - strings[i].length;
+    }
+  }
+  
+  for (int i = 0, j = 0; i < source->word_count; i++) {
+    if (!f_word_has_value(source->word_types[i])) {
+      continue;
+    }
+    
+    if (source->word_types[i] == l_str) {
+      source->values[j].str = f_string_move(strings, offsets, count, source->values[j].str);
+    }
+    
+    j++;
+  }
+  
+  for (int i = 0; i < source->macro_count; i++) {
+    for (int j = 0; j < source->macros[i].word_count; j++) {
+      if (source->macros[i].words[j].type == l_str) {
+        source->macros[i].words[j].str = f_string_move(strings, offsets, count, source->macros[i].words[j].str);
       }
+    }
+  }
+  
+  f_debug("DATA: %d bytes packed into %d.\n", source->data_length, data_length);
+  
+  source->data_buffer = data_buffer;
+  source->data_length = data_length;
+  source->data_capacity = data_length + 1;
+  
+  source->strings = NULL;
+  source->string_count = 0;
+  source->string_capacity = 0;
+}
+
+static void f_source_push(source_t *source, const word_t *word, int file, uint32_t offset) {
+  int count = source->word_count - source->word_base;
+  
+  if (count == source->word_capacity) {
+    int capacity = source->word_capacity;
+    
+    source->word_types = f_arena_reserve(source->arena, source->word_types, count + 1, &capacity, sizeof(uint8_t));
+    source->word_offsets = f_arena_reserve(source->arena, source->word_offsets, count + 1, &(source->word_capacity), sizeof(uint32_t));
+  }
+  
+  if (!source->span_count || source->spans[source->span_count - 1].file != file) {
+    source->spans = f_arena_reserve(source->arena, source->spans, source->span_count + 1, &(source->span_capacity), sizeof(span_t));
+    
+    source->spans[source->span_count++] = (span_t){
+      .word = source->word_count,
+      .file = file,
+    };
+  }
+  
+  source->word_types[count] = word->type;
+  source->word_offsets[count] = offset;
+  
+  source->word_count++;
+  
+  if (f_word_has_value(word->type)) {
+    int value_count = source->value_count - source->value_base;
+    
+    source->values = f_arena_reserve(source->arena, source->values, value_count + 1, &(source->value_capacity), sizeof(value_t));
+    memcpy(source->values + value_count, &(word->ux), sizeof(value_t));
+    
+    source->value_count++;
+  }
+}
+
+// Drops every word from count onwards.
+
+static void f_source_trim(source_t *source, int count) {
+  for (int i = count; i < source->word_count; i++) {
+    if (f_word_has_value(source->word_types[i - source->word_base])) {
+      source->value_count--;
+    }
+  }
+  
+  source->word_count = count;
+  
+  while (source->span_count && source->spans[source->span_count - 1].word > count) {
+    source->span_count--;
+  }
+}
+
+// Unpacks every word from first onwards into a new array, for guards and macro values.
+
+static word_t *f_source_copy(source_t *source, int first) {
+  word_t *words = f_arena_alloc(source->arena, (source->word_count - first + 1) * sizeof(word_t));
+  int value = source->value_count;
+  
+  for (int i = first; i < source->word_count; i++) {
+    if (f_word_has_value(source->word_types[i - source->word_base])) {
+      value--;
+    }
+  }
+  
+  for (int i = first; i < source->word_count; i++) {
+    word_t *word = words + (i - first);
+    
+    word->type = source->word_types[i - source->word_base];
+    word->index = -1;
+    
+    if (f_word_has_value(word->type)) {
+      memcpy(&(word->ux), source->values + ((value++) - source->value_base), sizeof(value_t));
+    }
+  }
+  
+  return words;
+}
+
+// Only valid right after f_source_peek() returned something other than w_invalid.
+
+void f_source_read(source_t *source, word_t *word) {
+  int type = source->word_types[source->word_index - source->word_base];
+  
+  if (word) {
+    word->type = type;
+    word->index = source->word_index;
+    
+    if (f_word_has_value(type)) {
+      memcpy(&(word->ux), source->values + (source->value_index - source->value_base), sizeof(value_t));
+    }
+  }
+  
+  if (f_word_has_value(type)) {
+    source->value_index++;
+  }
+  
+  source->word_index++;
+}
+
+static int f_macro_find(source_t *source, uint32_t atom) {
+  return f_table_find(&(source->macro_table), atom);
+}
+
+// Defines (or redefines) a macro from the words following "macro" (starting at first), that is, its name and
+// optionally "=" and its value.
+
+static void f_macro_define(source_t *source, int first) {
+  int word_count = source->word_count - first;
+  word_t *words = f_source_copy(source, first);
+  
+  int index = f_macro_find(source, words[0].atom);
+  
+  if (index < 0) {
+    index = source->macro_count++;
+    source->macros = f_arena_reserve(source->arena, source->macros, source->macro_count, &source->macro_capacity, sizeof(macro_t));
+    
+    source->macros[index].atom = words[0].atom;
+    f_table_bind(source->arena, &(source->macro_table), words[0].atom, index);
+  }
+  
+  macro_t *macro = source->macros + index;
+  
+  macro->words = NULL;
+  macro->word_count = 0;
+  
+  if (word_count > 2) {
+    macro->word_count = word_count - 2;
+    macro->words = words + 2;
+  }
+}
+
+// Evaluates the condition of an "only" statement, given the words after "only" (names, "!" and commas).
+
+static int f_only_check(source_t *source, const word_t *words, int word_count) {
+  int only_not = 0;
+  
+  for (int i = 0; i < word_count; i++) {
+    if (words[i].type == s_comma) {
+      only_not = 0;
+    } else if (words[i].type == s_not) {
+      only_not = 1;
+    } else if (words[i].type == l_name) {
+      int valid = (f_macro_find(source, words[i].atom) >= 0);
       
-      // Check for "use (path);":
-      
-      if (last_use >= 0) {
-        if (word.type == l_str) {
-          source->word_count = last_use;
-          done = 0;
-          
-          char *path_copy = strdup(source->data_buffer + word.str);
-          
-          f_source_load(source, path_copy);
-          free(path_copy);
-          
-          last_use = source->word_count;
-        } else if (word.type == s_comma) {
-          // Actually, just don't do anything here :p
-        } else if (word.type == s_semicolon) {
-          source->word_count = last_only;
-          done = 0;
-          
-          last_use = -1;
-        } else {
-          f_error("Expected path or valid symbol, found %s.\n", word_types[word.type]);
-        }
-      } else if (word.type == k_use) {
-        last_use = source->word_count;
+      if (only_not) {
+        valid = !valid;
       }
       
-      // Word storing section (reuse done as an inner flag):
-      
-      if (done) {
-        source->words = realloc(source->words, (source->word_count + 1) * sizeof(word_t));
-        source->words[source->word_count++] = word;
-        
-        done = 0;
+      if (!valid) {
+        return 0;
       }
-      
-      word = (word_t){
-        .type = w_invalid,
-        .file = file_id,
-        
-        .line = file_line,
-        .column = file_column,
-      };
     }
+  }
+  
+  return 1;
+}
+
+static guard_t *f_guard_find(source_t *source, const char *path) {
+  int index = f_table_find(&(source->guard_table), f_atom(path));
+  return (index >= 0 ? source->guards + index : NULL);
+}
+
+// Records the words from first onwards (plus last_word, if any) as the guard for path.
+
+static void f_guard_add(source_t *source, const char *path, int first, const word_t *last_word) {
+  if (f_guard_find(source, path)) {
+    return;
+  }
+  
+  source->guards = f_arena_reserve(source->arena, source->guards, source->guard_count + 1, &source->guard_capacity, sizeof(guard_t));
+  guard_t *guard = source->guards + (source->guard_count++);
+  
+  guard->path = f_arena_strdup(source->arena, path);
+  f_table_bind(source->arena, &(source->guard_table), f_atom(path), source->guard_count - 1);
+  guard->words = f_source_copy(source, first);
+  guard->word_count = source->word_count - first;
+  
+  if (last_word) {
+    guard->words[guard->word_count++] = *last_word;
+  }
+}
+
+static _Noreturn void f_source_fail(const char *path, int line, int column, const char *format, va_list args) {
+  char message[512];
+  vsnprintf(message, sizeof(message), format, args);
+  
+  f_error("(At '%s', line %d, column %d) %s", path, line, column, message);
+}
+
+// Works out the line and column of a byte offset in a file. Only ever done for errors, so the file just gets
+// mapped again instead of being kept around.
+
+static void f_source_locate(const source_t *source, int file, uint32_t offset, int *line, int *column) {
+  char *buffer;
+  size_t length;
+  int is_mapped;
+  
+  if (!f_lex_map(source->files[file], &buffer, &length, &is_mapped, NULL)) {
+    *line = 0;
+    *column = 0;
+    
+    return;
+  }
+  
+  f_lex_locate(buffer, length, offset, line, column);
+  f_lex_unmap(buffer, length, is_mapped);
+}
+
+static _Noreturn void f_source_error_in(const source_t *source, int file, uint32_t offset, const char *format, ...) {
+  int line, column;
+  f_source_locate(source, file, offset, &line, &column);
+  
+  va_list args;
+  va_start(args, format);
+  
+  f_source_fail(source->files[file], line, column, format, args);
+}
+
+void f_source_where(const source_t *source, int index, int *file, int *line, int *column) {
+  int low = 0, high = source->span_count - 1;
+  
+  // Find the last span starting at or before index.
+  
+  while (low < high) {
+    int middle = (low + high + 1) / 2;
     
-    if (reuse_chr) {
-      reuse_chr = 0;
+    if (source->spans[middle].word <= index) {
+      low = middle;
     } else {
-      if (feof(file)) {
-        break;
-      } else {
-        chr = fgetc(file);
-        
-        if (chr == '\n') {
-          file_column = 1;
-          file_line++;
-        } else {
-          file_column++;
-        }
-      }
+      high = middle - 1;
     }
+  }
+  
+  *file = source->spans[low].file;
+  f_source_locate(source, *file, source->word_offsets[index - source->word_base], line, column);
+}
+
+_Noreturn void f_source_error_at(const source_t *source, int index, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  
+  if (!source->word_count) {
+    char message[512];
+    vsnprintf(message, sizeof(message), format, args);
     
-    if (word.type == w_invalid) {
-      if (isalpha(chr) || chr == '_' || chr == '$') {
-        word.type = l_name;
-        
-        temp = 0;
-        word.name[temp++] = toupper(chr);
-      } else if (isdigit(chr)) {
-        word.type = l_x;
-        word.x = (chr - '0');
-        
-        if (chr == '0') {
-          word.type = l_ux;
-          temp = 8;
-        } else {
-          temp = 10;
-        }
-      } else if (chr == '\'') {
-        word.type = l_chr;
-        word.chr = '\0';
-      } else if (chr == '"') {
-        word.type = l_str;
-        word.str = source->data_length;
-      } else if (chr == '(') {
-        word.type = s_l_paren;
-        done = 1;
-      } else if (chr == ')') {
-        word.type = s_r_paren;
-        done = 1;
-      } else if (chr == '[') {
-        word.type = s_l_bracket;
-        done = 1;
-      } else if (chr == ']') {
-        word.type = s_r_bracket;
-        done = 1;
-      } else if (chr == ':') {
-        word.type = s_colon;
-        done = 1;
-      } else if (chr == ';') {
-        word.type = s_semicolon;
-        done = 1;
-      } else if (chr == ',') {
-        word.type = s_comma;
-        done = 1;
-      } else if (chr == '<') {
-        word.type = s_l_shift;
-        done = 1;
-      } else if (chr == '>') {
-        word.type = s_r_shift;
-        done = 1;
-      } else if (chr == '!') {
-        word.type = s_not;
-        done = 1;
-      } else if (chr == '&') {
-        word.type = s_and;
-        done = 1;
-      } else if (chr == '\\') {
-        word.type = s_or;
-        done = 1;
-      } else if (chr == '^') {
-        word.type = s_xor;
-        done = 1;
-      } else if (chr == '+') {
-        word.type = s_add;
-        done = 1;
-      } else if (chr == '-') {
-        word.type = s_sub;
-        done = 1;
-      } else if (chr == '*') {
-        word.type = s_mul;
-        done = 1;
-      } else if (chr == '/') {
-        word.type = s_div;
-        done = 1;
-      } else if (chr == '%') {
-        word.type = s_mod;
-        done = 1;
-      } else if (chr == '=') {
-        word.type = s_assign;
-        done = 1;
-      } else if (chr == '#') {
-        word.type = w_comment;
-      } else if (chr == '@') {
-        word.type = w_at;
-      }
-    } else if (word.type == w_comment) {
-      if (chr == '\n') {
-        word.type = w_invalid;
+    f_error("%s", message);
+  }
+  
+  if (index >= source->word_count) {
+    index = source->word_count - 1;
+  } else if (index < source->word_base) {
+    index = source->word_base; // Released already, point at the oldest word still around instead.
+  }
+  
+  int file, line, column;
+  f_source_where(source, index, &file, &line, &column);
+  
+  f_source_fail(source->files[file], line, column, format, args);
+}
+
+// Starts splicing the words of a file (lexing it first if no thread got to it yet) at the end of the source,
+// unless its guard rejects it.
+
+static void f_source_open(source_t *source, const char *path) {
+  // Files wrapped in an "only" guard that already got loaded once do not need to be opened again if their
+  // guard would reject them anyway.
+  
+  char *real_path = realpath(path, NULL);
+  char *canon_path = f_arena_strdup(source->arena, real_path ? real_path : path);
+  
+  free(real_path);
+  guard_t *guard = f_guard_find(source, canon_path);
+  
+  if (guard && !f_only_check(source, guard->words, guard->word_count)) {
+    f_debug("File '%s': skipped, rejected by its guard.\n", path);
+    return;
+  }
+  
+  unit_t *unit = f_lexer_get(source->lexer, path);
+  
+  if (unit->error && !unit->word_count) {
+    f_error("%s", unit->error);
+  }
+  
+  if (!unit->atoms) {
+    unit->atoms = f_arena_alloc(&(unit->arena), (unit->name_count + 1) * sizeof(uint32_t));
+    memset(unit->atoms, 0, (unit->name_count + 1) * sizeof(uint32_t));
+  }
+  
+  unit->splice_count++;
+  int file_id = source->file_count++;
+  
+  source->files = f_arena_reserve(source->arena, source->files, source->file_count, &source->file_capacity, sizeof(char *));
+  source->files[file_id] = f_arena_strdup(source->arena, path);
+  
+  source->frames = f_arena_reserve(source->arena, source->frames, source->frame_count + 1, &source->frame_capacity, sizeof(frame_t));
+  
+  source->frames[source->frame_count++] = (frame_t){
+    .unit = unit,
+    .path = canon_path,
+    .file = file_id,
+    
+    .word_index = 0,
+    .value_index = 0,
+    .string_index = 0,
+    
+    .first_word = source->word_count,
+    
+    .last_only = -1,
+    .last_macro = -1,
+    .in_use = 0,
+    
+    .only_not = 0,
+    .only_guard = 0,
+  };
+  
+  f_debug("File '%s':\n", path);
+}
+
+static void f_source_done(source_t *source) {
+  if (!source->is_lexer_kept) {
+    f_lexer_free(source->lexer);
+    free(source->lexer);
+  }
+  
+  source->lexer = NULL;
+}
+
+static void f_source_close(source_t *source) {
+  frame_t *frame = source->frames + (--source->frame_count);
+  
+  // Every word got copied over already, so there is no point in keeping units around (they just get lexed
+  // again if used again, as headers without guards would have been anyway). Lexers kept by the caller keep
+  // them for the next load instead.
+  
+  if (!(--frame->unit->splice_count) && !source->is_lexer_kept) {
+    f_lexer_drop(source->lexer, frame->unit);
+  }
+  
+  if (!source->frame_count) {
+    f_source_done(source);
+  }
+}
+
+// Splices the next word of the file on top of the stack, running "only", "use" and "macro" statements as it
+// goes ("use" pushes a new file on top). Returns 0 once there is nothing left to splice.
+
+static int f_source_step(source_t *source) {
+  if (!source->frame_count) {
+    return 0;
+  }
+  
+  frame_t *frame = source->frames + (source->frame_count - 1);
+  unit_t *unit = frame->unit;
+  
+  int file_id = frame->file;
+  int i = frame->word_index;
+  
+  if (i == unit->word_count) {
+    // Now that every word before it made it in, report whatever stopped the lexer (if anything).
+    
+    if (unit->error) {
+      f_error("%s", unit->error);
+    }
+    
+    f_source_close(source);
+    return 1;
+  }
+  
+  frame->word_index++;
+  
+  word_t word = (word_t){
+    .type = unit->word_types[i],
+    .index = -1,
+  };
+  
+  if (f_word_has_value(word.type)) {
+    memcpy(&(word.ux), unit->values + (frame->value_index++), sizeof(value_t));
+  }
+  
+  // Names only get interned into global atoms the first time each one gets spliced from the unit.
+  
+  if (word.type == l_name) {
+    uint32_t *atom = unit->atoms + word.atom;
+    
+    if (!*atom) {
+      *atom = f_atom(unit->name_data + unit->name_offsets[word.atom]);
+    }
+    
+    word.atom = *atom;
+  }
+  
+  const char *use_path = NULL;
+  
+  // Move strings into DATA (except "use" paths, which are never needed there):
+  
+  if (word.type == l_str) {
+    int length = unit->string_lengths[frame->string_index++];
+    
+    if (frame->in_use) {
+      use_path = unit->data_buffer + word.str;
+    } else {
+      source->data_buffer = f_arena_reserve(source->arena, source->data_buffer, source->data_length + length, &source->data_capacity, 1);
+      
+      memcpy(source->data_buffer + source->data_length, unit->data_buffer + word.str, length);
+      word.str = source->data_length;
+      
+      source->data_length += length;
+      word.str = f_string_intern(source, word.str);
+    }
+  }
+  
+  int done = 1;
+  
+  // Word debugging section:
+  
+  f_debug("  [%-11s", word_types[word.type]);
+  
+  if (word.type == l_name) {
+    f_debug(": %s", f_atom_name(word.atom));
+  } else if (word.type == l_ux) {
+    f_debug(": %lu", word.ux);
+  } else if (word.type == l_x) {
+    f_debug(": %ld", word.x);
+  } else if (word.type == l_chr) {
+    f_debug(": '%c'", (uint8_t)(word.chr));
+  } else if (use_path) {
+    f_debug(": \"%s\"", use_path);
+  } else if (word.type == l_str) {
+    f_debug(": \"%s\"", source->data_buffer + word.str);
+  }
+  
+  f_debug("]\n");
+  
+  // Check for "only (macro), !(macro), ...;":
+  
+  if (frame->last_only >= 0) {
+    if (word.type == s_comma) {
+      frame->only_not = 0;
+    } else if (word.type == s_semicolon) {
+      if (frame->only_guard) {
+        f_guard_add(source, frame->path, frame->last_only + 1, NULL);
       }
+      
+      f_source_trim(source, frame->last_only);
+      done = 0;
+      
+      frame->last_only = -1;
+      frame->only_not = 0;
+    } else if (word.type == s_not && !frame->only_not) {
+      frame->only_not = 1;
     } else if (word.type == l_name) {
-      if (isalnum(chr) || chr == '_' || chr == '$') {
-        if (temp >= MAX_LENGTH) {
-          f_source_error("Identifiers can only be %d characters long, found '%c'.\n", MAX_LENGTH, chr);
-        }
-        
-        word.name[temp++] = toupper(chr);
-      } else {
-        reuse_chr = 1;
-        done = 1;
+      int valid = (f_macro_find(source, word.atom) >= 0);
+      
+      if (frame->only_not) {
+        valid = !valid;
       }
-    } else if (word.type == l_ux || word.type == l_x) {
-      const char *ptr = strchr(digits, toupper(chr));
       
-      if (ptr) {
-        word.x = word.x * temp + (int64_t)(ptr - digits);
-      } else {
-        if (!word.x && temp == 8 && toupper(chr) == 'X') {
-          temp = 16;
-        } else if (toupper(chr) == 'U') {
-          word.type = l_ux;
-          done = 1;
-        } else if (isalnum(chr)) {
-          f_source_error("Expected base %ld digit, found '%c'.\n", temp, chr);
-        } else {
-          reuse_chr = 1;
-          done = 1;
+      if (!valid) {
+        if (frame->only_guard) {
+          f_guard_add(source, frame->path, frame->last_only + 1, &word);
         }
-      }
-    } else if (word.type == l_chr) {
-      if (chr == '\\') {
-        word.type = w_chr_slash;
-        temp = 0;
-      } else if (chr == '\'') {
-        done = 1;
-      } else {
-        word.chr = (word.chr << 8) | (uint64_t)(chr);
-      }
-    } else if (word.type == l_str) {
-      if (chr == '\\') {
-        word.type = w_str_slash;
-        temp = 0;
         
-        source->data_buffer = realloc(source->data_buffer, source->data_length + 1);
-        source->data_buffer[source->data_length] = '\0';
-      } else if (chr == '"') {
-        source->data_buffer = realloc(source->data_buffer, source->data_length + 1);
-        source->data_buffer[source->data_length++] = '\0';
+        // Whatever stopped the lexer past this point does not matter anymore.
         
-        done = 1;
-      } else {
-        source->data_buffer = realloc(source->data_buffer, source->data_length + 1);
-        source->data_buffer[source->data_length++] = chr;
+        f_source_trim(source, frame->last_only);
+        f_source_close(source);
+        
+        return 1;
       }
-    } else if (word.type == w_chr_slash || word.type == w_str_slash) {
-      uint8_t last_chr, next_chr;
-      int slash_done = 0;
+    } else {
+      f_error("Expected identifier or valid symbol, found %s.\n", word_types[word.type]);
+    }
+  } else if (word.type == k_only) {
+    // Only a guard if it comes before anything else, so it covers the whole file.
+    
+    frame->last_only = source->word_count;
+    frame->only_guard = (frame->last_only == frame->first_word);
+  }
+  
+  // Check for "use (path);" (none of its words ever make it into the source):
+  
+  if (frame->in_use) {
+    if (word.type == l_str) {
+      done = 0;
       
-      if (word.type == w_chr_slash) {
-        last_chr = (uint8_t)(word.chr & 0xFF);
-      } else if (word.type == w_str_slash) {
-        last_chr = source->data_buffer[source->data_length];
-      }
+      // The frame might move once a new one gets pushed, so nothing from here on can use it.
       
-      if (temp == 0) {
-        if (toupper(chr) == 'B') {
-          next_chr = '\b';
-          slash_done = 1;
-        } else if (toupper(chr) == 'E') {
-          next_chr = '\e';
-          slash_done = 1;
-        } else if (toupper(chr) == 'N') {
-          next_chr = '\n';
-          slash_done = 1;
-        } else if (toupper(chr) == 'R') {
-          next_chr = '\r';
-          slash_done = 1;
-        } else if (toupper(chr) == 'T') {
-          next_chr = '\t';
-          slash_done = 1;
-        } else if (toupper(chr) == 'X') {
-          next_chr = '\0';
-          temp = 16;
-        } else if (chr == '0') {
-          next_chr = '\0';
-          temp = 8;
-        } else if (isdigit(chr)) {
-          next_chr = chr - '0';
-          temp = 10;
-        } else {
-          next_chr = chr;
-          slash_done = 1;
-        }
-      } else {
-        const char *ptr = strchr(digits, toupper(chr));
-        
-        if (ptr) {
-          last_chr = last_chr * temp + (uint64_t)(ptr - digits);
-          word.chr = (word.chr & ~((uint64_t)(0xFF))) | last_chr;
-        } else {
-          slash_done = 1;
-          reuse_chr = 1;
-        }
-      }
+      f_source_open(source, use_path);
+      return 1;
+    } else if (word.type == s_comma) {
+      done = 0;
+    } else if (word.type == s_semicolon) {
+      done = 0;
+      frame->in_use = 0;
+    } else {
+      f_error("Expected path or valid symbol, found %s.\n", word_types[word.type]);
+    }
+  } else if (word.type == k_use) {
+    done = 0;
+    frame->in_use = 1;
+  }
+  
+  // Check for "macro (name) [= (value)];":
+  
+  if (frame->last_macro >= 0 && done) {
+    int index = source->word_count - frame->last_macro;
+    
+    if (index == 1 && word.type != l_name) {
+      f_source_error("Expected macro name, found %s.\n", word_types[word.type]);
+    } else if (index == 2 && word.type != s_assign && word.type != s_semicolon) {
+      f_source_error("Expected '=' or ';' after macro name, found %s.\n", word_types[word.type]);
+    } else if (word.type == s_semicolon) {
+      f_macro_define(source, frame->last_macro + 1);
+      f_source_trim(source, frame->last_macro);
+      done = 0;
       
-      if (word.type == w_chr_slash) {
-        if (!reuse_chr) {
-          word.chr = (word.chr << 8) | (uint64_t)(next_chr);
-        }
-        
-        if (slash_done) {
-          word.type = l_chr;
-        }
-      } else if (word.type == w_str_slash) {
-        if (!reuse_chr) {
-          source->data_buffer[source->data_length] = (char)(next_chr);
-        }
-        
-        if (slash_done) {
-          word.type = l_str;
-          source->data_length++;
-        }
-      }
-    } else if (word.type == w_at) {
-      if (chr == '(') {
-        word.type = s_a_paren;
-        done = 1;
-      } else if (chr == '[') {
-        word.type = s_a_bracket;
-        done = 1;
-      } else if (chr == ';') {
-        word.type = s_exit;
-        done = 1;
-      } else if (chr == '<') {
-        word.type = s_l_rotate;
-        done = 1;
-      } else if (chr == '>') {
-        word.type = s_r_rotate;
-        done = 1;
-      } else if (chr == '+') {
-        word.type = s_inc;
-        done = 1;
-      } else if (chr == '-') {
-        word.type = s_dec;
-        done = 1;
-      } else {
-        f_source_error("Expected double-char symbol, found '@%c'.\n", chr);
-      }
+      frame->last_macro = -1;
     }
+  } else if (word.type == k_macro) {
+    frame->last_macro = source->word_count;
+  }
+  
+  // Word storing section:
+  
+  if (done) {
+    f_source_push(source, &word, file_id, unit->word_offsets[i]);
+  }
+  
+  return 1;
+}
+
+// Whether the file on top of the stack is halfway through an "only" or "macro" statement, whose words are
+// still in the source but might get trimmed.
+
+static int f_source_is_pending(const source_t *source) {
+  if (!source->frame_count) {
+    return 0;
+  }
+  
+  const frame_t *frame = source->frames + (source->frame_count - 1);
+  return (frame->last_only >= 0 || frame->last_macro >= 0);
+}
+
+// Splices words until there are at least SOURCE_WINDOW of them past the cursor (or no more at all), stopping
+// only where every word spliced so far is final.
+
+static void f_source_fill(source_t *source) {
+  while (f_source_step(source)) {
+    if (source->word_count - source->word_index >= SOURCE_WINDOW && !f_source_is_pending(source)) {
+      break;
+    }
+  }
+}
+
+void f_source_load(source_t *source, const char *path) {
+  source->is_lexer_kept = (source->lexer != NULL);
+  
+  if (!source->is_lexer_kept) {
+    source->lexer = malloc(sizeof(lexer_t));
+    
+    // Threads would lex every header ahead of time, so streamed sources only lex files as they get spliced.
+    f_lexer_init(source->lexer, (source->is_streaming ? 1 : source->thread_count), source->cache_path);
   }
   
-  fclose(file);
+  f_source_open(source, path);
+  
+  if (!source->frame_count) {
+    f_source_done(source);
+  } else if (!source->is_streaming) {
+    // Streamed sources get spliced as the parser goes instead, through f_source_peek().
+    while (f_source_step(source));
+  }
+}
+
+// Type of the word at the cursor, or w_invalid at the end of the source.
+
+int f_source_peek(source_t *source) {
+  if (source->word_index == source->word_count) {
+    f_source_fill(source);
+  }
+  
+  if (source->word_index == source->word_count) {
+    return w_invalid;
+  }
+  
+  return source->word_types[source->word_index - source->word_base];
+}
+
+// Lets go of every word before the cursor (but the last one, which errors might still point at), once the
+// parser is done with a whole top-level statement. Only streamed sources release words, and they only get
+// moved back once the released ones outnumber the ones left, so it all stays linear.
+
+void f_source_release(source_t *source) {
+  if (!source->is_streaming || source->word_index - 1 <= source->word_base) {
+    return;
+  }
+  
+  int first = source->word_index - 1;
+  int count = source->word_count - first;
+  
+  if (first - source->word_base < count) {
+    return;
+  }
+  
+  int value_first = source->value_index;
+  
+  if (f_word_has_value(source->word_types[first - source->word_base])) {
+    value_first--;
+  }
+  
+  int value_count = source->value_count - value_first;
+  
+  memmove(source->word_types, source->word_types + (first - source->word_base), count * sizeof(uint8_t));
+  memmove(source->word_offsets, source->word_offsets + (first - source->word_base), count * sizeof(uint32_t));
+  memmove(source->values, source->values + (value_first - source->value_base), value_count * sizeof(value_t));
+  
+  source->word_base = first;
+  source->value_base = value_first;
 }
@@ -0,0 +1,71 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rtbc.h>
+
+#define TABLE_MIN_SLOTS 256
+
+// Atoms are dense, so slots are just an array indexed by them. Old slot arrays are left in the arena, which
+// is fine as they only ever double in size.
+
+static void f_table_grow(arena_t *arena, table_t *table, uint32_t atom) {
+  int capacity = (table->slot_capacity ? table->slot_capacity : TABLE_MIN_SLOTS);
+  
+  while ((uint32_t)(capacity) <= atom) {
+    capacity *= 2;
+  }
+  
+  int *slots = f_arena_alloc(arena, capacity * sizeof(int));
+  
+  if (table->slot_capacity) {
+    memcpy(slots, table->slots, table->slot_capacity * sizeof(int));
+  }
+  
+  memset(slots + table->slot_capacity, 0xFF, (capacity - table->slot_capacity) * sizeof(int));
+  
+  table->slots = slots;
+  table->slot_capacity = capacity;
+}
+
+// Value of the innermost binding of an atom, -1 if there is none.
+
+int f_table_find(const table_t *table, uint32_t atom) {
+  if (atom >= (uint32_t)(table->slot_capacity) || table->slots[atom] < 0) {
+    return -1;
+  }
+  
+  return table->binds[table->slots[atom]].value;
+}
+
+// Binds an atom to a (non-negative) value, hiding whatever it was bound to until the scope gets popped.
+
+void f_table_bind(arena_t *arena, table_t *table, uint32_t atom, int value) {
+  if (atom >= (uint32_t)(table->slot_capacity)) {
+    f_table_grow(arena, table, atom);
+  }
+  
+  table->binds = f_arena_reserve(arena, table->binds, table->bind_count + 1, &table->bind_capacity, sizeof(table_bind_t));
+  
+  table->binds[table->bind_count] = (table_bind_t){
+    .atom = atom,
+    
+    .value = value,
+    .shadow = table->slots[atom],
+  };
+  
+  table->slots[atom] = table->bind_count++;
+}
+
+// Scopes are just the number of bindings at the time, so popping one undoes every binding made since.
+
+int f_table_scope(const table_t *table) {
+  return table->bind_count;
+}
+
+void f_table_pop(table_t *table, int scope) {
+  while (table->bind_count > scope) {
+    const table_bind_t *bind = table->binds + (--table->bind_count);
+    table->slots[bind->atom] = bind->shadow;
+  }
+}
@@ -0,0 +1,41 @@
+[bits 32]
+
+; Calls a routine the way rtbc does: arguments pushed in order, then ebp around the call. Registers C wants
+; kept get saved here, as routines only keep ebp.
+;   uint32_t tbcall(void *routine, int count, const uint32_t *words);
+
+global tbcall
+
+section .bss
+
+saved_esp:
+  resd 1
+
+section .text
+
+tbcall:
+  push ebp
+  push ebx
+  push esi
+  push edi
+  mov eax, [esp + 20]
+  mov ecx, [esp + 24]
+  mov edx, [esp + 28]
+  mov [saved_esp], esp
+  xor esi, esi
+.PUSH:
+  cmp esi, ecx
+  jge .CALL
+  push dword [edx + esi * 4]
+  inc esi
+  jmp .PUSH
+.CALL:
+  push ebp
+  call eax
+  pop ebp
+  mov esp, [saved_esp]
+  pop edi
+  pop esi
+  pop ebx
+  pop ebp
+  ret
@@ -0,0 +1,22 @@
+# Turns the "# NAME(word, ...) = result" comments of a .tbc file into a case_t table (see tests/driver.c).
+
+/^# *[A-Za-z_][A-Za-z_0-9]*\(.*\) *= *[-0-9x]/ {
+  line = $0
+  sub(/^# */, "", line)
+  name = toupper(substr(line, 1, index(line, "(") - 1))
+  args = substr(line, index(line, "(") + 1)
+  result = args
+  sub(/\).*/, "", args)
+  sub(/.*= */, "", result)
+  count = (args ~ /[^ ]/ ? split(args, list, ",") : 0)
+  if (!(name in declared)) {
+    declared[name] = 1
+    externs = externs "extern char " name "[];\n"
+  }
+  gsub(/"/, "", line)
+  cases = cases sprintf("  {\"%s\", %s, %d, {%s}, (uint32_t)(%s)},\n", line, name, count, args, result)
+}
+
+END {
+  printf("%s\nstatic const case_t cases[] = {\n%s};\n", externs, cases)
+}
@@ -0,0 +1,66 @@
+// Runs every case in cases.h (generated by run.sh) against the compiled routines, printing the ones that do not
+// return what they should. Freestanding, so it links with nothing but the routines and tbcall.
+
+#include <stdint.h>
+
+typedef struct case_t case_t;
+
+struct case_t {
+  const char *text;
+  void *routine;
+  
+  int word_count;
+  uint32_t words[8];
+  
+  uint32_t result;
+};
+
+uint32_t tbcall(void *routine, int count, const uint32_t *words);
+
+#include "cases.h"
+
+static void f_write(const char *text) {
+  int length = 0;
+  
+  while (text[length]) {
+    length++;
+  }
+  
+  int call = 4; // write(), which returns in eax.
+  __asm__ volatile("int $0x80" : "+a"(call) : "b"(1), "c"(text), "d"(length) : "memory");
+}
+
+static void f_write_u32(uint32_t value) {
+  char buffer[16];
+  int i = sizeof(buffer) - 1;
+  
+  buffer[i] = '\0';
+  
+  do {
+    buffer[--i] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  
+  f_write(buffer + i);
+}
+
+void _start(void) {
+  int fail_count = 0;
+  
+  for (unsigned i = 0; i < sizeof(cases) / sizeof(case_t); i++) {
+    uint32_t result = tbcall(cases[i].routine, cases[i].word_count, cases[i].words);
+    
+    if (result != cases[i].result) {
+      f_write("FAIL ");
+      f_write(cases[i].text);
+      f_write(", got ");
+      f_write_u32(result);
+      f_write("\n");
+      
+      fail_count++;
+    }
+  }
+  
+  __asm__ volatile("int $0x80" : : "a"(1), "b"(fail_count));
+  __builtin_unreachable();
+}
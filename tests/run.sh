@@ -0,0 +1,47 @@
+#!/usr/bin/sh
+# Compiles every tests/*.tbc and runs the cases in its comments, which read
+#   # NAME(word, ...) = result
+# calling NAME with those 32-bit words pushed as arguments, and comparing what it returns in eax. Needs nasm and
+# a gcc that can target i386:
+#   sh tests/run.sh [file.tbc ...]
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gcc "$root"/*.c -I"$root/include" -O1 -pthread -o "$work/rtbc"
+nasm -f elf32 "$root/tests/call.asm" -o "$work/call.o"
+
+if [ $# -eq 0 ]; then
+  set -- "$root"/tests/*.tbc
+fi
+
+status=0
+
+for file in "$@"; do
+  name=$(basename "$file" .tbc)
+  mkdir -p "$work/$name"
+  cp "$file" "$work/$name/test.tbc"
+  
+  if ! (cd "$work/$name" && "$work/rtbc" > test.asm); then
+    echo "$name: does not compile"
+    status=1
+    continue
+  fi
+  
+  awk -f "$root/tests/cases.awk" "$file" > "$work/$name/cases.h"
+  
+  nasm -f elf32 "$work/$name/test.asm" -o "$work/$name/test.o"
+  gcc -m32 -ffreestanding -fno-pic -fno-stack-protector -nostdlib -static -I"$work/$name" \
+    "$root/tests/driver.c" "$work/$name/test.o" "$work/call.o" -o "$work/$name/test"
+  
+  if "$work/$name/test"; then
+    echo "$name: ok"
+  else
+    echo "$name: failed"
+    status=1
+  fi
+done
+
+exit $status
@@ -0,0 +1,471 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <rtbc.h>
+
+// Watch mode: compiles a source over and over, every time one of its files changes. Lexed units are kept
+// around between compiles (only the changed files get lexed again), and so is the output of every top-level
+// statement, so code only gets generated again for statements whose words changed.
+
+#define WATCH_QUIET 50 // Milliseconds without changes to wait for before compiling again (editors save in bursts).
+
+typedef struct watch_t watch_t;
+
+struct watch_t {
+  int handle;       // inotify watch on the directory of the file.
+  char *path;       // Canonical path of the unit, as the lexer knows it.
+  const char *base; // File name within the directory, to match events against.
+};
+
+// Hashes 8 bytes at a time, as most of what gets hashed are 16-byte values. Passing no data returns the
+// initial hash.
+
+uint64_t f_replay_hash(uint64_t hash, const void *data, size_t length) {
+  const uint8_t *bytes = data;
+  
+  if (!bytes) {
+    return 14695981039346656037u;
+  }
+  
+  for (; length >= 8; bytes += 8, length -= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, bytes, 8);
+    
+    hash = (hash ^ chunk) * 0x9E3779B97F4A7C15u;
+    hash ^= hash >> 32;
+  }
+  
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211u;
+  }
+  
+  return hash;
+}
+
+static size_t f_replay_slot(const replay_t *replay, uint64_t hash) {
+  uint64_t key = hash * 0x9E3779B97F4A7C15u;
+  return (size_t)(key >> 32) & (replay->slot_capacity - 1);
+}
+
+static int f_replay_is(const replay_entry_t *entry, uint64_t hash) {
+  return (entry->hash == hash);
+}
+
+static replay_entry_t *f_replay_push(replay_entry_t *entries, int *count, int *capacity, replay_entry_t entry) {
+  if (*count == *capacity) {
+    *capacity = (*capacity ? *capacity * 2 : 256);
+    entries = realloc(entries, *capacity * sizeof(replay_entry_t));
+  }
+  
+  entries[(*count)++] = entry;
+  return entries;
+}
+
+static void f_replay_next(replay_t *replay, replay_entry_t entry) {
+  replay->next_entries = f_replay_push(replay->next_entries, &(replay->next_count), &(replay->next_capacity), entry);
+}
+
+// Looks up the output of a statement from the last compile, keeping it for the next one.
+
+replay_entry_t *f_replay_find(replay_t *replay, uint64_t hash) {
+  if (!replay->entry_count) {
+    return NULL;
+  }
+  
+  int index = replay->cursor;
+  
+  if (index >= replay->entry_count || !f_replay_is(replay->entries + index, hash)) {
+    size_t slot = f_replay_slot(replay, hash);
+    
+    for (;;) {
+      if (!replay->slots[slot]) {
+        return NULL;
+      }
+      
+      index = replay->slots[slot] - 1;
+      
+      if (f_replay_is(replay->entries + index, hash)) {
+        break;
+      }
+      
+      slot = (slot + 1) & (replay->slot_capacity - 1);
+    }
+  }
+  
+  replay_entry_t *entry = replay->entries + index;
+  
+  entry->is_used = 1;
+  replay->cursor = index + 1;
+  
+  f_replay_next(replay, *entry);
+  return entry;
+}
+
+// Keeps the output of a statement for the next compile (text must come from malloc(), and gets owned by
+// the replay). Globals get copied along with the signatures of routines (but not their bodies, replayed
+// routines never get inlined), all in a single block.
+
+void f_replay_add(replay_t *replay, uint64_t hash, char *text, size_t length, const entry_t *globals, int global_count) {
+  entry_t *global_copy = NULL;
+  
+  if (global_count) {
+    size_t size = global_count * sizeof(entry_t);
+    
+    for (int i = 0; i < global_count; i++) {
+      if (globals[i].routine) {
+        size += sizeof(routine_t) + globals[i].routine->arg_count * (sizeof(type_t) + sizeof(int));
+      }
+    }
+    
+    global_copy = malloc(size);
+    memcpy(global_copy, globals, global_count * sizeof(entry_t));
+    
+    char *next = (char *)(global_copy + global_count);
+    
+    for (int i = 0; i < global_count; i++) {
+      const routine_t *routine = globals[i].routine;
+      
+      if (!routine) {
+        continue;
+      }
+      
+      routine_t *routine_copy = (routine_t *)(next);
+      next += sizeof(routine_t);
+      
+      *routine_copy = (routine_t){
+        .arg_types = (type_t *)(next),
+        .arg_offsets = (int *)(next + routine->arg_count * sizeof(type_t)),
+        .arg_count = routine->arg_count,
+        .arg_size = routine->arg_size,
+        
+        .state = routine_declared,
+        .word_index = 0,
+        .value_index = 0,
+        .local_size = 0,
+        
+        .body = NULL,
+      };
+      
+      memcpy(routine_copy->arg_types, routine->arg_types, routine->arg_count * sizeof(type_t));
+      memcpy(routine_copy->arg_offsets, routine->arg_offsets, routine->arg_count * sizeof(int));
+      
+      next += routine->arg_count * (sizeof(type_t) + sizeof(int));
+      global_copy[i].routine = routine_copy;
+    }
+  }
+  
+  f_replay_next(replay, (replay_entry_t){
+    .hash = hash,
+    
+    .text = text,
+    .length = length,
+    
+    .globals = global_copy,
+    .global_count = global_count,
+    
+    .is_used = 0,
+    .is_new = 1,
+  });
+}
+
+// Once a compile is done, its statements replace the ones from the last compile (and if it did not make it
+// through, the new ones just get added to them instead, as it stopped halfway).
+
+static void f_replay_done(replay_t *replay, int is_complete) {
+  if (is_complete) {
+    for (int i = 0; i < replay->entry_count; i++) {
+      if (!replay->entries[i].is_used) {
+        free(replay->entries[i].text);
+        free(replay->entries[i].globals);
+      }
+    }
+    
+    replay_entry_t *entries = replay->entries;
+    int capacity = replay->entry_capacity;
+    
+    replay->entries = replay->next_entries;
+    replay->entry_count = replay->next_count;
+    replay->entry_capacity = replay->next_capacity;
+    
+    replay->next_entries = entries;
+    replay->next_capacity = capacity;
+  } else {
+    for (int i = 0; i < replay->next_count; i++) {
+      if (!replay->next_entries[i].is_new) {
+        continue;
+      }
+      
+      replay->entries = f_replay_push(replay->entries, &(replay->entry_count), &(replay->entry_capacity), replay->next_entries[i]);
+    }
+  }
+  
+  replay->next_count = 0;
+  replay->cursor = 0;
+  
+  replay->slot_capacity = 64;
+  
+  while (replay->slot_capacity < replay->entry_count * 2) {
+    replay->slot_capacity *= 2;
+  }
+  
+  free(replay->slots);
+  replay->slots = calloc(replay->slot_capacity, sizeof(int));
+  
+  for (int i = 0; i < replay->entry_count; i++) {
+    replay_entry_t *entry = replay->entries + i;
+    
+    entry->is_used = 0;
+    entry->is_new = 0;
+    
+    size_t slot = f_replay_slot(replay, entry->hash);
+    
+    while (replay->slots[slot]) {
+      slot = (slot + 1) & (replay->slot_capacity - 1);
+    }
+    
+    replay->slots[slot] = i + 1;
+  }
+}
+
+static double f_watch_time(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  
+  return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+// Writes the whole output at once, through a temporary file, so whatever reads it never sees half of it.
+
+static int f_watch_write(const char *output_path, const char *text, size_t length) {
+  size_t temp_length = strlen(output_path) + 8;
+  char *temp_path = malloc(temp_length);
+  
+  snprintf(temp_path, temp_length, "%s.XXXXXX", output_path);
+  int fd = mkstemp(temp_path);
+  
+  if (fd < 0) {
+    free(temp_path);
+    return 0;
+  }
+  
+  int is_written = (write(fd, text, length) == (ssize_t)(length));
+  close(fd);
+  
+  if (!is_written || rename(temp_path, output_path)) {
+    unlink(temp_path);
+    is_written = 0;
+  }
+  
+  free(temp_path);
+  return is_written;
+}
+
+static void f_watch_compile(const arch_t *arch, const source_t *base, lexer_t *lexer, replay_t *replay, const char *path, const char *output_path) {
+  double start = f_watch_time();
+  
+  arena_t arena = (arena_t){
+    .chunk = NULL,
+    .large = NULL,
+    .chunk_length = 0,
+    
+    .allocated = 0,
+    .reserved = 0,
+  };
+  
+  source_t source = *base;
+  
+  source.arena = &arena;
+  source.lexer = lexer;
+  source.is_streaming = 0; // Statements need all their words around to be hashed.
+  
+  char *text = NULL;
+  size_t length = 0;
+  
+  FILE *output = open_memstream(&text, &length);
+  jmp_buf jump;
+  
+  replay->hit_count = 0;
+  replay->statement_count = 0;
+  
+  if (!setjmp(jump)) {
+    f_error_jump = &jump;
+    f_output = output;
+    
+    f_source_load(&source, path);
+    f_source_pack(&source);
+    f_parse_root(arch, &source, replay, NULL, NULL, 1);
+    
+    fclose(output);
+    
+    f_replay_done(replay, 1);
+    
+    if (!f_watch_write(output_path, text, length)) {
+      fprintf(stderr, "Cannot write to '%s'.\n", output_path);
+    } else {
+      fprintf(stderr, "Compiled '%s' in %.2fms (%d out of %d statements reused).\n", path, f_watch_time() - start,
+              replay->hit_count, replay->statement_count);
+    }
+  } else {
+    if (replay->stream) {
+      fclose(replay->stream);
+      free(replay->stream_text);
+      
+      replay->stream = NULL;
+      replay->stream_text = NULL;
+    }
+    
+    f_replay_done(replay, 0);
+    
+    fclose(output);
+    fprintf(stderr, "Waiting for changes...\n");
+  }
+  
+  f_error_jump = NULL;
+  f_output = NULL;
+  
+  free(text);
+  f_arena_free(&arena);
+}
+
+// Watches the directory of every file the lexer knows about (as editors tend to replace files instead of
+// writing to them), adding the ones not watched yet.
+
+static void f_watch_add(int fd, lexer_t *lexer, watch_t **watches, int *watch_count) {
+  pthread_mutex_lock(&(lexer->lock));
+  
+  for (int i = 0; i < lexer->unit_count; i++) {
+    const char *path = lexer->units[i]->path;
+    int is_watched = 0;
+    
+    for (int j = 0; j < *watch_count; j++) {
+      if (!strcmp((*watches)[j].path, path)) {
+        is_watched = 1;
+        break;
+      }
+    }
+    
+    if (is_watched) {
+      continue;
+    }
+    
+    // Files that could not be found when lexed keep the path they were written with, which might not have
+    // a directory in it.
+    
+    const char *base = strrchr(path, '/');
+    char *dir = (base ? strndup(path, (base > path ? base - path : 1)) : strdup("."));
+    int handle = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+    
+    free(dir);
+    
+    if (handle < 0) {
+      continue;
+    }
+    
+    char *watch_path = strdup(path);
+    
+    *watches = realloc(*watches, (*watch_count + 1) * sizeof(watch_t));
+    
+    (*watches)[(*watch_count)++] = (watch_t){
+      .handle = handle,
+      .path = watch_path,
+      .base = (base ? watch_path + (base - path) + 1 : watch_path),
+    };
+  }
+  
+  pthread_mutex_unlock(&(lexer->lock));
+}
+
+// Waits for any watched file to change, dropping the units of the ones that did, then waits until things
+// have been quiet for a while.
+
+static void f_watch_wait(int fd, lexer_t *lexer, const watch_t *watches, int watch_count) {
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int is_changed = 0;
+  
+  for (;;) {
+    struct pollfd poll_fd = (struct pollfd){
+      .fd = fd,
+      .events = POLLIN,
+      .revents = 0,
+    };
+    
+    if (poll(&poll_fd, 1, (is_changed ? WATCH_QUIET : -1)) <= 0) {
+      if (is_changed) {
+        return;
+      }
+      
+      continue;
+    }
+    
+    ssize_t length = read(fd, buffer, sizeof(buffer));
+    
+    for (ssize_t i = 0; i < length;) {
+      const struct inotify_event *event = (const struct inotify_event *)(buffer + i);
+      i += sizeof(struct inotify_event) + event->len;
+      
+      if (!event->len) {
+        continue;
+      }
+      
+      for (int j = 0; j < watch_count; j++) {
+        if (watches[j].handle == event->wd && !strcmp(watches[j].base, event->name)) {
+          f_debug("File '%s': changed.\n", watches[j].path);
+          f_lexer_touch(lexer, watches[j].path);
+          
+          is_changed = 1;
+        }
+      }
+    }
+  }
+}
+
+// Never returns. Sources are loaded as set up in source (other than its arena, lexer and streaming), and
+// compiled into output_path.
+
+void f_watch(const arch_t *arch, const source_t *source, const char *path, const char *output_path) {
+  int fd = inotify_init1(IN_CLOEXEC);
+  
+  if (fd < 0) {
+    f_error("Cannot watch for changes.\n");
+  }
+  
+  lexer_t lexer;
+  f_lexer_init(&lexer, source->thread_count, source->cache_path);
+  
+  replay_t replay = (replay_t){
+    .entries = NULL,
+    .entry_count = 0,
+    .entry_capacity = 0,
+    
+    .slots = NULL,
+    .slot_capacity = 0,
+    
+    .next_entries = NULL,
+    .next_count = 0,
+    .next_capacity = 0,
+    
+    .cursor = 0,
+    .hit_count = 0,
+    .statement_count = 0,
+    
+    .stream = NULL,
+    .stream_text = NULL,
+    .stream_length = 0,
+  };
+  
+  watch_t *watches = NULL;
+  int watch_count = 0;
+  
+  for (;;) {
+    f_watch_compile(arch, source, &lexer, &replay, path, output_path);
+    
+    f_watch_add(fd, &lexer, &watches, &watch_count);
+    f_watch_wait(fd, &lexer, watches, watch_count);
+  }
+}